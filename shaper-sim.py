@@ -0,0 +1,126 @@
+#!/usr/bin/env python
+"""\
+Simulate the input shaper of the Stepper on a frame that rings
+
+The speed along the path is shaped the way Stepper::shape_speed does it, one
+value per acceleration tick, and drives a damped oscillator on each axis. The
+largest vibration once the motors have stopped, or once past a corner, is
+printed for each shaper.
+
+The shaper works on the speed along the path, so it cancels the ringing of
+accelerations and decelerations. The change of direction at a corner is not
+shaped : the axis that stops there rings as much as without a shaper.
+"""
+
+from __future__ import print_function
+import math
+import argparse
+
+parser = argparse.ArgumentParser(description='Residual vibration of shaped moves.')
+parser.add_argument('-f', '--frequency', type=float, default=50.0,
+        help='ringing frequency of the frame in Hz')
+parser.add_argument('-d', '--damping', type=float, default=0.1,
+        help='damping ratio of the ringing')
+parser.add_argument('-a', '--acceleration', type=float, default=3000.0,
+        help='acceleration in mm/s^2')
+parser.add_argument('-s', '--speed', type=float, default=150.0,
+        help='feed rate in mm/s')
+parser.add_argument('-j', '--junction', type=float, default=20.0,
+        help='speed through the corner in mm/s')
+parser.add_argument('-t', '--ticks', type=int, default=1000,
+        help='acceleration_ticks_per_second')
+parser.add_argument('-e', '--error', type=float, default=0.0,
+        help='error on the shaper frequency, as a fraction, to check robustness')
+args = parser.parse_args()
+
+def shaper(kind, frequency, damping, ticks):
+    """Amplitudes and delays in ticks, as in Stepper::configure_input_shaper"""
+    if kind == 'none':
+        return [1.0], [0]
+    period = 1.0 / (frequency * math.sqrt(1.0 - damping * damping))
+    k = math.exp(-damping * math.pi / math.sqrt(1.0 - damping * damping))
+    times = [0.0, period / 2.0, period]
+    if kind == 'zv':
+        amplitudes = [1.0, k]
+    elif kind == 'zvd':
+        amplitudes = [1.0, 2.0 * k, k * k]
+    else:
+        tolerance = 0.05
+        amplitudes = [0.25 * (1.0 + tolerance), 0.5 * (1.0 - tolerance) * k, 0.25 * (1.0 + tolerance) * k * k]
+    total = sum(amplitudes)
+    return [a / total for a in amplitudes], [int(round(t * ticks)) for t in times[:len(amplitudes)]]
+
+def path_speed(length, speed, acceleration, start, end, ticks):
+    """Speed asked for by the trapezoid generator at each tick, in mm/s"""
+    speeds = []
+    position = 0.0
+    v = start
+    dv = acceleration / ticks
+    while position < length:
+        decelerate = (v * v - end * end) / (2.0 * acceleration) >= length - position
+        if decelerate:
+            v = max(end, v - dv)
+        else:
+            v = min(speed, v + dv)
+        v = max(v, dv)
+        position += v / ticks
+        speeds.append(v)
+    return speeds
+
+def vibration(velocities, frequency, damping, ticks, after):
+    """Largest vibration amplitude of a damped oscillator, from the given tick on, when its base moves at these speeds held for a tick"""
+    w = 2.0 * math.pi * frequency
+    wd = w * math.sqrt(1.0 - damping * damping)
+    dt = 1.0 / ticks
+    e = math.exp(-damping * w * dt)
+    c, s = math.cos(wd * dt), math.sin(wd * dt)
+    y, vy = 0.0, 0.0
+    previous = 0.0
+    largest = 0.0
+    for i, v in enumerate(velocities + [0.0] * ticks):
+        # A change of base speed kicks the relative speed of the frame
+        vy -= v - previous
+        previous = v
+        if i >= after:
+            largest = max(largest, math.sqrt(y * y + ((vy + damping * w * y) / wd) ** 2))
+        # Free damped oscillation over the tick
+        y, vy = (e * (y * c + (vy + damping * w * y) / wd * s),
+                 e * (vy * c - (damping * w * vy + w * w * y) / wd * s))
+    return largest * 1000.0
+
+def shape(speeds, amplitudes, delays):
+    history = speeds + [0.0] * delays[-1]
+    return [sum(a * (history[i - d] if i >= d else 0.0) for a, d in zip(amplitudes, delays)) for i in range(len(history))]
+
+ticks = args.ticks
+print("Frame ringing at %gHz, damping %g, %g mm/s^2, %d ticks per second" % (args.frequency, args.damping, args.acceleration, ticks))
+print("Largest vibration in microns once the motors stop, and after the corner")
+print("%-6s %12s %12s %12s" % ("shaper", "straight", "corner X", "corner Y"))
+
+for kind in ['none', 'zv', 'zvd', 'ei']:
+    amplitudes, delays = shaper(kind, args.frequency * (1.0 + args.error), args.damping, ticks)
+
+    # A straight 50mm move along X, from and to a stop
+    straight = shape(path_speed(50.0, args.speed, args.acceleration, 0.0, 0.0, ticks), amplitudes, delays)
+
+    # 30mm along X then 30mm along Y, through the corner at the junction speed
+    # The shaped speed carries on along X until the motors have done the first block, then turns to Y at once
+    first = path_speed(30.0, args.speed, args.acceleration, 0.0, args.junction, ticks)
+    second = path_speed(30.0, args.speed, args.acceleration, args.junction, 0.0, ticks)
+    corner = shape(first + second, amplitudes, delays)
+    x, y, distance, turn = [], [], 0.0, None
+    for i, v in enumerate(corner):
+        distance += v / ticks
+        if distance <= 30.0:
+            x.append(v)
+            y.append(0.0)
+        else:
+            if turn is None:
+                turn = i
+            x.append(0.0)
+            y.append(v)
+
+    print("%-6s %12.2f %12.2f %12.2f" % (kind,
+        vibration(straight, args.frequency, args.damping, ticks, len(straight)),
+        vibration(x, args.frequency, args.damping, ticks, turn),
+        vibration(y, args.frequency, args.damping, ticks, len(y))))
@@ -10,7 +10,7 @@
 #include "libs/Kernel.h"
 #include "libs/Pin.h"
 #include "libs/ADC/adc.h"
-#include "libs/Pin.h"
+#include "platform_memory.h"
 
 
 using namespace std;
@@ -18,8 +18,66 @@ using namespace std;
 // This is an interface to the mbed.org ADC library you can find in libs/ADC/adc.h
 // TODO : Having the same name is confusing, should change that
 
+// Linked list items the DMA channel goes through, one per row of samples, the last one links back to the first so it never stops
+struct AdcDmaLli {
+    uint32_t source;
+    uint32_t destination;
+    uint32_t next;
+    uint32_t control;
+};
+
+// Lowest priority GPDMA channel
+#define ADC_DMA_CHANNEL LPC_GPDMACH7
+#define ADC_DMA_CHANNEL_BIT (1 << 7)
+
 Adc::Adc(){
+    for( int i = 0; i < ADC_CHANNELS; i++ ){
+        this->last_value[i] = 0;
+        this->last_average[i] = 0;
+    }
     this->adc = new ADC(1000, 1);
+    this->start_dma();
+}
+
+// The DMA has to reach the samples and the linked list, so they go to AHB SRAM
+// If there is no room there, the ADC interrupt keeps the last conversion of each channel as before
+// The DMA request follows the ADC interrupt flag, which is only cleared by reading the channel data registers
+// So each request copies all of ADDR0 to ADDR7, not the global data register, and the request drops until the next conversion
+void Adc::start_dma(){
+    this->samples = (uint32_t*)AHB0.alloc(ADC_DMA_ROWS * ADC_CHANNELS * sizeof(uint32_t));
+    AdcDmaLli* lli = (AdcDmaLli*)AHB0.alloc(ADC_DMA_ROWS * sizeof(AdcDmaLli));
+    if( this->samples == NULL || lli == NULL ){
+        if( lli != NULL ){ AHB0.dealloc(lli); }
+        if( this->samples != NULL ){ AHB0.dealloc((void*)this->samples); }
+        this->samples = NULL;
+        return;
+    }
+    for( int i = 0; i < ADC_DMA_ROWS * ADC_CHANNELS; i++ ){
+        this->samples[i] = 0;
+    }
+
+    // Bursts of eight words from incrementing registers to incrementing memory, no terminal count interrupt
+    uint32_t control = ADC_CHANNELS | ( 2 << 12 ) | ( 2 << 15 ) | ( 2 << 18 ) | ( 2 << 21 ) | ( 1 << 26 ) | ( 1 << 27 );
+    for( int row = 0; row < ADC_DMA_ROWS; row++ ){
+        lli[row].source      = (uint32_t)&LPC_ADC->ADDR0;
+        lli[row].destination = (uint32_t)&this->samples[row * ADC_CHANNELS];
+        lli[row].next        = (uint32_t)&lli[( row + 1 ) % ADC_DMA_ROWS];
+        lli[row].control     = control;
+    }
+
+    LPC_SC->PCONP |= ( 1 << 29 );
+    LPC_GPDMA->DMACConfig = 1;
+    ADC_DMA_CHANNEL->DMACCConfig = 0;
+    LPC_GPDMA->DMACIntTCClear = ADC_DMA_CHANNEL_BIT;
+    LPC_GPDMA->DMACIntErrClr = ADC_DMA_CHANNEL_BIT;
+
+    ADC_DMA_CHANNEL->DMACCSrcAddr  = lli[0].source;
+    ADC_DMA_CHANNEL->DMACCDestAddr = lli[0].destination;
+    ADC_DMA_CHANNEL->DMACCLLI      = lli[0].next;
+    ADC_DMA_CHANNEL->DMACCControl  = control;
+
+    // Enabled, the ADC ( peripheral 4 ) as source, peripheral to memory
+    ADC_DMA_CHANNEL->DMACCConfig = 1 | ( 4 << 1 ) | ( 2 << 11 );
 }
 
 // Enables ADC on a given pin
@@ -28,11 +86,72 @@ void Adc::enable_pin(Pin* pin){
     this->adc->burst(1);
     this->adc->setup(pin_name,1);
     this->adc->interrupt_state(pin_name,1);
+
+    // The channel's interrupt enable still requests the DMA, but the CPU is not interrupted any more
+    if( this->samples != NULL ){
+        NVIC_DisableIRQ(ADC_IRQn);
+    }
 }
 
 // Read the last value ( burst mode ) on a given pin
 unsigned int Adc::read(Pin* pin){
-    return this->adc->read(this->_pin_to_pinname(pin));
+    if( this->samples == NULL ){
+        return this->adc->read(this->_pin_to_pinname(pin));
+    }
+
+    int chan = this->_pin_to_channel(pin);
+    if( chan < 0 ){ return 0; }
+
+    // Look back from where the DMA is writing, through this channel's ring, for its last conversion
+    int i = ( ADC_DMA_CHANNEL->DMACCDestAddr - (uint32_t)this->samples ) / sizeof(uint32_t);
+    int row = i / ADC_CHANNELS;
+    if( i % ADC_CHANNELS <= chan ){
+        row = ( row == 0 ) ? ADC_DMA_ROWS - 1 : row - 1;
+    }
+    for( int n = 0; n < ADC_DMA_ROWS; n++ ){
+        uint32_t sample = this->samples[row * ADC_CHANNELS + chan];
+        if( sample & ( 1UL << 31 ) ){
+            this->last_value[chan] = ( sample >> 4 ) & 0xFFF;
+            break;
+        }
+        row = ( row == 0 ) ? ADC_DMA_ROWS - 1 : row - 1;
+    }
+    return this->last_value[chan];
+}
+
+// Average of the conversions the DMA kept for this pin, with ADC_OVERSAMPLE_SHIFT more bits than read()
+// Burst mode converts much faster than readings are taken, so averaging adds resolution for free
+unsigned int Adc::read_average(Pin* pin){
+    int chan = this->_pin_to_channel(pin);
+    if( this->samples == NULL || chan < 0 ){
+        return this->read(pin) << ADC_OVERSAMPLE_SHIFT;
+    }
+
+    uint32_t sum = 0;
+    uint32_t count = 0;
+    for( int row = 0; row < ADC_DMA_ROWS; row++ ){
+        uint32_t sample = this->samples[row * ADC_CHANNELS + chan];
+        if( sample & ( 1UL << 31 ) ){
+            sum += ( sample >> 4 ) & 0xFFF;
+            count++;
+        }
+    }
+
+    if( count > 0 ){
+        this->last_average[chan] = ( ( sum << ADC_OVERSAMPLE_SHIFT ) + count / 2 ) / count;
+    }else if( this->last_average[chan] == 0 ){
+        this->last_average[chan] = this->read(pin) << ADC_OVERSAMPLE_SHIFT;
+    }
+    return this->last_average[chan];
+}
+
+int Adc::_pin_to_channel(Pin* pin){
+    PinName pin_name = this->_pin_to_pinname(pin);
+    if( pin_name == NC ){ return -1; }
+    for( int chan = 0; chan < 6; chan++ ){
+        if( this->adc->channel_to_pin(chan) == pin_name ){ return chan; }
+    }
+    return -1;
 }
 
 // Convert a smoothie Pin into a mBed Pin
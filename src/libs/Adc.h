@@ -14,6 +14,10 @@
 #include "PinNames.h" // mbed.h lib
 #include "libs/ADC/adc.h"
 
+#define ADC_OVERSAMPLE_SHIFT 4  // Averaged readings have this many more bits than the 12 bit ADC
+#define ADC_CHANNELS         8   // ADDR0 to ADDR7, copied in one go by the DMA
+#define ADC_DMA_ROWS         64  // Copies of the channel registers kept by the DMA, one per conversion, about 10ms worth
+
 class Pin;
 
 class Adc : public Module{
@@ -21,9 +25,22 @@ class Adc : public Module{
         Adc();
         void enable_pin(Pin* pin);
         unsigned int read(Pin* pin);
+        unsigned int read_average(Pin* pin);
         PinName _pin_to_pinname(Pin* pin);
+        int _pin_to_channel(Pin* pin);
 
         ADC* adc;
+
+    private:
+        void start_dma();
+
+        // After every conversion the DMA copies all the channel data registers here, as they are, round and round
+        // So each channel has its own ring of samples, those with the DONE bit set are new conversions
+        volatile uint32_t* samples;
+
+        // Last good reading of each channel, returned while the samples have none, so a heater never sees a 0
+        uint16_t last_value[ADC_CHANNELS];
+        uint32_t last_average[ADC_CHANNELS];
 };
 
 
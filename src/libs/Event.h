@@ -4,9 +4,9 @@ EVENT(ON_MAIN_LOOP, on_main_loop)
 EVENT(ON_CONSOLE_LINE_RECEIVED, on_console_line_received)
 EVENT(ON_GCODE_RECEIVED, on_gcode_received)
 EVENT(ON_GCODE_EXECUTE, on_gcode_execute)
-EVENT(ON_SPEED_CHANGE, on_speed_change)
 EVENT(ON_BLOCK_BEGIN, on_block_begin)
 EVENT(ON_BLOCK_END, on_block_end)
+EVENT(ON_QUEUE_FLUSH, on_queue_flush)
 EVENT(ON_CONFIG_RELOAD, on_config_reload)
 EVENT(ON_PLAY, on_play)
 EVENT(ON_PAUSE, on_pause)
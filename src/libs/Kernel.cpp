@@ -100,6 +100,11 @@ Kernel::Kernel(){
     NVIC_SetPriority(TIMER1_IRQn, 1);
     NVIC_SetPriority(TIMER2_IRQn, 3);
 
+    // Endstop and probe pins stop motors from their interrupt, so it must not preempt a step tick
+    // Their debounce is timed by the microsecond ticker, whose interrupt then calls the same hooks
+    NVIC_SetPriority(EINT3_IRQn, 2);
+    NVIC_SetPriority(TIMER3_IRQn, 2);
+
     // Set other priorities lower than the timers
     NVIC_SetPriority(ADC_IRQn, 4);
     NVIC_SetPriority(USB_IRQn, 4);
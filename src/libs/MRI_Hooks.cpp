@@ -25,9 +25,11 @@ extern "C" {
     };
 
     static uint32_t _previous_state[5];
+    static uint32_t _previous_pinsel[10];
 
     static LPC_GPIO_TypeDef* io;
-    static int i;
+    static volatile uint32_t* pinsel;
+    static int i, j;
 
     void __mriPlatform_EnteringDebuggerHook()
     {
@@ -41,6 +43,19 @@ extern "C" {
             io->FIOSET   = _set_high_on_debug[i];
             io->FIOCLR   = _set_low_on_debug[i];
         }
+
+        // Pins driven by a peripheral, like heaters on PWM1, are handed back to GPIO so the above applies to them
+        pinsel = &LPC_PINCON->PINSEL0;
+        for (i = 0; i < 10; i++)
+            _previous_pinsel[i] = pinsel[i];
+        for (i = 0; i < 5; i++)
+        {
+            for (j = 0; j < 32; j++)
+            {
+                if ((_set_high_on_debug[i] | _set_low_on_debug[i]) & (1 << j))
+                    pinsel[(i * 2) + (j >> 4)] &= ~(3 << ((j & 15) * 2));
+            }
+        }
     }
 
     void __mriPlatform_LeavingDebuggerHook()
@@ -52,6 +67,10 @@ extern "C" {
             io->FIOSET   =   _previous_state[i]  & (_set_high_on_debug[i] | _set_low_on_debug[i]);
             io->FIOCLR   = (~_previous_state[i]) & (_set_high_on_debug[i] | _set_low_on_debug[i]);
         }
+
+        pinsel = &LPC_PINCON->PINSEL0;
+        for (i = 0; i < 10; i++)
+            pinsel[i] = _previous_pinsel[i];
     }
 
     void set_high_on_debug(int port, int pin)
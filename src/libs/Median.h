@@ -5,6 +5,12 @@
       You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include <stdint.h>
+#include <string.h>
+
 template <typename T>
 void split(T data[], unsigned int n, T x, unsigned int& i, unsigned int& j)
 {
@@ -35,3 +41,62 @@ unsigned int quick_median(T data[], unsigned int n)
   }
   return k;
 }
+
+// Median and trimmed mean of the last N values
+// The values are kept sorted as they come in, so each new value costs a binary search and a short move instead of a full median search
+template <typename T, unsigned int N>
+class RunningMedian {
+    public:
+        RunningMedian() : count(0), next(0) {}
+
+        void push(T value){
+            // Drop the oldest value once the window is full, it is the one the new value replaces
+            if( this->count == N ){
+                unsigned int i = this->find(this->window[this->next]);
+                memmove(&this->sorted[i], &this->sorted[i + 1], (this->count - i - 1) * sizeof(T));
+                this->count--;
+            }
+
+            unsigned int i = this->find(value);
+            memmove(&this->sorted[i + 1], &this->sorted[i], (this->count - i) * sizeof(T));
+            this->sorted[i] = value;
+            this->count++;
+
+            this->window[this->next] = value;
+            this->next = (this->next + 1) % N;
+        }
+
+        T median(){
+            return this->sorted[this->count / 2];
+        }
+
+        // Mean of the values left once the trim lowest and trim highest are dropped
+        T trimmed_mean(unsigned int trim){
+            if( this->count <= 2 * trim ){ return this->median(); }
+            uint32_t sum = 0;
+            for( unsigned int i = trim; i < this->count - trim; i++ ){
+                sum += this->sorted[i];
+            }
+            return sum / ( this->count - 2 * trim );
+        }
+
+        unsigned int size(){ return this->count; }
+
+    private:
+        // First sorted position not below value
+        unsigned int find(T value){
+            unsigned int l = 0, r = this->count;
+            while( l < r ){
+                unsigned int m = ( l + r ) / 2;
+                if( this->sorted[m] < value ){ l = m + 1; }else{ r = m; }
+            }
+            return l;
+        }
+
+        T window[N];                    // Values in the order they came in
+        T sorted[N];
+        unsigned int count;
+        unsigned int next;              // Where the next value goes in window, the oldest one once it is full
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PinInterrupt.h"
+
+
+PinInterrupt* PinInterrupt::pins[PIN_INTERRUPT_MAX];
+uint8_t       PinInterrupt::pin_count = 0;
+
+PinInterrupt::PinInterrupt(){
+    this->pin = NULL;
+    this->hook = new Hook();
+    this->tag = 0;
+    this->debounce_us = 0;
+    this->is_armed = false;
+    this->has_triggered = false;
+    this->already_active = false;
+    this->debouncing = false;
+
+    if( pin_count < PIN_INTERRUPT_MAX ){
+        pins[pin_count++] = this;
+    }
+
+    // All P0 and P2 pins share the EINT3 interrupt, its priority is set with the timers' in the Kernel
+    NVIC_EnableIRQ(EINT3_IRQn);
+}
+
+bool PinInterrupt::supported(Pin* pin){
+    return pin->connected() && ( pin->port_number == 0 || pin->port_number == 2 );
+}
+
+bool PinInterrupt::set_pin(Pin* pin){
+    this->disarm();
+    this->pin = PinInterrupt::supported(pin) ? pin : NULL;
+    return this->pin != NULL;
+}
+
+// Enable the interrupt on the edge where the pin becomes active, which depends on it being inverted
+void PinInterrupt::enable_edge(bool enable){
+    uint32_t bit = 1 << this->pin->pin;
+    volatile uint32_t* edge;
+    if( this->pin->port_number == 0 ){
+        edge = this->pin->inverting ? &LPC_GPIOINT->IO0IntEnF : &LPC_GPIOINT->IO0IntEnR;
+        if( enable ){ LPC_GPIOINT->IO0IntClr = bit; }
+    }else{
+        edge = this->pin->inverting ? &LPC_GPIOINT->IO2IntEnF : &LPC_GPIOINT->IO2IntEnR;
+        if( enable ){ LPC_GPIOINT->IO2IntClr = bit; }
+    }
+
+    __disable_irq();
+    if( enable ){
+        *edge |= bit;
+    }else{
+        *edge &= ~bit;
+    }
+    __enable_irq();
+}
+
+// Call the hook the next time the pin becomes active, or right away if it already is and if_active is set
+// Returns false if the pin can't interrupt, it then has to be polled
+bool PinInterrupt::arm(bool if_active){
+    if( this->pin == NULL ){ return false; }
+    this->debounce.detach();
+    this->debouncing = false;
+    this->has_triggered = false;
+    this->already_active = false;
+    this->is_armed = true;
+    this->enable_edge(true);
+
+    if( if_active && this->pin->get() ){
+        this->already_active = true;
+        NVIC_SetPendingIRQ(EINT3_IRQn);
+    }
+    return true;
+}
+
+void PinInterrupt::disarm(){
+    if( this->pin == NULL ){ return; }
+    this->is_armed = false;
+    this->enable_edge(false);
+    this->debounce.detach();
+    this->debouncing = false;
+}
+
+// Called from the interrupt with the edges seen on this pin's port, returns true if the hook was called
+bool PinInterrupt::check(uint32_t rising, uint32_t falling){
+    if( !this->is_armed || this->debouncing ){ return false; }
+
+    uint32_t edges = this->pin->inverting ? falling : rising;
+    if( !this->already_active && !( edges & ( 1 << this->pin->pin ) ) ){ return false; }
+    this->already_active = false;
+
+    if( this->debounce_us == 0 ){
+        this->trigger();
+        return true;
+    }
+
+    // Debounce : look at the pin again once debounce_us has passed, bounces meanwhile are ignored
+    this->debouncing = true;
+    this->enable_edge(false);
+    this->debounce.attach_us(this, &PinInterrupt::debounced, this->debounce_us);
+    return false;
+}
+
+// Called from the microsecond ticker interrupt once the debounce time has passed
+void PinInterrupt::debounced(){
+    if( !this->debouncing ){ return; }
+    this->debouncing = false;
+    if( !this->is_armed ){ return; }
+
+    if( this->pin->get() ){
+        this->trigger();
+        return;
+    }
+
+    // It was a glitch, wait for the next edge, or look again if the pin became active while enabling it
+    this->enable_edge(true);
+    if( this->pin->get() ){
+        this->already_active = true;
+        NVIC_SetPendingIRQ(EINT3_IRQn);
+    }
+}
+
+// The hook is only called once per arm()
+void PinInterrupt::trigger(){
+    this->is_armed = false;
+    this->enable_edge(false);
+    this->has_triggered = true;
+    this->hook->call(this->tag);
+}
+
+void PinInterrupt::handle_interrupts(){
+    uint32_t rising0  = LPC_GPIOINT->IO0IntStatR;
+    uint32_t falling0 = LPC_GPIOINT->IO0IntStatF;
+    uint32_t rising2  = LPC_GPIOINT->IO2IntStatR;
+    uint32_t falling2 = LPC_GPIOINT->IO2IntStatF;
+    LPC_GPIOINT->IO0IntClr = rising0 | falling0;
+    LPC_GPIOINT->IO2IntClr = rising2 | falling2;
+
+    for( uint8_t i = 0; i < pin_count; i++ ){
+        PinInterrupt* p = pins[i];
+        if( p->pin == NULL ){ continue; }
+        if( p->pin->port_number == 0 ){
+            p->check(rising0, falling0);
+        }else{
+            p->check(rising2, falling2);
+        }
+    }
+}
+
+extern "C" void EINT3_IRQHandler (void){
+    PinInterrupt::handle_interrupts();
+}
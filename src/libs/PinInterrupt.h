@@ -0,0 +1,64 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PININTERRUPT_H
+#define PININTERRUPT_H
+
+#include "libs/Hook.h"
+#include "libs/Pin.h"
+#include "Timeout.h" // mbed.h lib
+
+#define PIN_INTERRUPT_MAX 12
+
+// Calls a hook from the GPIO interrupt when an input pin becomes active, so it can stop motors at that exact step
+// Only P0 and P2 pins can interrupt on the LPC17xx, others have to be polled as before
+// The hook runs at the same priority as the step ticker, so motors can be safely stopped from it
+// Debouncing is timed by a match of the microsecond ticker, nothing waits in the interrupt
+class PinInterrupt {
+    public:
+        PinInterrupt();
+
+        static bool supported(Pin* pin);
+
+        // Returns false if the pin can't interrupt, the hook is then never called
+        template<typename T> bool attach( Pin* pin, uint32_t tag, T *optr, uint32_t ( T::*fptr )( uint32_t ) ){
+            this->hook->attach(optr, fptr);
+            this->tag = tag;
+            return this->set_pin(pin);
+        }
+
+        bool arm(bool if_active = true);
+        void disarm();
+        void set_debounce_us(uint32_t us) { this->debounce_us = us; }
+
+        bool     armed()     { return this->is_armed; }
+        bool     triggered() { return this->has_triggered; }
+
+        static void handle_interrupts();
+
+    private:
+        bool set_pin(Pin* pin);
+        void enable_edge(bool enable);
+        bool check(uint32_t rising, uint32_t falling);
+        void debounced();
+        void trigger();
+
+        Pin*     pin;
+        Hook*    hook;
+        uint32_t tag;                   // Passed to the hook, so one method can serve several pins
+        uint32_t debounce_us;           // The pin must still be active this long after its edge for the hook to be called
+        mbed::Timeout debounce;
+        volatile bool is_armed;
+        volatile bool has_triggered;
+        volatile bool already_active;   // The pin was active when armed, there will be no edge for it
+        volatile bool debouncing;       // Waiting for the debounce timeout, the edge is disabled meanwhile
+
+        static PinInterrupt* pins[PIN_INTERRUPT_MAX];
+        static uint8_t       pin_count;
+};
+
+#endif
@@ -1,10 +1,76 @@
 #include "Pwm.h"
 
 #include "nuts_bolts.h"
+#include "Kernel.h"
+#include "SlowTicker.h"
+#include "Config.h"
+#include "ConfigValue.h"
+#include "checksumm.h"
+
+#include <vector>
+using std::vector;
 
 #define PID_PWM_MAX 256
 
-// What ?
+#define laser_module_enable_checksum CHECKSUM("laser_module_enable")
+
+// Sigma-delta modulates all the PWM pins that have no hardware channel from a single hook
+// The outputs of each port are written at once, so they all change on the same cycle
+class SoftPwmBank {
+public:
+    SoftPwmBank() : frequency(0), hook(NULL) {}
+
+    void add(Pwm* pwm, uint32_t frequency)
+    {
+        for (unsigned int i = 0; i < pwms.size(); i++)
+            if (pwms[i] == pwm) return;
+        __disable_irq();
+        pwms.push_back(pwm);
+        __enable_irq();
+
+        // Run as fast as the fastest output asks for
+        if (frequency <= this->frequency) return;
+        this->frequency = frequency;
+        if (hook == NULL) {
+            hook = THEKERNEL->slow_ticker->attach(frequency, this, &SoftPwmBank::tick);
+        } else {
+            hook->interval = (SystemCoreClock >> 2) / frequency;
+            if (frequency > THEKERNEL->slow_ticker->max_frequency) {
+                THEKERNEL->slow_ticker->max_frequency = frequency;
+                THEKERNEL->slow_ticker->set_frequency(frequency);
+            }
+        }
+    }
+
+    uint32_t tick(uint32_t dummy)
+    {
+        uint32_t set[5] = {0, 0, 0, 0, 0};
+        uint32_t clr[5] = {0, 0, 0, 0, 0};
+        for (unsigned int i = 0; i < pwms.size(); i++) {
+            Pwm* pwm = pwms[i];
+            if ((pwm->_pwm < 0) || (pwm->_pwm >= PID_PWM_MAX))
+                continue;
+            if (pwm->inverting ^ pwm->sd_tick())
+                set[(int)pwm->port_number] |= 1 << pwm->pin;
+            else
+                clr[(int)pwm->port_number] |= 1 << pwm->pin;
+        }
+
+        LPC_GPIO_TypeDef* ports[5] = {LPC_GPIO0, LPC_GPIO1, LPC_GPIO2, LPC_GPIO3, LPC_GPIO4};
+        for (int i = 0; i < 5; i++) {
+            if (set[i]) ports[i]->FIOSET = set[i];
+            if (clr[i]) ports[i]->FIOCLR = clr[i];
+        }
+        return dummy;
+    }
+
+private:
+    vector<Pwm*> pwms;
+    uint32_t     frequency;
+    Hook*        hook;
+};
+
+static SoftPwmBank* soft_pwm_bank = NULL;
 
 Pwm::Pwm()
 {
@@ -12,17 +78,112 @@ Pwm::Pwm()
     _pwm = -1;
     _sd_direction= false;
     _sd_accumulator= 0;
+    _match = NULL;
+    _channel = 0;
+}
+
+// Start modulating the pin, in hardware at that frequency if it is on a PWM1 channel
+Pwm* Pwm::start(uint32_t frequency)
+{
+    if (hardware() || start_hardware(frequency))
+        return this;
+
+    if (soft_pwm_bank == NULL)
+        soft_pwm_bank = new SoftPwmBank();
+    soft_pwm_bank->add(this, frequency);
+    return this;
+}
+
+// P1.18, P1.20, P1.21, P1.23, P1.24, P1.26, P2.0 to P2.5, P3.25 and P3.26 can be PWM1 outputs
+bool Pwm::start_hardware(uint32_t frequency)
+{
+    if (!connected())
+        return false;
+
+    int channel = 0, function = 0;
+    if (port_number == 1) {
+        function = 2;
+        switch (pin) {
+            case 18: channel = 1; break;
+            case 20: channel = 2; break;
+            case 21: channel = 3; break;
+            case 23: channel = 4; break;
+            case 24: channel = 5; break;
+            case 26: channel = 6; break;
+        }
+    } else if (port_number == 2 && pin <= 5) {
+        function = 1;
+        channel = pin + 1;
+    } else if (port_number == 3 && (pin == 25 || pin == 26)) {
+        function = 3;
+        channel = pin - 23;
+    }
+    if (channel == 0)
+        return false;
+
+    // The laser sets the PWM1 period itself, whenever it is loaded, so it keeps PWM1 to itself
+    if (THEKERNEL->config->value(laser_module_enable_checksum)->by_default(false)->as_bool())
+        return false;
+
+    // The period is shared by all channels, the first one to start sets it
+    // Pins asking for another frequency are modulated in software instead
+    uint32_t period = (SystemCoreClock >> 2) / frequency;   // PCLK is CCLK/4
+    if (LPC_PWM1->TCR & (1 << 3)) {
+        if (LPC_PWM1->MR0 != period)
+            return false;
+    } else {
+        LPC_SC->PCONP |= (1 << 6);
+        LPC_PWM1->TCR = (1 << 1);                           // Reset
+        LPC_PWM1->PR  = 0;
+        LPC_PWM1->MR0 = period;
+        LPC_PWM1->MCR = (1 << 1);                           // Reset on MR0
+        LPC_PWM1->LER = 1;
+        LPC_PWM1->TCR = (1 << 0) | (1 << 3);                // Counter and PWM enabled
+    }
+
+    switch (channel) {
+        case 1: _match = &LPC_PWM1->MR1; break;
+        case 2: _match = &LPC_PWM1->MR2; break;
+        case 3: _match = &LPC_PWM1->MR3; break;
+        case 4: _match = &LPC_PWM1->MR4; break;
+        case 5: _match = &LPC_PWM1->MR5; break;
+        case 6: _match = &LPC_PWM1->MR6; break;
+    }
+    _channel = channel;
+
+    // Keep the pin's current state until the match register is set, then hand the pin over to PWM1
+    if (_pwm < 0)
+        _pwm = get() ? _max : 0;
+    set_match();
+    LPC_PWM1->PCR &= ~(1 << channel);                      // Single edge
+    LPC_PWM1->PCR |= (1 << (8 + channel));
+
+    volatile uint32_t* pinsel = &LPC_PINCON->PINSEL0 + (port_number * 2) + (pin >> 4);
+    *pinsel = (*pinsel & ~(3 << ((pin & 15) * 2))) | (function << ((pin & 15) * 2));
+    return true;
+}
+
+// The output goes high at the start of the period and low on the match, if the match is past the period it stays high
+void Pwm::set_match()
+{
+    uint32_t period = LPC_PWM1->MR0;
+    uint32_t match = (_pwm < 0) ? 0 : (period * _pwm) / (PID_PWM_MAX - 1);
+    if (match >= period) match = period + 1;
+    *_match = inverting ? (period + 1 - match) : match;
+    LPC_PWM1->LER |= (1 << _channel);                       // Latched at the start of the next period
 }
 
 void Pwm::pwm(int new_pwm)
 {
     _pwm = confine(new_pwm, 0, _max);
+    if (hardware()) set_match();
 }
 
 Pwm* Pwm::max_pwm(int new_max)
 {
     _max = confine(new_max, 0, PID_PWM_MAX - 1);
     _pwm = confine(   _pwm, 0, _max);
+    if (hardware()) set_match();
     return this;
 }
 
@@ -33,15 +194,20 @@ int Pwm::max_pwm()
 
 void Pwm::set(bool value)
 {
+    if (hardware()) {
+        // Full on or off, set() is not limited by max_pwm
+        _pwm = value ? PID_PWM_MAX - 1 : 0;
+        set_match();
+        _pwm = -1;
+        return;
+    }
     _pwm = -1;
     Pin::set(value);
 }
 
-uint32_t Pwm::on_tick(uint32_t dummy)
+// One step of the modulation, returns whether the output should be on
+bool Pwm::sd_tick()
 {
-    if ((_pwm < 0) || (_pwm >= PID_PWM_MAX))
-        return dummy;
-
     /*
      * Sigma-Delta PWM algorithm
      *
@@ -120,7 +286,5 @@ uint32_t Pwm::on_tick(uint32_t dummy)
         if (_sd_accumulator <= 0)
             _sd_direction = false;
     }
-    Pin::set(_sd_direction);
-
-    return dummy;
+    return _sd_direction;
 }
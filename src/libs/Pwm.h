@@ -6,12 +6,16 @@
 #include "Pin.h"
 #include "Module.h"
 
+class SoftPwmBank;
+
+// Pins on a PWM1 channel are driven by the hardware match registers, if they all ask for the same frequency and there is no laser
+// Others are sigma-delta modulated, all from the same SlowTicker hook
 class Pwm : public Module, public Pin {
 public:
     Pwm();
 
     void     on_module_load(void);
-    uint32_t on_tick(uint32_t);
+    Pwm*     start(uint32_t frequency);
 
     Pwm*     max_pwm(int);
     int      max_pwm(void);
@@ -19,11 +23,21 @@ public:
     void     pwm(int);
     void     set(bool);
 
+    bool     hardware() { return _match != NULL; }
+
 private:
+    friend class SoftPwmBank;
+    bool     sd_tick(void);
+    void     set_match(void);
+    bool     start_hardware(uint32_t frequency);
+
     int  _max;
     int  _pwm;
     int  _sd_accumulator;
     bool _sd_direction;
+
+    volatile uint32_t* _match;  // PWM1 match register of this pin's channel, if it has one
+    uint8_t  _channel;
 };
 
 #endif /* _PWM_H */
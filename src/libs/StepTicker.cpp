@@ -49,10 +49,11 @@ StepTicker::StepTicker(){
     this->set_frequency(0.001);
     this->set_reset_delay(100);
     this->last_duration = 0;
-    for (int i = 0; i < 12; i++){
+    for (int i = 0; i < MAX_STEPPER_MOTORS; i++){
         this->active_motors[i] = NULL;
     }
     this->active_motor_bm = 0;
+    this->num_motors = 0;
 
     NVIC_EnableIRQ(TIMER0_IRQn);     // Enable interrupt handler
     NVIC_EnableIRQ(TIMER1_IRQn);     // Enable interrupt handler
@@ -89,7 +90,7 @@ inline void StepTicker::tick(){
     int i;
     uint32_t bm = 1;
     // We iterate over each active motor
-    for (i = 0; i < 12; i++, bm <<= 1){
+    for (i = 0; i < this->num_motors; i++, bm <<= 1){
         if (this->active_motor_bm & bm){
             this->active_motors[i]->tick();
         }
@@ -102,8 +103,8 @@ inline void StepTicker::tick(){
 void StepTicker::signal_moves_finished(){
     _isr_context = true;
 
-    uint16_t bitmask = 1;
-    for ( uint8_t motor = 0; motor < 12; motor++, bitmask <<= 1){
+    uint32_t bitmask = 1;
+    for ( uint8_t motor = 0; motor < this->num_motors; motor++, bitmask <<= 1){
         if (this->active_motor_bm & bitmask){
             if(this->active_motors[motor]->is_move_finished){
                 this->active_motors[motor]->signal_move_finished();
@@ -127,7 +128,7 @@ inline void StepTicker::reset_tick(){
 
     int i;
     uint32_t bm;
-    for (i = 0, bm = 1; i < 12; i++, bm <<= 1)
+    for (i = 0, bm = 1; i < this->num_motors; i++, bm <<= 1)
     {
         if (this->active_motor_bm & bm)
             this->active_motors[i]->unstep();
@@ -148,8 +149,8 @@ extern "C" void TIMER0_IRQHandler (void){
     LPC_TIM0->IR |= 1 << 0;
 
     // Step pins
-    uint16_t bitmask = 1;
-    for (uint8_t motor = 0; motor < 12; motor++, bitmask <<= 1){
+    uint32_t bitmask = 1;
+    for (uint8_t motor = 0; motor < global_step_ticker->num_motors; motor++, bitmask <<= 1){
         if (global_step_ticker->active_motor_bm & bitmask){
             global_step_ticker->active_motors[motor]->tick();
         }
@@ -190,7 +191,7 @@ extern "C" void TIMER0_IRQHandler (void){
 
             int i;
             uint32_t bm;
-            for (i = 0, bm = 1; i < 12; i++, bm <<= 1)
+            for (i = 0, bm = 1; i < global_step_ticker->num_motors; i++, bm <<= 1)
             {
                 if (global_step_ticker->active_motor_bm & bm)
                     ticks_we_actually_can_skip =
@@ -200,7 +201,7 @@ extern "C" void TIMER0_IRQHandler (void){
             }
 
             // Adding to MR0 for this time is not enough, we must also increment the counters ourself artificially
-            for (i = 0, bm = 1; i < 12; i++, bm <<= 1)
+            for (i = 0, bm = 1; i < global_step_ticker->num_motors; i++, bm <<= 1)
             {
                 if (global_step_ticker->active_motor_bm & bm)
                     global_step_ticker->active_motors[i]->fx_counter += (uint64_t)((uint64_t)(ticks_we_actually_can_skip)<<32);
@@ -231,7 +232,7 @@ void StepTicker::add_motor_to_active_list(StepperMotor* motor)
 {
     uint32_t bm;
     int i;
-    for (i = 0, bm = 1; i < 12; i++, bm <<= 1)
+    for (i = 0, bm = 1; i < MAX_STEPPER_MOTORS; i++, bm <<= 1)
     {
         if (this->active_motors[i] == motor)
         {
@@ -244,6 +245,7 @@ void StepTicker::add_motor_to_active_list(StepperMotor* motor)
         if (this->active_motors[i] == NULL)
         {
             this->active_motors[i] = motor;
+            this->num_motors = i + 1;
             this->active_motor_bm |= bm;
             if( this->active_motor_bm != 0 ){
                 LPC_TIM0->TCR = 1;               // Enable interrupt
@@ -258,7 +260,7 @@ void StepTicker::add_motor_to_active_list(StepperMotor* motor)
 void StepTicker::remove_motor_from_active_list(StepperMotor* motor)
 {
     uint32_t bm; int i;
-    for (i = 0, bm = 1; i < 12; i++, bm <<= 1)
+    for (i = 0, bm = 1; i < this->num_motors; i++, bm <<= 1)
     {
         if (this->active_motors[i] == motor)
         {
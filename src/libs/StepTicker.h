@@ -16,6 +16,9 @@ using namespace std;
 
 class StepperMotor;
 
+// Size of the active motor table, the ticker only ever walks the slots actually in use ( num_motors )
+#define MAX_STEPPER_MOTORS 32
+
 class StepTicker{
     public:
         StepTicker();
@@ -39,8 +42,9 @@ class StepTicker{
         bool moves_finished;
         bool reset_step_pins;
 
-        StepperMotor* active_motors[12];
+        StepperMotor* active_motors[MAX_STEPPER_MOTORS];
         uint32_t active_motor_bm;
+        uint8_t num_motors;                 // Number of slots used in active_motors
 
 };
 
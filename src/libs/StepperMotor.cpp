@@ -26,9 +26,16 @@ StepperMotor::StepperMotor(){
     this->is_move_finished = false;
     this->signal_step = false;
     this->step_signal_hook = new Hook();
+    this->watch_step = false;
+    this->step_watch_hook = new Hook();
 
     steps_per_mm         = 1.0F;
     max_rate             = 50.0F;
+    acceleration         = 0.0F;
+    linear_advance       = 0.0F;
+    advance_steps        = 0;
+    advance_planned      = 0;
+    advancing            = false;
 
     last_milestone_steps = 0;
     last_milestone_mm    = 0.0F;
@@ -45,12 +52,19 @@ StepperMotor::StepperMotor(Pin& step, Pin& dir, Pin& en) : step_pin(step), dir_p
     this->is_move_finished = false;
     this->signal_step = false;
     this->step_signal_hook = new Hook();
+    this->watch_step = false;
+    this->step_watch_hook = new Hook();
 
     enable(false);
     set_high_on_debug(en.port_number, en.pin);
 
     steps_per_mm         = 1.0F;
     max_rate             = 50.0F;
+    acceleration         = 0.0F;
+    linear_advance       = 0.0F;
+    advance_steps        = 0;
+    advance_planned      = 0;
+    advancing            = false;
 
     last_milestone_steps = 0;
     last_milestone_mm    = 0.0F;
@@ -74,6 +88,9 @@ void StepperMotor::step(){
     if( this->stepped == this->signal_step_number && this->signal_step ){
         this->step_signal_hook->call();
     }
+    if( this->watch_step && this->stepped == this->watch_step_number ){
+        this->step_watch_hook->call();
+    }
 
     // Is this move finished ?
     if( this->stepped == this->steps_to_move ){
@@ -134,6 +151,7 @@ void StepperMotor::move( bool direction, unsigned int steps ){
 
     // Do not signal steps until we get instructed to
     this->signal_step = false;
+    this->watch_step = false;
 
     // Starting now we are moving
     if( steps > 0 ){
@@ -145,9 +163,24 @@ void StepperMotor::move( bool direction, unsigned int steps ){
 
 }
 
+// Stop the current move where it is, stepped still tells how far it went
+void StepperMotor::stop(){
+    this->moving = false;
+    this->steps_to_move = 0;
+    this->is_move_finished = false;
+    this->update_exit_tick();
+}
+
 // Set the speed at which this steper moves
 void StepperMotor::set_speed( float speed ){
 
+    // Linear advance can hold the extruder still for a while, it then waits with its move unfinished
+    if (speed <= 0.0F){
+        this->steps_per_second = 0.0F;
+        this->fx_ticks_per_step = 0xFFFFFFFF;
+        return;
+    }
+
     if (speed < 20.0)
         speed = 20.0;
 
@@ -36,6 +36,7 @@ class StepperMotor {
 
         void move_finished();
         void move( bool direction, unsigned int steps );
+        void stop();
         void signal_move_finished();
         void set_speed( float speed );
         void update_exit_tick();
@@ -59,10 +60,21 @@ class StepperMotor {
             this->signal_step = true;
         }
 
+        // Calls the hook when the given step is reached, the hook may then set watch_step_number to the next step it wants
+        // Independent of the step signal above, which the Stepper uses for deceleration
+        template<typename T> void attach_step_watch(uint32_t step, T *optr, uint32_t ( T::*fptr )( uint32_t ) ){
+            this->step_watch_hook->attach(optr, fptr);
+            this->watch_step_number = step;
+            this->watch_step = true;
+        }
+
         Hook* end_hook;
         Hook* step_signal_hook;
+        Hook* step_watch_hook;
 
         bool signal_step;
+        volatile bool watch_step;
+        volatile uint32_t watch_step_number;
         uint32_t signal_step_number;
 
         StepTicker* step_ticker;
@@ -77,6 +89,11 @@ class StepperMotor {
 
         float steps_per_mm;
         float max_rate;
+        float acceleration;                 // Max acceleration in mm/s^2 for this actuator, 0 for no limit
+        float linear_advance;               // Pressure advance factor K in seconds, extra speed is K times the acceleration, 0 disables it
+        int32_t advance_steps;              // Steps the motor is ahead of its planned position because of linear advance
+        int32_t advance_planned;            // Planned steps of the current move, signed, while linear advance applies to it
+        bool    advancing;                  // Linear advance applies to the current move
 
         int32_t last_milestone_steps;
         float   last_milestone_mm;
@@ -24,6 +24,7 @@
 #include "libs/Kernel.h"
 #include "libs/SerialMessage.h"
 #include "StreamOutputPool.h"
+#include "modules/robot/Robot.h"
 
 // extern void setled(int, bool);
 #define setled(a, b) do {} while (0)
@@ -279,7 +280,8 @@ void USBSerial::on_main_loop(void *argument)
             nl_in_rx = 0;
         }
     }
-    if (nl_in_rx)
+    // Leave the next line in the buffer until the current move is fully cut into segments
+    if (nl_in_rx && !THEKERNEL->robot->is_segmenting())
     {
         string received;
         while (available())
@@ -25,9 +25,20 @@ along with Grbl. If not, see <http://www.gnu.org/licenses/>.
 #define Y_AXIS 1
 #define Z_AXIS 2
 
+#define A_AXIS 3
+#define B_AXIS 4
+#define C_AXIS 5
+
 #define ALPHA_STEPPER 0
 #define BETA_STEPPER 1
 #define GAMMA_STEPPER 2
+#define DELTA_STEPPER 3
+#define EPSILON_STEPPER 4
+#define ZETA_STEPPER 5
+
+// Max number of actuators the planner coordinates : the three driven by the arm solution,
+// followed by up to three linear axes ( A B C ) moved one to one by their own actuator, then the extruders
+#define MAX_ROBOT_ACTUATORS 8
 
 #define clear_vector(a) memset(a, 0, sizeof(a))
 #define clear_vector_float(a) memset(a, 0.0F, sizeof(a))
@@ -6,6 +6,7 @@
 */
 
 #include <string>
+#include <ctype.h>
 using std::string;
 #include "libs/Module.h"
 #include "libs/Kernel.h"
@@ -19,6 +20,8 @@ using std::string;
 #include "Config.h"
 #include "checksumm.h"
 #include "ConfigValue.h"
+#include "PublicData.h"
+#include "modules/tools/laser/LaserPublicAccess.h"
 
 GcodeDispatch::GcodeDispatch() {}
 
@@ -88,6 +91,19 @@ try_again:
             possible_command = possible_command.substr(0, comment);
         }
 
+        //Raster rows carry their pixels as base64 after a D, which must not be split up like the other letters
+        string raster_data;
+        bool has_raster_data = false;
+        if( !uploading && possible_command.compare(0, 2, "G7") == 0 && ( possible_command.size() == 2 || !isdigit(possible_command[2]) ) ) {
+            size_t data = possible_command.find_first_of("D");
+            if( data != string::npos ) {
+                raster_data = possible_command.substr(data + 1);
+                possible_command = possible_command.substr(0, data);
+                has_raster_data = true;
+                THEKERNEL->public_data->set_value( laser_checksum, raster_data_checksum, &raster_data );
+            }
+        }
+
         //If checksum passes then process message, else request resend
         int nextline = currentline + 1;
         if( cs == 0x00 && ln == nextline ) {
@@ -222,6 +238,11 @@ try_again:
             new_message.stream->printf("rs N%d\r\n", nextline);
         }
 
+        //The pixels only live as long as this line
+        if( has_raster_data ) {
+            THEKERNEL->public_data->set_value( laser_checksum, raster_data_checksum, NULL );
+        }
+
     } else if( (n=possible_command.find_first_of("XYZF")) == 0 || (first_char == ' ' && n != string::npos) ) {
         // handle pycam syntax, use last G0 or G1 and resubmit if an X Y Z or F is found on its own line
         if(last_g != 0 && last_g != 1) {
@@ -16,6 +16,7 @@ using std::string;
 #include "libs/SerialMessage.h"
 #include "libs/StreamOutput.h"
 #include "libs/StreamOutputPool.h"
+#include "modules/robot/Robot.h"
 
 // Serial reading module
 // Treats every received line as a command and passes it ( via event call ) to the command dispatcher.
@@ -49,6 +50,9 @@ void SerialConsole::on_serial_char_received(){
 
 // Actual event calling must happen in the main loop because if it happens in the interrupt we will loose data
 void SerialConsole::on_main_loop(void * argument){
+    // Leave the next line in the buffer until the current move is fully cut into segments
+    if( THEKERNEL->robot->is_segmenting() ){ return; }
+
     if( this->has_char('\n') ){
         string received;
         received.reserve(20);
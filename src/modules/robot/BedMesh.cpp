@@ -0,0 +1,149 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BedMesh.h"
+#include "libs/nuts_bolts.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Layout of mesh files : this header, then the heights as they are in memory
+struct BedMeshFileHeader {
+    char    magic[4];                       // "MESH"
+    uint8_t version;
+    uint8_t size[2];
+    uint8_t reserved;
+    float   origin[2];
+    float   spacing[2];
+};
+
+#define BED_MESH_FILE_VERSION 1
+
+BedMesh::BedMesh(){
+    this->active = false;
+    this->heights = NULL;
+    this->size[0] = this->size[1] = 0;
+}
+
+BedMesh::~BedMesh(){
+    delete[] this->heights;
+}
+
+// Lay out a grid of points over the given area, all heights are 0 until set
+bool BedMesh::resize(uint8_t points_x, uint8_t points_y, float min_x, float min_y, float max_x, float max_y){
+    this->active = false;
+    if( points_x < 2 || points_y < 2 || points_x > BED_MESH_MAX_POINTS || points_y > BED_MESH_MAX_POINTS || max_x <= min_x || max_y <= min_y ){
+        return false;
+    }
+
+    if( points_x * points_y != this->size[0] * this->size[1] ){
+        delete[] this->heights;
+        this->heights = new int16_t[points_x * points_y];
+    }
+    memset(this->heights, 0, points_x * points_y * sizeof(int16_t));
+
+    this->size[0] = points_x;
+    this->size[1] = points_y;
+    this->origin[0] = min_x;
+    this->origin[1] = min_y;
+    this->spacing[0] = (max_x - min_x) / (points_x - 1);
+    this->spacing[1] = (max_y - min_y) / (points_y - 1);
+    this->inverse_spacing[0] = 1.0F / this->spacing[0];
+    this->inverse_spacing[1] = 1.0F / this->spacing[1];
+    return true;
+}
+
+void BedMesh::set_height(uint8_t i, uint8_t j, float z){
+    this->heights[j * this->size[0] + i] = lroundf(z * BED_MESH_UNITS_PER_MM);
+}
+
+// Height of the bed at x, y : the cell is found directly from the spacing, then its four corners are interpolated
+float BedMesh::get_height(float x, float y){
+    float cx = (x - this->origin[0]) * this->inverse_spacing[0];
+    float cy = (y - this->origin[1]) * this->inverse_spacing[1];
+    if( cx < 0.0F ){ cx = 0.0F; }
+    if( cy < 0.0F ){ cy = 0.0F; }
+    if( cx > this->size[0] - 1 ){ cx = this->size[0] - 1; }
+    if( cy > this->size[1] - 1 ){ cy = this->size[1] - 1; }
+
+    int i = cx;
+    int j = cy;
+    if( i > this->size[0] - 2 ){ i = this->size[0] - 2; }
+    if( j > this->size[1] - 2 ){ j = this->size[1] - 2; }
+    float fx = cx - i;
+    float fy = cy - j;
+
+    const int16_t* corner = this->heights + j * this->size[0] + i;
+    float bottom = corner[0]                 + fx * ( corner[1]                 - corner[0] );
+    float top    = corner[this->size[0]]     + fx * ( corner[this->size[0] + 1] - corner[this->size[0]] );
+    return ( bottom + fy * ( top - bottom ) ) * ( 1.0F / BED_MESH_UNITS_PER_MM );
+}
+
+// Fraction of the way from start to end where the move first crosses a line of the grid, 1 if it does not
+// Inside a cell the heights are straight along X and Y, but a diagonal path through it follows a parabola. Cutting moves
+// at the grid lines follows the bed exactly along the axes, and within a quarter of the cell's twist otherwise
+float BedMesh::next_line(const float start[], const float end[]){
+    float t = 1.0F;
+    for( int axis = X_AXIS; axis <= Y_AXIS; axis++ ){
+        float distance = end[axis] - start[axis];
+        if( fabs(distance) < 0.0001F ){ continue; }
+
+        float cell = (start[axis] - this->origin[axis]) * this->inverse_spacing[axis];
+        int last = this->size[axis] - 1;
+        float line;
+        if( distance > 0 ){
+            line = floorf(cell + 0.0001F) + 1.0F;
+            if( line < 0.0F ){ line = 0.0F; }
+            if( line > last ){ continue; }
+        }else{
+            line = ceilf(cell - 0.0001F) - 1.0F;
+            if( line > last ){ line = last; }
+            if( line < 0.0F ){ continue; }
+        }
+
+        float crossing = ( this->origin[axis] + line * this->spacing[axis] - start[axis] ) / distance;
+        if( crossing > 0.0001F && crossing < t ){ t = crossing; }
+    }
+    return t;
+}
+
+// Read a mesh saved by save(), the mesh is active if it loaded
+bool BedMesh::load(const char* filename){
+    FILE* file = fopen(filename, "r");
+    if( file == NULL ){ return false; }
+
+    BedMeshFileHeader header;
+    bool loaded = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "MESH", 4) == 0 && header.version == BED_MESH_FILE_VERSION
+               && this->resize(header.size[0], header.size[1], header.origin[0], header.origin[1],
+                               header.origin[0] + header.spacing[0] * (header.size[0] - 1), header.origin[1] + header.spacing[1] * (header.size[1] - 1))
+               && fread(this->heights, sizeof(int16_t), header.size[0] * header.size[1], file) == (size_t)(header.size[0] * header.size[1]);
+    fclose(file);
+
+    this->active = loaded;
+    return loaded;
+}
+
+bool BedMesh::save(const char* filename){
+    if( this->heights == NULL ){ return false; }
+    FILE* file = fopen(filename, "w");
+    if( file == NULL ){ return false; }
+
+    BedMeshFileHeader header;
+    memcpy(header.magic, "MESH", 4);
+    header.version = BED_MESH_FILE_VERSION;
+    header.size[0] = this->size[0];
+    header.size[1] = this->size[1];
+    header.reserved = 0;
+    memcpy(header.origin, this->origin, sizeof(header.origin));
+    memcpy(header.spacing, this->spacing, sizeof(header.spacing));
+
+    bool saved = fwrite(&header, sizeof(header), 1, file) == 1
+              && fwrite(this->heights, sizeof(int16_t), this->size[0] * this->size[1], file) == (size_t)(this->size[0] * this->size[1]);
+    fclose(file);
+    return saved;
+}
@@ -0,0 +1,43 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEDMESH_H
+#define BEDMESH_H
+
+#include <stdint.h>
+
+#define BED_MESH_MAX_POINTS 16              // Max number of points along each axis
+#define BED_MESH_UNITS_PER_MM 1000          // Heights are stored in micrometers
+
+// Grid of bed heights the Robot adds to Z, interpolated bilinearly between the points
+// Beyond the grid the height of its edge is used
+class BedMesh {
+    public:
+        BedMesh();
+        ~BedMesh();
+
+        bool resize(uint8_t points_x, uint8_t points_y, float min_x, float min_y, float max_x, float max_y);
+        void set_height(uint8_t i, uint8_t j, float z);
+        float get_height(float x, float y);
+        float next_line(const float start[], const float end[]);
+        float point_x(uint8_t i) { return this->origin[0] + i * this->spacing[0]; }
+        float point_y(uint8_t j) { return this->origin[1] + j * this->spacing[1]; }
+
+        bool load(const char* filename);
+        bool save(const char* filename);
+
+        bool    active;                     // Heights are valid and applied to moves
+        uint8_t size[2];                    // Number of points along X and Y
+
+    private:
+        int16_t* heights;                   // size[0] * size[1] heights, row by row along X
+        float   origin[2];                  // First point
+        float   spacing[2];                 // Distance between points
+        float   inverse_spacing[2];
+};
+
+#endif
@@ -34,9 +34,9 @@ Block::Block()
 
 void Block::clear()
 {
-    //commands.clear();
-    //travel_distances.clear();
-    gcodes.clear();
+    // the gcodes themselves are freed by the Conveyor, see Conveyor::on_idle
+    first_gcode         = 0;
+    gcode_count         = 0;
     clear_vector(this->steps);
 
     steps_event_count   = 0;
@@ -46,6 +46,7 @@ void Block::clear()
     entry_speed         = 0.0F;
     exit_speed          = 0.0F;
     rate_delta          = 0.0F;
+    acceleration        = 0.0F;
     initial_rate        = -1;
     final_rate          = -1;
     accelerate_until    = 0;
@@ -172,7 +173,7 @@ float Block::reverse_pass(float exit_speed)
         // for max allowable speed if block is decelerating and nominal length is false.
         if ((!this->nominal_length_flag) && (this->max_entry_speed > exit_speed))
         {
-            float max_entry_speed = max_allowable_speed(-THEKERNEL->planner->acceleration, exit_speed, this->millimeters);
+            float max_entry_speed = max_allowable_speed(-this->acceleration, exit_speed, this->millimeters);
 
             this->entry_speed = min(max_entry_speed, this->max_entry_speed);
 
@@ -229,16 +230,23 @@ float Block::max_exit_speed()
         return nominal_speed;
 
     // otherwise, we have to work out max exit speed based on entry and acceleration
-    float max = max_allowable_speed(-THEKERNEL->planner->acceleration, this->entry_speed, this->millimeters);
+    float max = max_allowable_speed(-this->acceleration, this->entry_speed, this->millimeters);
 
     return min(max, nominal_speed);
 }
 
 // Gcodes are attached to their respective blocks so that on_gcode_execute can be called with it
+// A copy goes at the head of the gcode queue, the caller must make sure there is room for it
 void Block::append_gcode(Gcode* gcode)
 {
-    Gcode new_gcode = *gcode;
-    gcodes.push_back(new_gcode);
+    Conveyor::GcodeQueue_t& gcode_queue = THEKERNEL->conveyor->gcode_queue;
+
+    if (gcode_count == 0)
+        first_gcode = gcode_queue.head_i;
+
+    *gcode_queue.head_ref() = new Gcode(*gcode);
+    gcode_queue.produce_head();
+    gcode_count++;
 }
 
 void Block::begin()
@@ -251,8 +259,9 @@ void Block::begin()
     times_taken = -1;
 
     // execute all the gcodes related to this block
-    for(unsigned int index = 0; index < gcodes.size(); index++)
-        THEKERNEL->call_event(ON_GCODE_EXECUTE, &(gcodes[index]));
+    Conveyor::GcodeQueue_t& gcode_queue = THEKERNEL->conveyor->gcode_queue;
+    for(unsigned int index = first_gcode, i = 0; i < gcode_count; index = gcode_queue.next(index), i++)
+        THEKERNEL->call_event(ON_GCODE_EXECUTE, gcode_queue.item(index));
 
     THEKERNEL->call_event(ON_BLOCK_BEGIN, this);
 
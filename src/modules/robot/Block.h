@@ -12,6 +12,8 @@ using namespace std;
 #include <string>
 #include <vector>
 
+#include "libs/nuts_bolts.h"
+
 class Gcode;
 
 float max_allowable_speed( float acceleration, float target_velocity, float distance);
@@ -42,11 +44,7 @@ class Block {
 
         void begin();
 
-        //vector<std::string> commands;
-        //vector<float> travel_distances;
-        vector<Gcode> gcodes;
-
-        unsigned int   steps[3];           // Number of steps for each axis for this block
+        unsigned int   steps[MAX_ROBOT_ACTUATORS]; // Number of steps for each actuator for this block
         unsigned int   steps_event_count;  // Steps for the longest axis
         unsigned int   nominal_rate;       // Nominal rate in steps per second
         float          nominal_speed;      // Nominal speed in mm per second
@@ -54,22 +52,26 @@ class Block {
         float          entry_speed;
         float          exit_speed;
         float          rate_delta;         // Nomber of steps to add to the speed for each acceleration tick
+        float          acceleration;       // Acceleration for this move in mm/s^2, limited by the axes and actuators it moves
         unsigned int   initial_rate;       // Initial speed in steps per second
         unsigned int   final_rate;         // Final speed in steps per second
         unsigned int   accelerate_until;   // Stop accelerating after this number of steps
         unsigned int   decelerate_after;   // Start decelerating after this number of steps
         unsigned int   direction_bits;     // Direction for each axis in bit form, relative to the direction port's mask
 
-
-        bool recalculate_flag;             // Planner flag to recalculate trapezoids on entry junction
-        bool nominal_length_flag;          // Planner flag for nominal speed always reached
-
         float max_entry_speed;
 
-        bool is_ready;
+        // Gcodes to execute when this block begins, they live in Conveyor::gcode_queue
+        unsigned short first_gcode;        // Index of the first one in the gcode queue
+        unsigned short gcode_count;
 
         short times_taken;    // A block can be "taken" by any number of modules, and the next block is not moved to until all the modules have "released" it. This value serves as a tracker.
 
+        // Flags are packed, none of them is written from both ISR and main context while the other may touch the same block
+        bool recalculate_flag:1;           // Planner flag to recalculate trapezoids on entry junction
+        bool nominal_length_flag:1;        // Planner flag for nominal speed always reached
+        bool is_ready:1;
+
 };
 
 
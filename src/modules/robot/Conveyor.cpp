@@ -17,14 +17,23 @@ using namespace std;
 #include "Block.h"
 #include "Conveyor.h"
 #include "Planner.h"
+#include "Robot.h"
+#include "Stepper.h"
+#include "StepperMotor.h"
 #include "mri.h"
 #include "checksumm.h"
 #include "Config.h"
 #include "libs/StreamOutputPool.h"
 #include "ConfigValue.h"
+#include "platform_memory.h"
+
+#include <new>
 
 #define planner_queue_size_checksum CHECKSUM("planner_queue_size")
 
+// AHB memory left for later users ( panel framebuffer, USB MSD, etc ) when sizing the queue automatically
+#define AHB_QUEUE_RESERVE 2048
+
 /*
  * The conveyor holds the queue of blocks, takes care of creating them, and starting the executing chain of blocks
  *
@@ -55,14 +64,14 @@ using namespace std;
 Conveyor::Conveyor(){
     gc_pending = queue.tail_i;
     running = false;
+    halted = false;
 }
 
 void Conveyor::on_module_loaded(){
     register_for_event(ON_IDLE);
     register_for_event(ON_MAIN_LOOP);
-    register_for_event(ON_CONFIG_RELOAD);
 
-    on_config_reload(this);
+    allocate_queue();
 }
 
 // Delete blocks here, because they can't be deleted in interrupt context ( see Block.cpp:release )
@@ -77,6 +86,14 @@ void Conveyor::on_idle(void* argument){
             // Cleanly delete block
             Block* block = queue.tail_ref();
 //             block->debug();
+
+            // its gcodes are the oldest ones in the gcode queue
+            for (unsigned int i = 0; i < block->gcode_count; i++)
+            {
+                delete *gcode_queue.tail_ref();
+                gcode_queue.consume_tail();
+            }
+
             block->clear();
             queue.consume_tail();
         }
@@ -108,7 +125,7 @@ void Conveyor::on_main_loop(void*)
 
     if (queue.is_empty())
     {
-        if (queue.head_ref()->gcodes.size())
+        if (queue.head_ref()->gcode_count)
         {
             queue_head_block();
             ensure_running();
@@ -119,14 +136,61 @@ void Conveyor::on_main_loop(void*)
         ensure_running();
 }
 
-void Conveyor::on_config_reload(void* argument)
+/*
+ * The queue is allocated once at boot, as blocks can't be moved around once the planner uses them
+ *
+ * It goes in whichever AHB bank has the most room, so the main heap is left alone.
+ * planner_queue_size of 0 ( the default ) sizes it from the memory actually free in that bank,
+ * otherwise the given size is used, and it falls back to the main heap if the bank is too small.
+ */
+void Conveyor::allocate_queue()
 {
-    queue.resize(THEKERNEL->config->value(planner_queue_size_checksum)->by_default(32)->as_number());
+    unsigned int size = THEKERNEL->config->value(planner_queue_size_checksum)->by_default(0)->as_number();
+
+    MemoryPool* pool = (AHB1.free() > AHB0.free()) ? &AHB1 : &AHB0;
+
+    if (size == 0)
+    {
+        uint32_t free = pool->free();
+        size = (free > AHB_QUEUE_RESERVE) ? (free - AHB_QUEUE_RESERVE) / sizeof(Block) : 0;
+        if (size < 32)
+            size = 32;
+    }
+
+    Block* ring = (Block*) pool->alloc(size * sizeof(Block));
+    if (ring != NULL)
+    {
+        for (unsigned int i = 0; i < size; i++)
+            new (&ring[i]) Block();
+        queue.provide(ring, size);
+    }
+    else
+        queue.resize(size);
+
+    // gcodes mostly come one per block, leave room for bursts of non-move gcodes
+    gcode_queue.resize(size * 2);
+
+    gc_pending = queue.tail_i;
 }
 
 void Conveyor::append_gcode(Gcode* gcode)
 {
     gcode->mark_as_taken();
+
+    // make room in the gcode queue. If the head block holds gcodes, those are only freed once it has been
+    // executed, so push it as a non-move block first
+    while (gcode_queue.is_full() && !halted)
+    {
+        if (queue.head_ref()->gcode_count)
+            queue_head_block();
+        ensure_running();
+        THEKERNEL->call_event(ON_IDLE, this);
+    }
+
+    // Gcodes are dropped along with the moves once halted, the queue would not make room for them anyway
+    if (halted)
+        return;
+
     queue.head_ref()->append_gcode(gcode);
 }
 
@@ -152,26 +216,115 @@ void Conveyor::on_block_end(void* block)
 }
 
 // Wait for the queue to be empty
+// Once halted the queue does not run anymore, it is flushed from the main loop instead
 void Conveyor::wait_for_empty_queue()
 {
-    while (!queue.is_empty())
+    while (!queue.is_empty() && !halted)
     {
         ensure_running();
         THEKERNEL->call_event(ON_IDLE, this);
     }
 }
 
+/*
+ * Throw away every queued block, the one being executed included, once the motors have been stopped
+ *
+ * The actuators are moved back by the steps they did not make, so they are where the motors actually stopped.
+ * The gcodes attached to the blocks are not executed, on_idle deletes them with the blocks as usual.
+ */
+void Conveyor::flush_queue()
+{
+    std::vector<StepperMotor*>& actuators = THEKERNEL->robot->actuators;
+    Block* current = THEKERNEL->stepper->current_block;
+
+    __disable_irq();
+    for (unsigned int i = gc_pending; i != queue.head_i; i = queue.next(i))
+    {
+        Block* block = queue.item_ref(i);
+        for (unsigned int m = 0; m < actuators.size(); m++)
+        {
+            StepperMotor* motor = actuators[m];
+            int32_t left = ((block->direction_bits >> m) & 1) ? -(int32_t)block->steps[m] : (int32_t)block->steps[m];
+
+            // Motors stopped with stop() keep how far they got, extruders running ahead or behind included
+            if (block == current && block->steps[m] > 0)
+                left -= motor->direction ? -(int32_t)motor->stepped : (int32_t)motor->stepped;
+
+            motor->last_milestone_steps -= left;
+        }
+    }
+
+    // Linear advance is dropped, the extruders are where their advance steps have taken them
+    for (StepperMotor* motor : actuators)
+    {
+        motor->last_milestone_steps += motor->advance_steps;
+        motor->last_milestone_mm = motor->last_milestone_steps / motor->steps_per_mm;
+        motor->advance_steps = 0;
+        motor->advance_planned = 0;
+        motor->advancing = false;
+    }
+
+    // The executing block ends here, the others were never begun
+    bool executing = current != NULL && current->is_ready;
+    if (executing)
+        current->is_ready = false;
+    gc_pending = queue.head_i;
+    running = false;
+    __enable_irq();
+
+    if (executing)
+        THEKERNEL->call_event(ON_BLOCK_END, current);
+
+    // Modules keeping track of the queued blocks start again from an empty queue
+    THEKERNEL->call_event(ON_QUEUE_FLUSH, this);
+}
+
+/*
+ * Take back the head block instead of pushing it, when halted
+ *
+ * Its steps come back off the actuators, and its gcodes off the gcode queue, as if it had never been prepared.
+ */
+void Conveyor::discard_head_block()
+{
+    std::vector<StepperMotor*>& actuators = THEKERNEL->robot->actuators;
+    Block* block = queue.head_ref();
+
+    for (unsigned int m = 0; m < actuators.size(); m++)
+    {
+        if (block->steps[m] == 0)
+            continue;
+        actuators[m]->last_milestone_steps -= ((block->direction_bits >> m) & 1) ? -(int32_t)block->steps[m] : (int32_t)block->steps[m];
+        actuators[m]->last_milestone_mm = actuators[m]->last_milestone_steps / actuators[m]->steps_per_mm;
+    }
+
+    // its gcodes are the newest ones in the gcode queue
+    for (unsigned int i = 0; i < block->gcode_count; i++)
+    {
+        gcode_queue.head_i = gcode_queue.prev(gcode_queue.head_i);
+        delete *gcode_queue.head_ref();
+    }
+
+    block->clear();
+}
+
 /*
  * push the pre-prepared head block onto the queue
  */
 void Conveyor::queue_head_block()
 {
-    while (queue.is_full())
+    while (queue.is_full() && !halted)
     {
         ensure_running();
         THEKERNEL->call_event(ON_IDLE, this);
     }
 
+    // A limit switch was hit, possibly while waiting for room above, the queue is about to be flushed
+    if (halted)
+    {
+        discard_head_block();
+        return;
+    }
+
     queue.head_ref()->ready();
     queue.produce_head();
 }
@@ -204,3 +357,4 @@ void Conveyor::dump_queue()
 // feels hacky, but apparently the way to do it
 #include "HeapRing.cpp"
 template class HeapRing<Block>;
+template class HeapRing<Gcode*>;
@@ -27,11 +27,12 @@ public:
     void on_idle(void*);
     void on_main_loop(void*);
     void on_block_end(void*);
-    void on_config_reload(void*);
 
     void notify_block_finished(Block*);
 
     void wait_for_empty_queue();
+    void flush_queue();
+    void discard_head_block();
 
     void ensure_running(void);
 
@@ -40,12 +41,16 @@ public:
 
     void dump_queue(void);
 
-    // right now block queue size can only be changed at compile time by changing the value below
+    void allocate_queue(void);
+
     typedef HeapRing<Block> Queue_t;
+    typedef HeapRing<Gcode*> GcodeQueue_t;
 
     Queue_t queue;  // Queue of Blocks
+    GcodeQueue_t gcode_queue; // Gcodes attached to the blocks, in the same order
 
     volatile bool running;
+    volatile bool halted;   // Set by a limit switch, no more blocks are pushed until homing clears it
 
     volatile unsigned int gc_pending;
 };
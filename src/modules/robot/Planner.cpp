@@ -54,14 +54,21 @@ void Planner::on_config_reload(void* argument){
 
 
 // Append a block to the queue, compute it's speed factors
-void Planner::append_block( float actuator_pos[], float rate_mm_s, float distance, float unit_vec[] )
+// acceleration is this block's own limit in mm/s^2, see Robot::append_milestone
+void Planner::append_block( float actuator_pos[], float rate_mm_s, float distance, float unit_vec[], float acceleration )
 {
+    // After a limit switch hit moves are dropped until homing, the actuators stay where the motors stopped
+    if (THEKERNEL->conveyor->halted)
+        return;
+
     // Create ( recycle ) a new block
     Block* block = THEKERNEL->conveyor->queue.head_ref();
 
     // Direction bits
+    int n_motors = THEKERNEL->robot->actuators.size();
     block->direction_bits = 0;
-    for (int i = 0; i < 3; i++)
+    block->steps_event_count = 0;
+    for (int i = 0; i < n_motors; i++)
     {
         int steps = THEKERNEL->robot->actuators[i]->steps_to_target(actuator_pos[i]);
 
@@ -73,12 +80,13 @@ void Planner::append_block( float actuator_pos[], float rate_mm_s, float distanc
         THEKERNEL->robot->actuators[i]->last_milestone_mm = actuator_pos[i];
 
         block->steps[i] = labs(steps);
-    }
 
-    // Max number of steps, for all axes
-    block->steps_event_count = max( block->steps[ALPHA_STEPPER], max( block->steps[BETA_STEPPER], block->steps[GAMMA_STEPPER] ) );
+        // Max number of steps, for all axes
+        block->steps_event_count = max( block->steps_event_count, block->steps[i] );
+    }
 
     block->millimeters = distance;
+    block->acceleration = acceleration;
 
     // Calculate speed in mm/sec for each axis. No divide by zero due to previous checks.
     // NOTE: Minimum stepper speed is limited by MINIMUM_STEPS_PER_MINUTE in stepper.c
@@ -117,9 +125,9 @@ void Planner::append_block( float actuator_pos[], float rate_mm_s, float distanc
         if (previous_nominal_speed > 0.0F) {
             // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
             // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
-            float cos_theta = - this->previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
-                                - this->previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
-                                - this->previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
+            float cos_theta = 0.0F;
+            for (int i = 0; i < n_motors; i++)
+                cos_theta -= this->previous_unit_vec[i] * unit_vec[i];
 
             // Skip and use default max junction speed for 0 degree acute junction.
             if (cos_theta < 0.95F) {
@@ -128,7 +136,7 @@ void Planner::append_block( float actuator_pos[], float rate_mm_s, float distanc
                 if (cos_theta > -0.95F) {
                     // Compute maximum junction velocity based on maximum acceleration and junction deviation
                     float sin_theta_d2 = sqrtf(0.5F * (1.0F - cos_theta)); // Trig half angle identity. Always positive.
-                    vmax_junction = min(vmax_junction, sqrtf(this->acceleration * this->junction_deviation * sin_theta_d2 / (1.0F - sin_theta_d2)));
+                    vmax_junction = min(vmax_junction, sqrtf(acceleration * this->junction_deviation * sin_theta_d2 / (1.0F - sin_theta_d2)));
                 }
             }
         }
@@ -154,7 +162,7 @@ void Planner::append_block( float actuator_pos[], float rate_mm_s, float distanc
     block->recalculate_flag = true;
 
     // Update previous path unit_vector and nominal speed
-    memcpy(this->previous_unit_vec, unit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = unit_vec[]
+    memcpy(this->previous_unit_vec, unit_vec, n_motors * sizeof(float)); // previous_unit_vec[] = unit_vec[]
 
     // Math-heavy re-computing of the whole queue to take the new
     this->recalculate();
@@ -17,7 +17,7 @@ class Block;
 class Planner : public Module {
     public:
         Planner();
-        void append_block( float target[], float rate_mm_s, float distance, float unit_vec[] );
+        void append_block( float target[], float rate_mm_s, float distance, float unit_vec[], float acceleration );
         float max_allowable_speed( float acceleration, float target_velocity, float distance);
         void recalculate();
         Block* get_current_block();
@@ -25,7 +25,7 @@ class Planner : public Module {
         void on_module_loaded();
         void on_config_reload(void* argument);
 
-        float previous_unit_vec[3];
+        float previous_unit_vec[MAX_ROBOT_ACTUATORS];
         Block last_deleted_block;     // Item -1 in the queue, TODO: Grbl does not need this, but Smoothie won't work without it, we are probably doing something wrong
         bool has_deleted_block;       // Flag for above value
 
@@ -27,7 +27,9 @@ using std::string;
 #include "arm_solutions/RostockSolution.h"
 #include "arm_solutions/JohannKosselSolution.h"
 #include "arm_solutions/HBotSolution.h"
+#include "BedMesh.h"
 #include "StepTicker.h"
+#include "Stepper.h"
 #include "checksumm.h"
 #include "utils.h"
 #include "ConfigValue.h"
@@ -38,9 +40,17 @@ using std::string;
 #define  delta_segments_per_second_checksum  CHECKSUM("delta_segments_per_second")
 #define  mm_per_arc_segment_checksum         CHECKSUM("mm_per_arc_segment")
 #define  arc_correction_checksum             CHECKSUM("arc_correction")
+#define  mm_max_arc_error_checksum           CHECKSUM("mm_max_arc_error")
+#define  arc_segment_min_ms_checksum         CHECKSUM("arc_segment_min_ms")
+#define  segment_merge_tolerance_checksum    CHECKSUM("segment_merge_tolerance")
+#define  segment_merge_max_length_checksum   CHECKSUM("segment_merge_max_length")
+#define  bed_mesh_file_checksum              CHECKSUM("bed_mesh_file")
 #define  x_axis_max_speed_checksum           CHECKSUM("x_axis_max_speed")
 #define  y_axis_max_speed_checksum           CHECKSUM("y_axis_max_speed")
 #define  z_axis_max_speed_checksum           CHECKSUM("z_axis_max_speed")
+#define  x_axis_max_acceleration_checksum    CHECKSUM("x_axis_max_acceleration")
+#define  y_axis_max_acceleration_checksum    CHECKSUM("y_axis_max_acceleration")
+#define  z_axis_max_acceleration_checksum    CHECKSUM("z_axis_max_acceleration")
 
 // arm solutions
 #define  arm_solution_checksum               CHECKSUM("arm_solution")
@@ -71,6 +81,10 @@ using std::string;
 #define  beta_max_rate_checksum              CHECKSUM("beta_max_rate")
 #define  gamma_max_rate_checksum             CHECKSUM("gamma_max_rate")
 
+#define  alpha_max_acceleration_checksum     CHECKSUM("alpha_max_acceleration")
+#define  beta_max_acceleration_checksum      CHECKSUM("beta_max_acceleration")
+#define  gamma_max_acceleration_checksum     CHECKSUM("gamma_max_acceleration")
+
 
 // new-style actuator stuff
 #define  actuator_checksum                   CHEKCSUM("actuator")
@@ -86,6 +100,9 @@ using std::string;
 #define  beta_checksum                       CHECKSUM("beta")
 #define  gamma_checksum                      CHECKSUM("gamma")
 
+// optional actuators for the A B C axes, configured as <name>_step_pin etc.
+static const char* const extra_actuator_names[] = { "delta", "epsilon", "zeta" };
+
 
 // The Robot converts GCodes into actual movements, and then adds them to the Planner, which passes them to the Conveyor so they can be added to the queue
 // It takes care of cutting arcs into segments, same thing for line that are too long
@@ -94,10 +111,17 @@ using std::string;
 Robot::Robot(){
     this->inch_mode = false;
     this->absolute_mode = true;
+    this->e_absolute_mode = true;
     this->motion_mode =  MOTION_MODE_SEEK;
     this->select_plane(X_AXIS, Y_AXIS, Z_AXIS);
     clear_vector(this->last_milestone);
+    clear_vector(this->planned_milestone);
     this->arm_solution = NULL;
+    this->bed_mesh = new BedMesh();
+    this->n_axes = 3;
+    this->merged_count = 0;
+    this->arc_segments = 0;
+    this->line_segments = 0;
     seconds_per_minute = 60.0F;
 }
 
@@ -105,6 +129,7 @@ Robot::Robot(){
 void Robot::on_module_loaded() {
     register_for_event(ON_CONFIG_RELOAD);
     this->register_for_event(ON_GCODE_RECEIVED);
+    this->register_for_event(ON_MAIN_LOOP);
     this->register_for_event(ON_GET_PUBLIC_DATA);
     this->register_for_event(ON_SET_PUBLIC_DATA);
 
@@ -121,8 +146,10 @@ void Robot::on_config_reload(void* argument){
     if (this->arm_solution) delete this->arm_solution;
     int solution_checksum = get_checksum(THEKERNEL->config->value(arm_solution_checksum)->by_default("cartesian")->as_string());
     // Note checksums are not const expressions when in debug mode, so don't use switch
+    this->arm_solution_kind = ARM_SOLUTION_OTHER;
     if(solution_checksum == hbot_checksum || solution_checksum == corexy_checksum) {
         this->arm_solution = new HBotSolution(THEKERNEL->config);
+        this->arm_solution_kind = ARM_SOLUTION_HBOT;
 
     }else if(solution_checksum == rostock_checksum) {
         this->arm_solution = new RostockSolution(THEKERNEL->config);
@@ -137,11 +164,9 @@ void Robot::on_config_reload(void* argument){
     }else if(solution_checksum == rotatable_cartesian_checksum) {
         this->arm_solution = new RotatableCartesianSolution(THEKERNEL->config);
 
-    }else if(solution_checksum == cartesian_checksum) {
-        this->arm_solution = new CartesianSolution(THEKERNEL->config);
-
     }else{
         this->arm_solution = new CartesianSolution(THEKERNEL->config);
+        this->arm_solution_kind = ARM_SOLUTION_CARTESIAN;
     }
 
 
@@ -151,11 +176,23 @@ void Robot::on_config_reload(void* argument){
     this->delta_segments_per_second = THEKERNEL->config->value(delta_segments_per_second_checksum )->by_default(0.0f   )->as_number();
     this->mm_per_arc_segment  = THEKERNEL->config->value(mm_per_arc_segment_checksum  )->by_default(    0.5f)->as_number();
     this->arc_correction      = THEKERNEL->config->value(arc_correction_checksum      )->by_default(    5   )->as_number();
+    this->mm_max_arc_error    = THEKERNEL->config->value(mm_max_arc_error_checksum    )->by_default(    0.0f)->as_number();
+    this->arc_segment_min_ms  = THEKERNEL->config->value(arc_segment_min_ms_checksum  )->by_default(    0.0f)->as_number();
+    this->segment_merge_tolerance  = THEKERNEL->config->value(segment_merge_tolerance_checksum  )->by_default(0.0F)->as_number();
+    this->segment_merge_max_length = THEKERNEL->config->value(segment_merge_max_length_checksum )->by_default(0.0F)->as_number();
+
+    // A mesh probed by G29 is kept between boots
+    this->bed_mesh_file = THEKERNEL->config->value(bed_mesh_file_checksum)->by_default("/sd/bed_mesh.bin")->as_string();
+    this->bed_mesh->load(this->bed_mesh_file.c_str());
 
     this->max_speeds[X_AXIS]  = THEKERNEL->config->value(x_axis_max_speed_checksum    )->by_default(60000.0F)->as_number() / 60.0F;
     this->max_speeds[Y_AXIS]  = THEKERNEL->config->value(y_axis_max_speed_checksum    )->by_default(60000.0F)->as_number() / 60.0F;
     this->max_speeds[Z_AXIS]  = THEKERNEL->config->value(z_axis_max_speed_checksum    )->by_default(  300.0F)->as_number() / 60.0F;
 
+    this->max_accelerations[X_AXIS] = THEKERNEL->config->value(x_axis_max_acceleration_checksum)->by_default(0.0F)->as_number();
+    this->max_accelerations[Y_AXIS] = THEKERNEL->config->value(y_axis_max_acceleration_checksum)->by_default(0.0F)->as_number();
+    this->max_accelerations[Z_AXIS] = THEKERNEL->config->value(z_axis_max_acceleration_checksum)->by_default(0.0F)->as_number();
+
     Pin alpha_step_pin;
     Pin alpha_dir_pin;
     Pin alpha_en_pin;
@@ -196,17 +233,95 @@ void Robot::on_config_reload(void* argument){
     beta_stepper_motor->max_rate  = THEKERNEL->config->value(beta_max_rate_checksum )->by_default(30000.0F)->as_number() / 60.0F;
     gamma_stepper_motor->max_rate = THEKERNEL->config->value(gamma_max_rate_checksum)->by_default(30000.0F)->as_number() / 60.0F;
 
+    alpha_stepper_motor->acceleration = THEKERNEL->config->value(alpha_max_acceleration_checksum)->by_default(0.0F)->as_number();
+    beta_stepper_motor->acceleration  = THEKERNEL->config->value(beta_max_acceleration_checksum )->by_default(0.0F)->as_number();
+    gamma_stepper_motor->acceleration = THEKERNEL->config->value(gamma_max_acceleration_checksum)->by_default(0.0F)->as_number();
+
+    // The extruder motors are registered by the Extruder modules, keep them at the end of the list
+    std::vector<StepperMotor*> extruder_motors;
+    if (actuators.size() > this->n_axes)
+        extruder_motors.assign(actuators.begin() + this->n_axes, actuators.end());
+
     actuators.clear();
     actuators.push_back(alpha_stepper_motor);
     actuators.push_back(beta_stepper_motor);
     actuators.push_back(gamma_stepper_motor);
 
+    // The A B C axes each get their own actuator, in order, only if its step pin is set
+    for (unsigned int i = 0; i < sizeof(extra_actuator_names) / sizeof(extra_actuator_names[0]); i++) {
+        StepperMotor* motor = this->load_extra_actuator(extra_actuator_names[i]);
+        if (motor == NULL) break;
+        actuators.push_back(motor);
+    }
+    this->n_axes = actuators.size();
+    actuators.insert(actuators.end(), extruder_motors.begin(), extruder_motors.end());
+
     // initialise actuator positions to current cartesian position (X0 Y0 Z0)
     // so the first move can be correct if homing is not performed
+    this->update_actuator_positions();
+}
+
+// Take the position of the first three axes back from where the actuators are, after moves planned straight to the actuators
+// The actuators are left exactly where their steps have them, and the bed mesh is taken back out of Z
+void Robot::reset_position_from_actuators(){
     float actuator_pos[3];
-    arm_solution->cartesian_to_actuator(last_milestone, actuator_pos);
+    float position[3];
+    for (int i = 0; i < 3; i++)
+        actuator_pos[i] = actuators[i]->last_milestone_mm;
+    arm_solution->actuator_to_cartesian(actuator_pos, position);
+    if( this->bed_mesh->active )
+        position[Z_AXIS] -= this->bed_mesh->get_height(position[X_AXIS], position[Y_AXIS]);
+
+    for (int i = X_AXIS; i <= Z_AXIS; i++)
+        this->last_milestone[i] = this->planned_milestone[i] = position[i];
+}
+
+// Make the actuator for an A B C axis from the <name>_step_pin etc. settings, returns NULL if it is not configured
+StepperMotor* Robot::load_extra_actuator(const char* name){
+    string prefix(name);
+    Pin step_pin, dir_pin, en_pin;
+
+    step_pin.from_string( THEKERNEL->config->value(get_checksum(prefix + "_step_pin"))->by_default("nc")->as_string());
+    if (!step_pin.connected()) return NULL;
+
+    step_pin.as_output();
+    dir_pin.from_string(  THEKERNEL->config->value(get_checksum(prefix + "_dir_pin" ))->by_default("nc")->as_string())->as_output();
+    en_pin.from_string(   THEKERNEL->config->value(get_checksum(prefix + "_en_pin"  ))->by_default("nc")->as_string())->as_output();
+
+    StepperMotor* motor = THEKERNEL->step_ticker->add_stepper_motor( new StepperMotor(step_pin, dir_pin, en_pin) );
+    motor->change_steps_per_mm(THEKERNEL->config->value(get_checksum(prefix + "_steps_per_mm"))->by_default(80.0F)->as_number());
+    motor->max_rate     = THEKERNEL->config->value(get_checksum(prefix + "_max_rate"        ))->by_default(30000.0F)->as_number() / 60.0F;
+    motor->acceleration = THEKERNEL->config->value(get_checksum(prefix + "_max_acceleration"))->by_default(0.0F)->as_number();
+    return motor;
+}
+
+// Tell the actuators where they are for the current position
+// The first three go through the arm solution, the A B C axes and the extruders map one to one to their actuator
+// The nozzle follows the bed mesh, so Z is leveled here the same way plan_milestone does it
+void Robot::update_actuator_positions(){
+    float actuator_pos[3];
+    float position[3] = { last_milestone[X_AXIS], last_milestone[Y_AXIS], last_milestone[Z_AXIS] };
+    if( this->bed_mesh->active )
+        position[Z_AXIS] += this->bed_mesh->get_height(position[X_AXIS], position[Y_AXIS]);
+    arm_solution->cartesian_to_actuator(position, actuator_pos);
+
     for (int i = 0; i < 3; i++)
         actuators[i]->change_last_milestone(actuator_pos[i]);
+    for (unsigned int i = 3; i < actuators.size(); i++)
+        actuators[i]->change_last_milestone(last_milestone[i]);
+}
+
+// Called by the Extruder modules, their motor is then planned and stepped along with the axes, following the E word
+// Every extruder gets the same E moves, as there is no tool selection yet
+bool Robot::add_extruder_motor(StepperMotor* motor){
+    if (actuators.size() >= MAX_ROBOT_ACTUATORS) return false;
+
+    int i = actuators.size();
+    this->last_milestone[i] = this->planned_milestone[i] = ( i > this->n_axes ? this->last_milestone[this->n_axes] : 0.0F );
+    motor->change_last_milestone(this->last_milestone[i]);
+    motor->attach(THEKERNEL->stepper, &Stepper::stepper_motor_finished_move );
+    actuators.push_back(motor);
+    return true;
 }
 
 void Robot::on_get_public_data(void* argument){
@@ -256,6 +371,14 @@ void Robot::on_gcode_received(void * argument){
     uint8_t next_action = NEXT_ACTION_DEFAULT;
     this->motion_mode = -1;
 
+    // A move still being cut into segments must reach the queue before anything else does
+    this->generate_arc_segments(true);
+    this->generate_line_segments(true);
+
+    // Only plain G0/G1 moves can be coalesced, anything else must see the pending line in the queue first
+    if( !(gcode->has_g && (gcode->g == 0 || gcode->g == 1) && !gcode->has_letter('E') && !gcode->has_letter('S')) )
+        this->flush_merged_line();
+
    //G-letter Gcodes are mostly what the Robot module is interrested in, other modules also catch the gcode event and do stuff accordingly
     if( gcode->has_g){
         switch( gcode->g ){
@@ -268,8 +391,8 @@ void Robot::on_gcode_received(void * argument){
             case 19: this->select_plane(Y_AXIS, Z_AXIS, X_AXIS); gcode->mark_as_taken();  break;
             case 20: this->inch_mode = true; gcode->mark_as_taken();  break;
             case 21: this->inch_mode = false; gcode->mark_as_taken();  break;
-            case 90: this->absolute_mode = true; gcode->mark_as_taken();  break;
-            case 91: this->absolute_mode = false; gcode->mark_as_taken();  break;
+            case 90: this->absolute_mode = true; this->e_absolute_mode = true; gcode->mark_as_taken();  break;
+            case 91: this->absolute_mode = false; this->e_absolute_mode = false; gcode->mark_as_taken();  break;
             case 92: {
                 if(gcode->get_num_args() == 0){
                     clear_vector(this->last_milestone);
@@ -278,14 +401,19 @@ void Robot::on_gcode_received(void * argument){
                         if ( gcode->has_letter(letter) )
                             this->last_milestone[letter-'X'] = this->to_millimeters(gcode->get_value(letter));
                     }
+                    for (int axis = A_AXIS; axis < this->n_axes; axis++){
+                        if ( gcode->has_letter('A' + axis - A_AXIS) )
+                            this->last_milestone[axis] = this->to_millimeters(gcode->get_value('A' + axis - A_AXIS));
+                    }
+                    if ( gcode->has_letter('E') ){
+                        for (unsigned int i = this->n_axes; i < actuators.size(); i++)
+                            this->last_milestone[i] = gcode->get_value('E');
+                    }
                 }
 
-                // TODO: handle any number of actuators
-                float actuator_pos[3];
-                arm_solution->cartesian_to_actuator(last_milestone, actuator_pos);
+                memcpy(this->planned_milestone, this->last_milestone, sizeof(this->planned_milestone));
 
-                for (int i = 0; i < 3; i++)
-                    actuators[i]->change_last_milestone(actuator_pos[i]);
+                this->update_actuator_positions();
 
                 gcode->mark_as_taken();
                 return;
@@ -307,18 +435,52 @@ void Robot::on_gcode_received(void * argument){
                 gcode->add_nl = true;
                 gcode->mark_as_taken();
                 return;
+            case 82: this->e_absolute_mode = true; gcode->mark_as_taken(); break;
+            case 83: this->e_absolute_mode = false; gcode->mark_as_taken(); break;
+
+            case 420: // M420 - S1 applies the bed mesh, S0 stops applying it
+                if (gcode->has_letter('S'))
+                    this->bed_mesh->active = gcode->get_value('S') != 0 && this->bed_mesh->size[0] > 0;
+                gcode->stream->printf("Bed mesh %s ", this->bed_mesh->active ? "on" : "off");
+                gcode->add_nl = true;
+                gcode->mark_as_taken();
+                return;
+
             case 114:
                 {
-                    char buf[32];
+                    char buf[64];
                     int n= snprintf(buf, sizeof(buf), "C: X:%1.3f Y:%1.3f Z:%1.3f",
                                                 from_millimeters(this->last_milestone[0]),
                                                 from_millimeters(this->last_milestone[1]),
                                                 from_millimeters(this->last_milestone[2]));
+                    if (this->has_extruders())
+                        n += snprintf(buf + n, sizeof(buf) - n, " E:%1.3f", this->last_milestone[this->n_axes]);
                     gcode->txt_after_ok.append(buf, n);
                     gcode->mark_as_taken();
                 }
                 return;
 
+            case 201: // M201 Set maximum accelerations in mm/sec^2, 0 for no limit
+                if (gcode->has_letter('X'))
+                    this->max_accelerations[X_AXIS]= gcode->get_value('X');
+                if (gcode->has_letter('Y'))
+                    this->max_accelerations[Y_AXIS]= gcode->get_value('Y');
+                if (gcode->has_letter('Z'))
+                    this->max_accelerations[Z_AXIS]= gcode->get_value('Z');
+                if (gcode->has_letter('A'))
+                    alpha_stepper_motor->acceleration= gcode->get_value('A');
+                if (gcode->has_letter('B'))
+                    beta_stepper_motor->acceleration= gcode->get_value('B');
+                if (gcode->has_letter('C'))
+                    gamma_stepper_motor->acceleration= gcode->get_value('C');
+
+                gcode->stream->printf("X:%g Y:%g Z:%g  A:%g B:%g C:%g ",
+                    this->max_accelerations[X_AXIS], this->max_accelerations[Y_AXIS], this->max_accelerations[Z_AXIS],
+                    alpha_stepper_motor->acceleration, beta_stepper_motor->acceleration, gamma_stepper_motor->acceleration);
+                gcode->add_nl = true;
+                gcode->mark_as_taken();
+                break;
+
             case 203: // M203 Set maximum feedrates in mm/sec
                 if (gcode->has_letter('X'))
                     this->max_speeds[X_AXIS]= gcode->get_value('X');
@@ -400,6 +562,9 @@ void Robot::on_gcode_received(void * argument){
             case 503: // M503 just prints the settings
                 gcode->stream->printf(";Steps per unit:\nM92 X%1.5f Y%1.5f Z%1.5f\n", actuators[0]->steps_per_mm, actuators[1]->steps_per_mm, actuators[2]->steps_per_mm);
                 gcode->stream->printf(";Acceleration mm/sec^2:\nM204 S%1.5f\n", THEKERNEL->planner->acceleration);
+                gcode->stream->printf(";Max accelerations in mm/sec^2, XYZ cartesian, ABC actuator, 0 for no limit:\nM201 X%1.5f Y%1.5f Z%1.5f A%1.5f B%1.5f C%1.5f\n",
+                    this->max_accelerations[X_AXIS], this->max_accelerations[Y_AXIS], this->max_accelerations[Z_AXIS],
+                    alpha_stepper_motor->acceleration, beta_stepper_motor->acceleration, gamma_stepper_motor->acceleration);
                 gcode->stream->printf(";X- Junction Deviation, S - Minimum Planner speed:\nM205 X%1.5f S%1.5f\n", THEKERNEL->planner->junction_deviation, THEKERNEL->planner->minimum_planner_speed);
                 gcode->stream->printf(";Max feedrates in mm/sec, XYZ cartesian, ABC actuator:\nM203 X%1.5f Y%1.5f Z%1.5f A%1.5f B%1.5f C%1.5f\n",
                     this->max_speeds[X_AXIS], this->max_speeds[Y_AXIS], this->max_speeds[Z_AXIS],
@@ -436,7 +601,7 @@ void Robot::on_gcode_received(void * argument){
         return;
 
    //Get parameters
-    float target[3], offset[3];
+    float target[MAX_ROBOT_ACTUATORS], offset[3];
     clear_vector(offset);
 
     memcpy(target, this->last_milestone, sizeof(target));    //default to last target
@@ -451,6 +616,16 @@ void Robot::on_gcode_received(void * argument){
             target[letter-'X'] = this->to_millimeters(gcode->get_value(letter)) + ( this->absolute_mode ? 0 : target[letter-'X']);
         }
     }
+    for(int axis = A_AXIS; axis < this->n_axes; axis++){
+        char letter = 'A' + axis - A_AXIS;
+        if( gcode->has_letter(letter) ){
+            target[axis] = this->to_millimeters(gcode->get_value(letter)) + ( this->absolute_mode ? 0 : target[axis]);
+        }
+    }
+    if( gcode->has_letter('E') ){
+        for(unsigned int i = this->n_axes; i < actuators.size(); i++)
+            target[i] = gcode->get_value('E') + ( this->e_absolute_mode ? 0 : target[i]);
+    }
 
     if( gcode->has_letter('F') )
     {
@@ -460,6 +635,11 @@ void Robot::on_gcode_received(void * argument){
             this->feed_rate = this->to_millimeters( gcode->get_value('F') );
     }
 
+    // After a limit switch hit moves are dropped until homing, and the position stays where the motors stopped
+    if( THEKERNEL->conveyor->halted ){
+        return;
+    }
+
     //Perform any physical actions
     switch( next_action ){
         case NEXT_ACTION_DEFAULT:
@@ -479,6 +659,16 @@ void Robot::on_gcode_received(void * argument){
 
 }
 
+void Robot::on_main_loop(void* argument){
+    // Keep feeding the segments of a pending move as the queue frees up
+    this->generate_arc_segments(false);
+    this->generate_line_segments(false);
+
+    // If the queue ran dry there is no point holding on to a coalesced line, the host is not keeping up anyway
+    if( this->merged_count > 0 && !this->is_segmenting() && !THEKERNEL->conveyor->running )
+        this->flush_merged_line();
+}
+
 // We received a new gcode, and one of the functions
 // determined the distance for that given gcode. So now we can attach this gcode to the right block
 // and continue
@@ -488,66 +678,174 @@ void Robot::distance_in_gcode_is_known(Gcode* gcode){
     THEKERNEL->conveyor->append_gcode(gcode);
 }
 
+// Hand the planner everything still held back, for modules that then wait for the queue to empty before moving on their own
+void Robot::flush_moves(){
+    this->flush_merged_line();
+    this->generate_arc_segments(true);
+    this->generate_line_segments(true);
+}
+
+// Forget the moves not handed to the planner yet, and take the position back from the actuators
+// Used once the queue has been flushed, the actuators are then where the motors stopped
+void Robot::discard_moves(){
+    this->merged_count = 0;
+    this->arc_segments = 0;
+    this->line_segments = 0;
+
+    float actuator_pos[3];
+    for (int i = X_AXIS; i <= Z_AXIS; i++)
+        actuator_pos[i] = actuators[i]->last_milestone_mm;
+    arm_solution->actuator_to_cartesian(actuator_pos, this->last_milestone);
+    if( this->bed_mesh->active )
+        this->last_milestone[Z_AXIS] -= this->bed_mesh->get_height(this->last_milestone[X_AXIS], this->last_milestone[Y_AXIS]);
+    for (unsigned int i = Z_AXIS + 1; i < actuators.size(); i++)
+        this->last_milestone[i] = actuators[i]->last_milestone_mm;
+
+    memcpy(this->planned_milestone, this->last_milestone, sizeof(this->planned_milestone));
+}
+
 // Reset the position for all axes ( used in homing and G92 stuff )
 void Robot::reset_axis_position(float position, int axis) {
     this->last_milestone[axis] = position;
+    this->planned_milestone[axis] = position;
 
-    float actuator_pos[3];
-    arm_solution->cartesian_to_actuator(last_milestone, actuator_pos);
+    this->update_actuator_positions();
+}
 
-    for (int i = 0; i < 3; i++)
-        actuators[i]->change_last_milestone(actuator_pos[i]);
+// Acceleration limit in mm/s^2 of an actuator moved on its own, as when homing, 0 for no limit
+// On a cartesian machine the first three actuators are the axes, so their axis limits apply too
+float Robot::actuator_max_acceleration(int actuator)
+{
+    float max_acceleration = actuators[actuator]->acceleration;
+    if ( this->arm_solution_kind == ARM_SOLUTION_CARTESIAN && actuator <= Z_AXIS && max_accelerations[actuator] > 0 &&
+         (max_acceleration <= 0 || max_accelerations[actuator] < max_acceleration) )
+        max_acceleration = max_accelerations[actuator];
+    return max_acceleration;
 }
 
 
-// Convert target from millimeters to steps, and append this to the planner
+// Append a move to the planner, cut where it crosses the lines of the bed mesh
 void Robot::append_milestone( float target[], float rate_mm_s )
 {
-    float deltas[3];
-    float unit_vec[3];
-    float actuator_pos[3];
-    float millimeters_of_travel;
+    if( this->bed_mesh->active ){
+        float t;
+        while( (t = this->bed_mesh->next_line(this->planned_milestone, target)) < 1.0F ){
+            float point[MAX_ROBOT_ACTUATORS];
+            for (unsigned int i = 0; i < actuators.size(); i++)
+                point[i] = this->planned_milestone[i] + t * ( target[i] - this->planned_milestone[i] );
+            this->plan_milestone(point, rate_mm_s);
+        }
+    }
+    this->plan_milestone(target, rate_mm_s);
+}
+
+// Convert target from millimeters to steps, and append this to the planner
+void Robot::plan_milestone( float target[], float rate_mm_s )
+{
+    float deltas[MAX_ROBOT_ACTUATORS];
+    float unit_vec[MAX_ROBOT_ACTUATORS];
+    float actuator_pos[MAX_ROBOT_ACTUATORS];
+    float millimeters_of_travel = 0.0F;
+    int n_motors = actuators.size();
 
     // find distance moved by each axis
-    for (int axis = X_AXIS; axis <= Z_AXIS; axis++)
-        deltas[axis] = target[axis] - last_milestone[axis];
+    for (int axis = X_AXIS; axis < n_motors; axis++) {
+        deltas[axis] = target[axis] - planned_milestone[axis];
+        if (axis < this->n_axes)
+            millimeters_of_travel += deltas[axis] * deltas[axis];
+    }
 
     // Compute how long this move moves, so we can attach it to the block for later use
-    millimeters_of_travel = sqrtf( pow( deltas[X_AXIS], 2 ) +  pow( deltas[Y_AXIS], 2 ) +  pow( deltas[Z_AXIS], 2 ) );
+    millimeters_of_travel = sqrtf( millimeters_of_travel );
+
+    // The extruders only set the length of moves they make alone, and only weigh in the junctions of those
+    bool extruder_only = millimeters_of_travel < 0.0001F && n_motors > this->n_axes && fabs(deltas[this->n_axes]) > millimeters_of_travel;
+    if (extruder_only)
+        millimeters_of_travel = fabs(deltas[this->n_axes]);
 
     // find distance unit vector
-    for (int i = 0; i < 3; i++)
-        unit_vec[i] = deltas[i] / millimeters_of_travel;
+    for (int i = 0; i < n_motors; i++)
+        unit_vec[i] = (i < this->n_axes || extruder_only) ? deltas[i] / millimeters_of_travel : 0.0F;
+
+    // On a cartesian machine the first three actuators are the axes, so their limits are checked here along with the axes'
+    // Unless the bed mesh moves Z away from the axis
+    bool cartesian = this->arm_solution_kind == ARM_SOLUTION_CARTESIAN && !this->bed_mesh->active;
 
     // Do not move faster than the configured cartesian limits
     for (int axis = X_AXIS; axis <= Z_AXIS; axis++)
     {
-        if ( max_speeds[axis] > 0 )
+        float max_speed = max_speeds[axis];
+        if ( cartesian && (max_speed <= 0 || actuators[axis]->max_rate < max_speed) )
+            max_speed = actuators[axis]->max_rate;
+
+        if ( max_speed > 0 )
         {
             float axis_speed = fabs(unit_vec[axis] * rate_mm_s);
 
-            if (axis_speed > max_speeds[axis])
-                rate_mm_s *= ( max_speeds[axis] / axis_speed );
+            if (axis_speed > max_speed)
+                rate_mm_s *= ( max_speed / axis_speed );
+        }
+    }
+
+    // Do not accelerate faster than the configured cartesian limits either
+    float acceleration = THEKERNEL->planner->acceleration;
+    for (int axis = X_AXIS; axis <= Z_AXIS; axis++)
+    {
+        float max_acceleration = max_accelerations[axis];
+        if ( cartesian && actuators[axis]->acceleration > 0 && (max_acceleration <= 0 || actuators[axis]->acceleration < max_acceleration) )
+            max_acceleration = actuators[axis]->acceleration;
+
+        if ( max_acceleration > 0 )
+        {
+            float axis_acceleration = fabs(unit_vec[axis] * acceleration);
+
+            if (axis_acceleration > max_acceleration)
+                acceleration *= ( max_acceleration / axis_acceleration );
         }
     }
 
-    // find actuator position given cartesian position
-    arm_solution->cartesian_to_actuator( target, actuator_pos );
+    // find actuator position given cartesian position, the A B C axes drive their actuator directly
+    // The common solutions are called directly so they inline, the others go through the virtual call
+    // The bed mesh only moves the actuators, our positions stay where the gcode put them
+    float* position = target;
+    float leveled[3];
+    if( this->bed_mesh->active ){
+        leveled[X_AXIS] = target[X_AXIS];
+        leveled[Y_AXIS] = target[Y_AXIS];
+        leveled[Z_AXIS] = target[Z_AXIS] + this->bed_mesh->get_height(target[X_AXIS], target[Y_AXIS]);
+        position = leveled;
+    }
+    switch( this->arm_solution_kind ){
+        case ARM_SOLUTION_CARTESIAN: memcpy(actuator_pos, position, 3 * sizeof(float)); break;
+        case ARM_SOLUTION_HBOT: static_cast<HBotSolution*>(arm_solution)->HBotSolution::cartesian_to_actuator( position, actuator_pos ); break;
+        default: arm_solution->cartesian_to_actuator( position, actuator_pos ); break;
+    }
+    for (int actuator = 3; actuator < n_motors; actuator++)
+        actuator_pos[actuator] = target[actuator];
 
-    // check per-actuator speed limits
-    for (int actuator = 0; actuator <= 2; actuator++)
+    // check per-actuator speed and acceleration limits
+    for (int actuator = cartesian ? 3 : 0; actuator < n_motors; actuator++)
     {
-        float actuator_rate  = fabs(actuator_pos[actuator] - actuators[actuator]->last_milestone_mm) * rate_mm_s / millimeters_of_travel;
+        float actuator_ratio = fabs(actuator_pos[actuator] - actuators[actuator]->last_milestone_mm) / millimeters_of_travel;
+        float actuator_rate  = actuator_ratio * rate_mm_s;
 
         if (actuator_rate > actuators[actuator]->max_rate)
             rate_mm_s *= (actuators[actuator]->max_rate / actuator_rate);
+
+        if (actuators[actuator]->acceleration > 0)
+        {
+            float actuator_acceleration = actuator_ratio * acceleration;
+
+            if (actuator_acceleration > actuators[actuator]->acceleration)
+                acceleration *= (actuators[actuator]->acceleration / actuator_acceleration);
+        }
     }
 
     // Append the block to the planner
-    THEKERNEL->planner->append_block( actuator_pos, rate_mm_s, millimeters_of_travel, unit_vec );
+    THEKERNEL->planner->append_block( actuator_pos, rate_mm_s, millimeters_of_travel, unit_vec, acceleration );
 
-    // Update the last_milestone to the current target for the next time we use last_milestone
-    memcpy(this->last_milestone, target, sizeof(this->last_milestone)); // this->last_milestone[] = target[];
+    // Update the planned_milestone to the current target for the next time we use planned_milestone
+    memcpy(this->planned_milestone, target, sizeof(this->planned_milestone)); // this->planned_milestone[] = target[];
 
 }
 
@@ -555,29 +853,133 @@ void Robot::append_milestone( float target[], float rate_mm_s )
 void Robot::append_line(Gcode* gcode, float target[], float rate_mm_s ){
 
     // Find out the distance for this gcode
-    gcode->millimeters_of_travel = pow( target[X_AXIS]-this->last_milestone[X_AXIS], 2 ) +  pow( target[Y_AXIS]-this->last_milestone[Y_AXIS], 2 ) +  pow( target[Z_AXIS]-this->last_milestone[Z_AXIS], 2 );
+    gcode->millimeters_of_travel = 0.0F;
+    for (int axis = X_AXIS; axis < this->n_axes; axis++)
+        gcode->millimeters_of_travel += ( target[axis]-this->last_milestone[axis] ) * ( target[axis]-this->last_milestone[axis] );
+
+    gcode->millimeters_of_travel = sqrtf(gcode->millimeters_of_travel);
+    float millimeters_of_travel = gcode->millimeters_of_travel;
 
-    // We ignore non-moves ( for example, extruder moves are not XYZ moves )
-    if( gcode->millimeters_of_travel < 1e-8F ){
+    // Moves of the extruders alone are planned over the length of filament they feed
+    if( millimeters_of_travel < 0.0001F && this->has_extruders() )
+        millimeters_of_travel = fabs(target[this->n_axes] - this->last_milestone[this->n_axes]);
+
+    // We ignore non-moves
+    if( millimeters_of_travel < 0.0001F ){
         return;
     }
 
-    gcode->millimeters_of_travel = sqrtf(gcode->millimeters_of_travel);
+    if( this->segment_merge_tolerance > 0.0F && !gcode->has_letter('E') && !gcode->has_letter('S') ){
+        // Extend the pending line if this move stays within tolerance of it, its gcode then rides on the same block
+        if( this->merge_line(target, rate_mm_s) ){
+            this->distance_in_gcode_is_known( gcode );
+            return;
+        }
+
+        // Otherwise plan what we have so far, and start a new line with this move
+        this->flush_merged_line();
+        this->distance_in_gcode_is_known( gcode );
+
+        memcpy(this->merge_points[0], this->last_milestone, sizeof(this->merge_points[0]));
+        memcpy(this->merge_points[1], target, sizeof(this->merge_points[1]));
+        this->merged_count = 1;
+        this->merge_motion_mode = this->motion_mode;
+        this->merge_rate = rate_mm_s;
+        return;
+    }
 
     // Mark the gcode as having a known distance
     this->distance_in_gcode_is_known( gcode );
 
+    // A raster row is a single block whatever the segmentation, the laser spreads its pixels over the steps of that block
+    if( gcode->has_letter('Q') && gcode->get_value('Q') == 1 ){
+        this->generate_line_segments(true);
+        this->plan_milestone( target, rate_mm_s );
+        THEKERNEL->conveyor->ensure_running();
+        return;
+    }
+
+    this->append_segmented_line( target, rate_mm_s, millimeters_of_travel );
+}
+
+// Try to coalesce a move from the end of the pending line to target into that line
+// Returns false if any of the coalesced points would end up further than segment_merge_tolerance from the new line
+bool Robot::merge_line( float target[], float rate_mm_s ){
+    uint8_t n = this->merged_count;
+    if( n == 0 || n >= MAX_MERGED_SEGMENTS || this->motion_mode != this->merge_motion_mode || rate_mm_s != this->merge_rate ){ return false; }
+
+    // The gcode of this move would not fit on the pending block
+    if( THEKERNEL->conveyor->gcode_queue.is_full() ){ return false; }
+
+    float* start = this->merge_points[0];
+    float* end   = this->merge_points[n];
+
+    float chord[MAX_ROBOT_ACTUATORS];
+    float forward = 0.0F;
+    float chord_length2 = 0.0F;
+    for (int axis = X_AXIS; axis < this->n_axes; axis++){
+        chord[axis] = target[axis] - start[axis];
+        forward += (target[axis] - end[axis]) * (end[axis] - start[axis]);
+        chord_length2 += chord[axis] * chord[axis];
+    }
+
+    // Never fold a move back onto the line
+    if( forward <= 0.0F ){ return false; }
+
+    if( this->segment_merge_max_length > 0.0F && chord_length2 > this->segment_merge_max_length * this->segment_merge_max_length ){ return false; }
+
+    // Distance of each point to the new line is sqrt(|v|^2 |chord|^2 - (v.chord)^2) / |chord|, which holds for any number of axes
+    // Compare squared values to avoid the sqrt
+    float max_cross = this->segment_merge_tolerance * this->segment_merge_tolerance * chord_length2;
+    for (int i = 1; i <= n; i++){
+        float v2 = 0.0F, dot = 0.0F;
+        for (int axis = X_AXIS; axis < this->n_axes; axis++){
+            float v = this->merge_points[i][axis] - start[axis];
+            v2  += v * v;
+            dot += v * chord[axis];
+        }
+        if( v2 * chord_length2 - dot * dot > max_cross ){ return false; }
+    }
+
+    memcpy(this->merge_points[n+1], target, sizeof(this->merge_points[n+1]));
+    this->merged_count++;
+    return true;
+}
+
+// Hand the pending coalesced line over to the planner
+void Robot::flush_merged_line(){
+    if( this->merged_count == 0 ){ return; }
+
+    // planned_milestone is still at the start of the line
+    float* start  = this->merge_points[0];
+    float* target = this->merge_points[this->merged_count];
+    this->merged_count = 0;
+
+    float millimeters_of_travel = 0.0F;
+    for (int axis = X_AXIS; axis < this->n_axes; axis++)
+        millimeters_of_travel += ( target[axis] - start[axis] ) * ( target[axis] - start[axis] );
+    millimeters_of_travel = sqrtf( millimeters_of_travel );
+    this->append_segmented_line( target, this->merge_rate, millimeters_of_travel );
+}
+
+// Append a line from planned_milestone to target to the planner, cutting it into segments if needed
+// The segments themselves are generated by generate_line_segments as the queue frees up
+void Robot::append_segmented_line( float target[], float rate_mm_s, float millimeters_of_travel ){
+
+    // The previous line must be fully planned, as we start from its end
+    this->generate_line_segments(true);
+
     // We cut the line into smaller segments. This is not usefull in a cartesian robot, but necessary for robots with rotational axes.
     // In cartesian robot, a high "mm_per_line_segment" setting will prevent waste.
     // In delta robots either mm_per_line_segment can be used OR delta_segments_per_second The latter is more efficient and avoids splitting fast long lines into very small segments, like initial z move to 0, it is what Johanns Marlin delta port does
-    uint16_t segments;
+    unsigned int segments;
 
     if(this->delta_segments_per_second > 1.0F) {
         // enabled if set to something > 1, it is set to 0.0 by default
         // segment based on current speed and requested segments per second
         // the faster the travel speed the fewer segments needed
         // NOTE rate is mm/sec and we take into account any speed override
-        float seconds = gcode->millimeters_of_travel / rate_mm_s;
+        float seconds = millimeters_of_travel / rate_mm_s;
         segments= max(1, ceil(this->delta_segments_per_second * seconds));
         // TODO if we are only moving in Z on a delta we don't really need to segment at all
 
@@ -585,34 +987,46 @@ void Robot::append_line(Gcode* gcode, float target[], float rate_mm_s ){
         if(this->mm_per_line_segment == 0.0F){
             segments= 1; // don't split it up
         }else{
-            segments = ceil( gcode->millimeters_of_travel/ this->mm_per_line_segment);
+            segments = ceil( millimeters_of_travel/ this->mm_per_line_segment);
         }
     }
 
-    if (segments > 1)
-    {
-        // A vector to keep track of the endpoint of each segment
-        float segment_delta[3];
-        float segment_end[3];
+    // How far do we move each segment?
+    for (unsigned int i = X_AXIS; i < actuators.size(); i++)
+        this->line_delta[i] = (target[i] - planned_milestone[i]) / segments;
 
-        // How far do we move each segment?
-        for (int i = X_AXIS; i <= Z_AXIS; i++)
-            segment_delta[i] = (target[i] - last_milestone[i]) / segments;
+    memcpy(this->line_end, target, sizeof(this->line_end));
+    this->line_rate = rate_mm_s;
+    this->line_segments = segments;
+    this->line_segment = 1;
 
-        // segment 0 is already done - it's the end point of the previous move so we start at segment 1
-        // We always add another point after this loop so we stop at segments-1, ie i < segments
-        for (int i = 1; i < segments; i++)
-        {
-            for(int axis=X_AXIS; axis <= Z_AXIS; axis++ )
-                segment_end[axis] = last_milestone[axis] + segment_delta[axis];
+    this->generate_line_segments(false);
+}
+
+// Hand the segments of the pending line to the planner
+// Unless asked to wait for room, this stops as soon as the queue is full so the main loop can get on with other things
+void Robot::generate_line_segments(bool wait){
+    if( this->line_segments == 0 ){ return; }
+
+    while( this->line_segment <= this->line_segments ){
+        if( !wait && THEKERNEL->conveyor->queue.is_full() ){ break; }
+
+        if( this->line_segment == this->line_segments ){
+            // Append the end of this full move to the queue
+            this->append_milestone(this->line_end, this->line_rate);
+
+        }else{
+            float segment_end[MAX_ROBOT_ACTUATORS];
+            for(unsigned int axis=X_AXIS; axis < actuators.size(); axis++ )
+                segment_end[axis] = planned_milestone[axis] + this->line_delta[axis];
 
             // Append the end of this segment to the queue
-            this->append_milestone(segment_end, rate_mm_s);
+            this->append_milestone(segment_end, this->line_rate);
         }
+        this->line_segment++;
     }
 
-    // Append the end of this full move to the queue
-    this->append_milestone(target, rate_mm_s);
+    if( this->line_segment > this->line_segments ){ this->line_segments = 0; }
 
     // if adding these blocks didn't start executing, do that now
     THEKERNEL->conveyor->ensure_running();
@@ -620,6 +1034,7 @@ void Robot::append_line(Gcode* gcode, float target[], float rate_mm_s ){
 
 
 // Append an arc to the queue ( cutting it into segments as needed )
+// Only the arc geometry is worked out here, the segments are generated by generate_arc_segments as the queue frees up
 void Robot::append_arc(Gcode* gcode, float target[], float offset[], float radius, bool is_clockwise ){
 
     // Scary math
@@ -645,11 +1060,53 @@ void Robot::append_arc(Gcode* gcode, float target[], float offset[], float radiu
     // Mark the gcode as having a known distance
     this->distance_in_gcode_is_known( gcode );
 
-    // Figure out how many segments for this gcode
-    uint16_t segments = floor(gcode->millimeters_of_travel/this->mm_per_arc_segment);
+    float rate_mm_s = this->feed_rate / seconds_per_minute;
+
+    // Figure out how long the segments are for this gcode
+    // Longest chord whose sagitta stays within mm_max_arc_error, or the fixed mm_per_arc_segment if that is disabled
+    float segment_length = this->mm_per_arc_segment;
+    if( this->mm_max_arc_error > 0.0F && radius > this->mm_max_arc_error ){
+        segment_length = 2.0F * sqrtf(this->mm_max_arc_error * (2.0F * radius - this->mm_max_arc_error));
+    }
+
+    // Make sure each segment lasts at least arc_segment_min_ms, so the queue holds enough time worth of moves
+    if( this->arc_segment_min_ms > 0.0F ){
+        float min_length = rate_mm_s * this->arc_segment_min_ms / 1000.0F;
+        if( segment_length < min_length ){ segment_length = min_length; }
+    }
+
+    float segments = ceilf(gcode->millimeters_of_travel / segment_length);
+    if( segments < 1.0F ){ segments = 1.0F; }
+    if( segments > 65535.0F ){ segments = 65535.0F; }
+
+    this->arc_segments = segments;
+    this->arc_segment = 1;
+    this->arc_count = 0;
+    this->arc_rate = rate_mm_s;
+    this->arc_theta_per_segment = angular_travel/segments;
+    this->arc_linear_per_segment = linear_travel/segments;
+    this->arc_center[0] = center_axis0;
+    this->arc_center[1] = center_axis1;
+    this->arc_offset[0] = offset[this->plane_axis_0];
+    this->arc_offset[1] = offset[this->plane_axis_1];
+    this->arc_r[0] = r_axis0;
+    this->arc_r[1] = r_axis1;
+
+    // Vector rotation matrix values
+    this->arc_cos_T = 1-0.5F*this->arc_theta_per_segment*this->arc_theta_per_segment; // Small angle approximation
+    this->arc_sin_T = this->arc_theta_per_segment;
+
+    // Initialize the linear axis
+    memcpy(this->arc_target, this->last_milestone, sizeof(this->arc_target));
+    memcpy(this->arc_end, target, sizeof(this->arc_end));
+
+    this->generate_arc_segments(false);
+}
 
-    float theta_per_segment = angular_travel/segments;
-    float linear_per_segment = linear_travel/segments;
+// Hand the segments of the pending arc to the planner
+// Unless asked to wait for room, this stops as soon as the queue is full so the main loop can get on with other things
+void Robot::generate_arc_segments(bool wait){
+    if( this->arc_segments == 0 ){ return; }
 
     /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
     and phi is the angle of rotation. Based on the solution approach by Jens Geisler.
@@ -674,50 +1131,50 @@ void Robot::append_arc(Gcode* gcode, float target[], float offset[], float radiu
     a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead.
     This is important when there are successive arc motions.
     */
-    // Vector rotation matrix values
-    float cos_T = 1-0.5F*theta_per_segment*theta_per_segment; // Small angle approximation
-    float sin_T = theta_per_segment;
-
-    float arc_target[3];
-    float sin_Ti;
-    float cos_Ti;
-    float r_axisi;
-    uint16_t i;
-    int8_t count = 0;
+    while( this->arc_segment <= this->arc_segments ){
+        if( !wait && THEKERNEL->conveyor->queue.is_full() ){ break; }
 
-    // Initialize the linear axis
-    arc_target[this->plane_axis_2] = this->last_milestone[this->plane_axis_2];
-
-    for (i = 1; i<segments; i++) { // Increment (segments-1)
+        if( this->arc_segment == this->arc_segments ){
+            // Ensure last segment arrives at target location.
+            this->append_milestone(this->arc_end, this->arc_rate);
+            this->arc_segment++;
+            break;
+        }
 
-        if (count < this->arc_correction ) {
+        if (this->arc_count < this->arc_correction ) {
           // Apply vector rotation matrix
-          r_axisi = r_axis0*sin_T + r_axis1*cos_T;
-          r_axis0 = r_axis0*cos_T - r_axis1*sin_T;
-          r_axis1 = r_axisi;
-          count++;
+          float r_axisi = this->arc_r[0]*this->arc_sin_T + this->arc_r[1]*this->arc_cos_T;
+          this->arc_r[0] = this->arc_r[0]*this->arc_cos_T - this->arc_r[1]*this->arc_sin_T;
+          this->arc_r[1] = r_axisi;
+          this->arc_count++;
         } else {
           // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments.
           // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
-          cos_Ti = cosf(i*theta_per_segment);
-          sin_Ti = sinf(i*theta_per_segment);
-          r_axis0 = -offset[this->plane_axis_0]*cos_Ti + offset[this->plane_axis_1]*sin_Ti;
-          r_axis1 = -offset[this->plane_axis_0]*sin_Ti - offset[this->plane_axis_1]*cos_Ti;
-          count = 0;
+          float cos_Ti = cosf(this->arc_segment*this->arc_theta_per_segment);
+          float sin_Ti = sinf(this->arc_segment*this->arc_theta_per_segment);
+          this->arc_r[0] = -this->arc_offset[0]*cos_Ti + this->arc_offset[1]*sin_Ti;
+          this->arc_r[1] = -this->arc_offset[0]*sin_Ti - this->arc_offset[1]*cos_Ti;
+          this->arc_count = 0;
         }
 
         // Update arc_target location
-        arc_target[this->plane_axis_0] = center_axis0 + r_axis0;
-        arc_target[this->plane_axis_1] = center_axis1 + r_axis1;
-        arc_target[this->plane_axis_2] += linear_per_segment;
+        this->arc_target[this->plane_axis_0] = this->arc_center[0] + this->arc_r[0];
+        this->arc_target[this->plane_axis_1] = this->arc_center[1] + this->arc_r[1];
+        this->arc_target[this->plane_axis_2] += this->arc_linear_per_segment;
 
-        // Append this segment to the queue
-        this->append_milestone(arc_target, this->feed_rate / seconds_per_minute);
+        // The A B C axes and the extruders move linearly along with the arc
+        for (unsigned int axis = A_AXIS; axis < actuators.size(); axis++)
+            this->arc_target[axis] += (this->arc_end[axis] - this->arc_target[axis]) / (this->arc_segments - this->arc_segment + 1);
 
+        // Append this segment to the queue
+        this->append_milestone(this->arc_target, this->arc_rate);
+        this->arc_segment++;
     }
 
-    // Ensure last segment arrives at target location.
-    this->append_milestone(target, this->feed_rate / seconds_per_minute);
+    if( this->arc_segment > this->arc_segments ){ this->arc_segments = 0; }
+
+    // if adding these blocks didn't start executing, do that now
+    THEKERNEL->conveyor->ensure_running();
 }
 
 // Do the math for an arc and add it to the queue
@@ -35,9 +35,18 @@ using std::string;
 #define SPINDLE_DIRECTION_CW 0
 #define SPINDLE_DIRECTION_CCW 1
 
+#define ARM_SOLUTION_CARTESIAN 0 // Actuators are the axes, no transform
+#define ARM_SOLUTION_HBOT 1
+#define ARM_SOLUTION_OTHER 2     // Goes through the virtual arm solution
+
+#define MAX_MERGED_SEGMENTS 16 // max number of collinear segments coalesced into one planner block
+
+#include "libs/nuts_bolts.h"
+
 class Gcode;
 class BaseSolution;
 class StepperMotor;
+class BedMesh;
 
 class Robot : public Module {
     public:
@@ -45,23 +54,40 @@ class Robot : public Module {
         void on_module_loaded();
         void on_config_reload(void* argument);
         void on_gcode_received(void* argument);
+        void on_main_loop(void* argument);
         void on_get_public_data(void* argument);
         void on_set_public_data(void* argument);
 
         void reset_axis_position(float position, int axis);
+        void reset_position_from_actuators();
         void get_axis_position(float position[]);
+        float actuator_max_acceleration(int actuator);
         float to_millimeters(float value);
         float from_millimeters(float value);
+        bool is_segmenting();
+        bool add_extruder_motor(StepperMotor* motor);
+        void flush_moves();
+        void discard_moves();
 
         BaseSolution* arm_solution;                           // Selected Arm solution ( millimeters to step calculation )
+        uint8_t arm_solution_kind;                            // Which one it is, so the common ones can be called directly
+        BedMesh* bed_mesh;                                    // Bed heights added to Z when active, probed by G29
+        string bed_mesh_file;                                 // Setting : where the mesh is loaded from at boot, and saved to
         bool absolute_mode;                                   // true for absolute mode ( default ), false for relative mode
+        bool e_absolute_mode;                                 // same for the E word, also set by M82/M83
 
     private:
         void distance_in_gcode_is_known(Gcode* gcode);
         void append_milestone( float target[], float rate_mm_s);
+        void plan_milestone( float target[], float rate_mm_s);
         void append_line( Gcode* gcode, float target[], float rate_mm_s);
+        void append_segmented_line( float target[], float rate_mm_s, float millimeters_of_travel );
+        void generate_line_segments(bool wait);
+        bool merge_line( float target[], float rate_mm_s );
+        void flush_merged_line();
         //void append_arc(float theta_start, float angular_travel, float radius, float depth, float rate);
         void append_arc( Gcode* gcode, float target[], float offset[], float radius, bool is_clockwise );
+        void generate_arc_segments(bool wait);
 
 
         void compute_arc(Gcode* gcode, float offset[], float target[]);
@@ -69,7 +95,8 @@ class Robot : public Module {
         float theta(float x, float y);
         void select_plane(uint8_t axis_0, uint8_t axis_1, uint8_t axis_2);
 
-        float last_milestone[3];                             // Last position, in millimeters
+        float last_milestone[MAX_ROBOT_ACTUATORS];           // Last position, in millimeters
+        float planned_milestone[MAX_ROBOT_ACTUATORS];        // Last position handed to the planner, lags last_milestone while a move is cut into segments
         bool  inch_mode;                                       // true for inch mode, false for millimeter mode ( default )
         int8_t motion_mode;                                   // Motion mode for the current received Gcode
         float seek_rate;                                     // Current rate for seeking moves ( mm/s )
@@ -77,7 +104,17 @@ class Robot : public Module {
         uint8_t plane_axis_0, plane_axis_1, plane_axis_2;     // Current plane ( XY, XZ, YZ )
         float mm_per_line_segment;                           // Setting : Used to split lines into segments
         float mm_per_arc_segment;                            // Setting : Used to split arcs into segmentrs
+        float mm_max_arc_error;                              // Setting : Max chord error when splitting arcs into segments, 0 to use mm_per_arc_segment
+        float arc_segment_min_ms;                            // Setting : Min duration of an arc segment at the feed rate, in milliseconds
         float delta_segments_per_second;                     // Setting : Used to split lines into segments for delta based on speed
+        float segment_merge_tolerance;                       // Setting : Max deviation ( mm ) when coalescing collinear segments, 0 disables it
+        float segment_merge_max_length;                      // Setting : Max length ( mm ) of a coalesced segment, 0 for no limit
+
+        // Collinear segments waiting to be handed to the planner as a single line
+        float merge_points[MAX_MERGED_SEGMENTS+1][MAX_ROBOT_ACTUATORS]; // Start of the line, then the end of each coalesced segment
+        uint8_t merged_count;                                // Number of coalesced segments, 0 if nothing is pending
+        int8_t merge_motion_mode;
+        float merge_rate;
 
         // Number of arc generation iterations by small angle approximation before exact arc trajectory
         // correction. This parameter maybe decreased if there are issues with the accuracy of the arc
@@ -86,6 +123,32 @@ class Robot : public Module {
         // computational efficiency of generating arcs.
         int arc_correction;                                   // Setting : how often to rectify arc computation
         float max_speeds[3];                                 // Setting : max allowable speed in mm/m for each axis
+        float max_accelerations[3];                          // Setting : max allowable acceleration in mm/s^2 for each axis, 0 for no limit
+
+        // Arc being cut into segments, which are handed to the planner as the queue frees up
+        unsigned int arc_segments;                            // Number of segments in the arc, 0 if no arc is pending
+        unsigned int arc_segment;                             // Next segment to generate
+        int8_t arc_count;                                     // Segments since the last exact correction
+        float arc_rate;
+        float arc_theta_per_segment;
+        float arc_linear_per_segment;
+        float arc_cos_T, arc_sin_T;
+        float arc_center[2];
+        float arc_offset[2];
+        float arc_r[2];                                       // Radius vector from center to the last segment end
+        float arc_target[MAX_ROBOT_ACTUATORS];
+        float arc_end[MAX_ROBOT_ACTUATORS];
+
+        // Line being cut into segments, same as above
+        unsigned int line_segments;                           // Number of segments in the line, 0 if no line is pending
+        unsigned int line_segment;                            // Next segment to generate
+        float line_rate;
+        float line_delta[MAX_ROBOT_ACTUATORS];                // Distance moved by each segment
+        float line_end[MAX_ROBOT_ACTUATORS];
+
+        void update_actuator_positions();
+        bool has_extruders();
+        StepperMotor* load_extra_actuator(const char* name);
 
     // Used by Stepper
     public:
@@ -93,7 +156,8 @@ class Robot : public Module {
         StepperMotor* beta_stepper_motor;
         StepperMotor* gamma_stepper_motor;
 
-        std::vector<StepperMotor*> actuators;
+        std::vector<StepperMotor*> actuators;                 // alpha beta gamma, then the optional A B C axis actuators, then the extruders
+        uint8_t n_axes;                                       // Number of axes setting the length of moves, 3 plus the optional A B C axes
 
         float seconds_per_minute;                            // for realtime speed change
 };
@@ -105,6 +169,13 @@ inline float Robot::to_millimeters( float value ){
 inline float Robot::from_millimeters( float value){
     return this->inch_mode ? value/25.4 : value;
 }
+// True while a move is still being cut into segments, new gcodes would have to wait for it to reach the queue
+inline bool Robot::is_segmenting(){
+    return this->arc_segments > 0 || this->line_segments > 0;
+}
+inline bool Robot::has_extruders(){
+    return this->actuators.size() > this->n_axes;
+}
 inline void Robot::get_axis_position(float position[]){
     memcpy(position, this->last_milestone, sizeof(float)*3 );
 }
@@ -18,6 +18,7 @@
 #include "Config.h"
 #include "ConfigValue.h"
 #include "Gcode.h"
+#include "StreamOutputPool.h"
 
 #include <vector>
 using namespace std;
@@ -26,6 +27,8 @@ using namespace std;
 #include "libs/Hook.h"
 
 #include <mri.h>
+#include <math.h>
+#include <string.h>
 
 
 // The stepper reacts to blocks that have XYZ movement to transform them into actual stepper motor moves
@@ -41,6 +44,11 @@ Stepper::Stepper(){
     this->paused = false;
     this->trapezoid_generator_busy = false;
     this->force_speed_update = false;
+    this->stopping = false;
+    this->n_speed_listeners = 0;
+    this->speed_ratio = 0.0F;
+    this->shaper_impulses = 0;
+    this->shaper_history = NULL;
     skipped_speed_updates = 0;
 }
 
@@ -62,9 +70,8 @@ void Stepper::on_module_loaded(){
     this->acceleration_tick_hook = THEKERNEL->slow_ticker->attach( this->acceleration_ticks_per_second, this, &Stepper::trapezoid_generator_tick );
 
     // Attach to the end_of_move stepper event
-    THEKERNEL->robot->alpha_stepper_motor->attach(this, &Stepper::stepper_motor_finished_move );
-    THEKERNEL->robot->beta_stepper_motor->attach( this, &Stepper::stepper_motor_finished_move );
-    THEKERNEL->robot->gamma_stepper_motor->attach(this, &Stepper::stepper_motor_finished_move );
+    for (StepperMotor* m : THEKERNEL->robot->actuators)
+        m->attach(this, &Stepper::stepper_motor_finished_move );
 }
 
 // Get configuration from the config file
@@ -73,6 +80,8 @@ void Stepper::on_config_reload(void* argument){
     this->acceleration_ticks_per_second =  THEKERNEL->config->value(acceleration_ticks_per_second_checksum)->by_default(100   )->as_number();
     this->minimum_steps_per_second      =  THEKERNEL->config->value(minimum_steps_per_minute_checksum     )->by_default(3000  )->as_number() / 60.0F;
 
+    this->configure_input_shaper();
+
     // Steppers start off by default
     this->turn_enable_pins_off();
 }
@@ -80,18 +89,16 @@ void Stepper::on_config_reload(void* argument){
 // When the play/pause button is set to pause, or a module calls the ON_PAUSE event
 void Stepper::on_pause(void* argument){
     this->paused = true;
-    THEKERNEL->robot->alpha_stepper_motor->pause();
-    THEKERNEL->robot->beta_stepper_motor->pause();
-    THEKERNEL->robot->gamma_stepper_motor->pause();
+    for (StepperMotor* m : THEKERNEL->robot->actuators)
+        m->pause();
 }
 
 // When the play/pause button is set to play, or a module calls the ON_PLAY event
 void Stepper::on_play(void* argument){
     // TODO: Re-compute the whole queue for a cold-start
     this->paused = false;
-    THEKERNEL->robot->alpha_stepper_motor->unpause();
-    THEKERNEL->robot->beta_stepper_motor->unpause();
-    THEKERNEL->robot->gamma_stepper_motor->unpause();
+    for (StepperMotor* m : THEKERNEL->robot->actuators)
+        m->unpause();
 }
 
 void Stepper::on_gcode_received(void* argument){
@@ -138,7 +145,7 @@ void Stepper::on_block_begin(void* argument){
     if( block->millimeters == 0.0F ){ return; }
 
     // Mark the new block as of interrest to us
-    if( block->steps[ALPHA_STEPPER] > 0 || block->steps[BETA_STEPPER] > 0 || block->steps[GAMMA_STEPPER] > 0 ){
+    if( block->steps_event_count > 0 ){
         block->take();
     }else{
         return;
@@ -150,22 +157,38 @@ void Stepper::on_block_begin(void* argument){
     }
 
     // Setup : instruct stepper motors to move
-    if( block->steps[ALPHA_STEPPER] > 0 ){ THEKERNEL->robot->alpha_stepper_motor->move( ( block->direction_bits >> 0  ) & 1 , block->steps[ALPHA_STEPPER] ); }
-    if( block->steps[BETA_STEPPER ] > 0 ){ THEKERNEL->robot->beta_stepper_motor->move(  ( block->direction_bits >> 1  ) & 1 , block->steps[BETA_STEPPER ] ); }
-    if( block->steps[GAMMA_STEPPER] > 0 ){ THEKERNEL->robot->gamma_stepper_motor->move( ( block->direction_bits >> 2  ) & 1 , block->steps[GAMMA_STEPPER] ); }
+    // Find the stepper with the more steps, it's the one the speed calculations will want to follow
+    std::vector<StepperMotor*>& actuators = THEKERNEL->robot->actuators;
+
+    // Linear advance only applies to extruding moves, the speed then follows a motor without it
+    bool can_advance = false;
+    for (unsigned int i = 0; i < actuators.size(); i++)
+        if( actuators[i]->linear_advance <= 0.0F && block->steps[i] == block->steps_event_count ){ can_advance = true; }
+
+    this->main_stepper = actuators[ALPHA_STEPPER];
+    for (unsigned int i = 0; i < actuators.size(); i++) {
+        bool direction = ( block->direction_bits >> i ) & 1;
+        if( can_advance && block->steps[i] > 0 && actuators[i]->linear_advance > 0.0F ){
+            this->begin_advance(actuators[i], direction, block->steps[i], block->final_rate * block->steps[i] / block->steps_event_count);
+            continue;
+        }
+        if( block->steps[i] > 0 ){ actuators[i]->move( direction, block->steps[i] ); }
+        if( actuators[i]->steps_to_move > this->main_stepper->steps_to_move ){ this->main_stepper = actuators[i]; }
+    }
 
     this->current_block = block;
 
     // Setup acceleration for this block
     this->trapezoid_generator_reset();
 
-    // Find the stepper with the more steps, it's the one the speed calculations will want to follow
-    this->main_stepper = THEKERNEL->robot->alpha_stepper_motor;
-    if( THEKERNEL->robot->beta_stepper_motor->steps_to_move > this->main_stepper->steps_to_move ){ this->main_stepper = THEKERNEL->robot->beta_stepper_motor; }
-    if( THEKERNEL->robot->gamma_stepper_motor->steps_to_move > this->main_stepper->steps_to_move ){ this->main_stepper = THEKERNEL->robot->gamma_stepper_motor; }
-
-    // Set the initial speed for this move
-    this->trapezoid_generator_tick(0);
+    // Set the initial speed for this move, when shaping we carry on at the shaped speed the previous block ended with
+    if( this->shaper_impulses > 0 ){
+        this->force_speed_update = false;
+        this->shaper_idle = false;
+        this->set_step_events_per_second( this->shaper_speed * block->steps_event_count / block->millimeters );
+    }else{
+        this->trapezoid_generator_tick(0);
+    }
 
     // Synchronise the acceleration curve with the stepping
     this->synchronize_acceleration(0);
@@ -174,14 +197,48 @@ void Stepper::on_block_begin(void* argument){
 
 // Current block is discarded
 void Stepper::on_block_end(void* argument){
+    // Extruders running ahead or behind stop with the block, what they did not do is carried over to the next one
+    for (StepperMotor* m : THEKERNEL->robot->actuators)
+        if( m->advancing ){ this->end_advance(m); }
+
     this->current_block = NULL; //stfu !
+    this->stopping = false;
+}
+
+// Linear advance : the extruder is ahead of its planned position by K times its speed, so nozzle pressure keeps up with the flow
+// The advance is kept as extra steps carried from block to block, this block's move brings it to what the final speed needs
+void Stepper::begin_advance(StepperMotor* m, bool direction, uint32_t steps, float final_rate){
+    int32_t planned = direction ? -(int32_t)steps : (int32_t)steps;
+    int32_t advance = lroundf( m->linear_advance * final_rate );
+    int32_t total = planned + ( direction ? -advance : advance ) - m->advance_steps;
+
+    m->advance_planned = planned;
+    m->advancing = true;
+    m->move( total < 0, labs(total) );
+}
+
+// Whatever the extruder did beyond its planned steps is now part of the advance
+void Stepper::end_advance(StepperMotor* m){
+    int32_t stepped = m->direction ? -(int32_t)m->stepped : (int32_t)m->stepped;
+    m->advance_steps += stepped - m->advance_planned;
+    m->advancing = false;
+    if( m->moving ){ m->stop(); }
+}
+
+// Stop the current block early : decelerate at the block's rate, then cut it short wherever the motors are
+// Called from interrupts, for example by an endstop, the motors' stepped counts then tell how far the block went
+void Stepper::decelerate_to_stop(){
+    if( this->current_block != NULL ){
+        this->stopping = true;
+    }
 }
 
 // When a stepper motor has finished it's assigned movement
 uint32_t Stepper::stepper_motor_finished_move(uint32_t dummy){
 
-    // We care only if none is still moving
-    if( THEKERNEL->robot->alpha_stepper_motor->moving || THEKERNEL->robot->beta_stepper_motor->moving || THEKERNEL->robot->gamma_stepper_motor->moving ){ return 0; }
+    // We care only if none is still moving, extruders running ahead or behind are stopped with the block
+    for (StepperMotor* m : THEKERNEL->robot->actuators)
+        if( m->moving && !m->advancing ){ return 0; }
 
     // This block is finished, release it
     if( this->current_block != NULL ){
@@ -203,6 +260,11 @@ uint32_t Stepper::trapezoid_generator_tick( uint32_t dummy ) {
         // Store this here because we use it a lot down there
         uint32_t current_steps_completed = this->main_stepper->stepped;
 
+        // When shaping, the ramps follow where the trapezoid generator is, which is ahead of the motors
+        if( this->shaper_impulses > 0 ){
+            current_steps_completed += lroundf( this->shaper_lag * this->current_block->steps_event_count / this->current_block->millimeters );
+        }
+
         // Do not accel, just set the value
         if( this->force_speed_update ){
           this->force_speed_update = false;
@@ -210,14 +272,35 @@ uint32_t Stepper::trapezoid_generator_tick( uint32_t dummy ) {
           return 0;
         }
 
+        float previous_rate = this->trapezoid_adjusted_rate;
+        bool speed_changed = false;
+
+        // If we are stopping before the end of the block
+        if( this->stopping ){
+            float floor_rate = max(this->current_block->rate_delta * 1.5F, (float)this->minimum_steps_per_second);
+            this->trapezoid_adjusted_rate = max(floor_rate, this->trapezoid_adjusted_rate - this->current_block->rate_delta);
+            this->trapezoid_acceleration = (this->trapezoid_adjusted_rate - previous_rate) * this->acceleration_ticks_per_second;
+            speed_changed = true;
+
+            // Once the motors are down to the slowest speed, cut the moves short, their end then releases the block as usual
+            float motor_rate = this->shaper_impulses > 0 ? this->shaper_speed * this->current_block->steps_event_count / this->current_block->millimeters : previous_rate;
+            if( previous_rate <= floor_rate && motor_rate <= floor_rate * 1.01F ){
+                __disable_irq();
+                for (StepperMotor* m : THEKERNEL->robot->actuators)
+                    if( m->moving ){ m->steps_to_move = m->stepped + 1; }
+                __enable_irq();
+                this->stopping = false;
+            }
+
         // If we are accelerating
-        if(current_steps_completed <= this->current_block->accelerate_until + 1) {
+        }else if(current_steps_completed <= this->current_block->accelerate_until + 1) {
             // Increase speed
             this->trapezoid_adjusted_rate += this->current_block->rate_delta;
               if (this->trapezoid_adjusted_rate > this->current_block->nominal_rate ) {
                   this->trapezoid_adjusted_rate = this->current_block->nominal_rate;
               }
-              this->set_step_events_per_second(this->trapezoid_adjusted_rate);
+              this->trapezoid_acceleration = (this->trapezoid_adjusted_rate - previous_rate) * this->acceleration_ticks_per_second;
+              speed_changed = true;
 
         // If we are decelerating
         }else if (current_steps_completed > this->current_block->decelerate_after) {
@@ -232,27 +315,125 @@ uint32_t Stepper::trapezoid_generator_tick( uint32_t dummy ) {
               if(this->trapezoid_adjusted_rate < this->current_block->final_rate ) {
                   this->trapezoid_adjusted_rate = this->current_block->final_rate;
               }
-              this->set_step_events_per_second(this->trapezoid_adjusted_rate);
+              this->trapezoid_acceleration = (this->trapezoid_adjusted_rate - previous_rate) * this->acceleration_ticks_per_second;
+              speed_changed = true;
 
         // If we are cruising
         }else {
               // Make sure we cruise at exactly nominal rate
-              if (this->trapezoid_adjusted_rate != this->current_block->nominal_rate) {
+              if (this->trapezoid_adjusted_rate != this->current_block->nominal_rate || this->trapezoid_acceleration != 0.0F) {
                   this->trapezoid_adjusted_rate = this->current_block->nominal_rate;
-                  this->set_step_events_per_second(this->trapezoid_adjusted_rate);
+                  this->trapezoid_acceleration = 0.0F;
+                  speed_changed = true;
               }
           }
+
+        if( this->shaper_impulses > 0 ){
+            this->shape_speed(this->trapezoid_adjusted_rate);
+        }else if( speed_changed ){
+            this->set_step_events_per_second(this->trapezoid_adjusted_rate);
+        }
+
+    }else if( this->shaper_impulses > 0 && !this->paused && this->current_block == NULL && !this->shaper_idle ){
+        // Nothing left to move, the motors have stopped whatever the history says
+        memset(this->shaper_history, 0, SHAPER_HISTORY_SIZE * sizeof(float));
+        this->shaper_speed = 0.0F;
+        this->shaper_lag = 0.0F;
+        this->shaper_idle = true;
     }
 
     return 0;
 }
 
+// Convolve the speed asked for by the trapezoid generator with the shaper's impulses, and move at the result
+// This is done on the speed along the path, so it applies to every axis of the block in the same way, no axis is shaped on its own
+// It does not reduce the ringing at corners : the change of direction between blocks is not shaped, see shaper-sim.py
+void Stepper::shape_speed(float steps_per_second){
+    float mm_per_step = this->current_block->millimeters / this->current_block->steps_event_count;
+    float speed = steps_per_second * mm_per_step;
+
+    this->shaper_history[this->shaper_index] = speed;
+    float shaped = 0.0F;
+    for (uint8_t i = 0; i < this->shaper_impulses; i++)
+        shaped += this->shaper_amplitudes[i] * this->shaper_history[(this->shaper_index - this->shaper_delays[i]) & (SHAPER_HISTORY_SIZE - 1)];
+    this->shaper_index = (this->shaper_index + 1) & (SHAPER_HISTORY_SIZE - 1);
+
+    // The motors catch up on the generator once it has stopped asking for more
+    this->shaper_lag += (speed - shaped) / this->acceleration_ticks_per_second;
+    if( this->shaper_lag < 0.0F ){ this->shaper_lag = 0.0F; }
+
+    this->trapezoid_acceleration = (shaped - this->shaper_speed) * this->acceleration_ticks_per_second / mm_per_step;
+    this->shaper_speed = shaped;
+    this->set_step_events_per_second(shaped / mm_per_step);
+}
+
+// Work out the impulses of the configured shaper, for a vibration of the given frequency and damping ratio
+void Stepper::configure_input_shaper(){
+    string type     = THEKERNEL->config->value(input_shaper_type_checksum     )->by_default("none")->as_string();
+    float frequency = THEKERNEL->config->value(input_shaper_frequency_checksum)->by_default(0.0F  )->as_number();
+    float damping   = THEKERNEL->config->value(input_shaper_damping_checksum  )->by_default(0.1F  )->as_number();
+
+    this->shaper_impulses = 0;
+    if( type == "none" || frequency <= 0.0F || damping < 0.0F || damping >= 1.0F ){ return; }
+
+    // Damped period of the vibration, and how much of it is left after half of it
+    float period = 1.0F / ( frequency * sqrtf(1.0F - damping * damping) );
+    float k = expf( -damping * M_PI / sqrtf(1.0F - damping * damping) );
+    float times[MAX_SHAPER_IMPULSES] = { 0.0F, period / 2.0F, period };
+
+    if( type == "zv" ){
+        this->shaper_amplitudes[0] = 1.0F;
+        this->shaper_amplitudes[1] = k;
+        this->shaper_impulses = 2;
+    }else if( type == "zvd" ){
+        this->shaper_amplitudes[0] = 1.0F;
+        this->shaper_amplitudes[1] = 2.0F * k;
+        this->shaper_amplitudes[2] = k * k;
+        this->shaper_impulses = 3;
+    }else if( type == "ei" ){
+        // Extra insensitive, for 5% of vibration left at the design frequency
+        float tolerance = 0.05F;
+        this->shaper_amplitudes[0] = 0.25F * (1.0F + tolerance);
+        this->shaper_amplitudes[1] = 0.5F * (1.0F - tolerance) * k;
+        this->shaper_amplitudes[2] = 0.25F * (1.0F + tolerance) * k * k;
+        this->shaper_impulses = 3;
+    }else{
+        THEKERNEL->streams->printf("Error: unknown input_shaper_type %s, input shaping disabled\r\n", type.c_str());
+        return;
+    }
+
+    // The amplitudes add up to one so the moves keep their length
+    float sum = 0.0F;
+    for (uint8_t i = 0; i < this->shaper_impulses; i++)
+        sum += this->shaper_amplitudes[i];
+    for (uint8_t i = 0; i < this->shaper_impulses; i++){
+        this->shaper_amplitudes[i] /= sum;
+        this->shaper_delays[i] = lroundf( times[i] * this->acceleration_ticks_per_second );
+    }
+
+    if( this->shaper_delays[this->shaper_impulses - 1] >= SHAPER_HISTORY_SIZE ){
+        THEKERNEL->streams->printf("Error: input shaper too long for acceleration_ticks_per_second, input shaping disabled\r\n");
+        this->shaper_impulses = 0;
+        return;
+    }
+
+    if( this->shaper_history == NULL ){
+        this->shaper_history = new float[SHAPER_HISTORY_SIZE];
+    }
+    memset(this->shaper_history, 0, SHAPER_HISTORY_SIZE * sizeof(float));
+    this->shaper_index = 0;
+    this->shaper_speed = 0.0F;
+    this->shaper_lag = 0.0F;
+    this->shaper_idle = true;
+}
+
 
 
 // Initializes the trapezoid generator from the current block. Called whenever a new
 // block begins.
 inline void Stepper::trapezoid_generator_reset(){
     this->trapezoid_adjusted_rate = this->current_block->initial_rate;
+    this->trapezoid_acceleration = 0.0F;
     this->force_speed_update = true;
     this->trapezoid_tick_cycle_counter = 0;
     previous_step_count = 0;
@@ -263,6 +444,9 @@ inline void Stepper::trapezoid_generator_reset(){
 // Update the speed for all steppers
 void Stepper::set_step_events_per_second( float steps_per_second )
 {
+    // Shared with the speed listeners
+    this->speed_ratio = steps_per_second / this->current_block->nominal_rate;
+
     // We do not step slower than this
     //steps_per_second = max(steps_per_second, this->minimum_steps_per_second);
     if( steps_per_second < this->minimum_steps_per_second ){
@@ -270,12 +454,25 @@ void Stepper::set_step_events_per_second( float steps_per_second )
     }
 
     // Instruct the stepper motors
-    if( THEKERNEL->robot->alpha_stepper_motor->moving ){ THEKERNEL->robot->alpha_stepper_motor->set_speed( steps_per_second * ( (float)this->current_block->steps[ALPHA_STEPPER] / (float)this->current_block->steps_event_count ) ); }
-    if( THEKERNEL->robot->beta_stepper_motor->moving  ){ THEKERNEL->robot->beta_stepper_motor->set_speed(  steps_per_second * ( (float)this->current_block->steps[BETA_STEPPER ] / (float)this->current_block->steps_event_count ) ); }
-    if( THEKERNEL->robot->gamma_stepper_motor->moving ){ THEKERNEL->robot->gamma_stepper_motor->set_speed( steps_per_second * ( (float)this->current_block->steps[GAMMA_STEPPER] / (float)this->current_block->steps_event_count ) ); }
+    std::vector<StepperMotor*>& actuators = THEKERNEL->robot->actuators;
+    for (unsigned int i = 0; i < actuators.size(); i++) {
+        if( !actuators[i]->moving ){ continue; }
+        float ratio = (float)this->current_block->steps[i] / (float)this->current_block->steps_event_count;
+
+        // Linear advance : the extruder runs ahead while accelerating and behind while decelerating, by K times its acceleration
+        // It may have to run backwards, or to wait at zero speed while its direction is the other one
+        if( actuators[i]->advancing ){
+            float speed = ( steps_per_second + actuators[i]->linear_advance * this->trapezoid_acceleration ) * ratio;
+            bool backwards = actuators[i]->direction != (bool)( ( this->current_block->direction_bits >> i ) & 1 );
+            actuators[i]->set_speed( backwards ? -speed : speed );
+        }else{
+            actuators[i]->set_speed( steps_per_second * ratio );
+        }
+    }
 
-    // Other modules might want to know the speed changed
-    THEKERNEL->call_event(ON_SPEED_CHANGE, this);
+    // Other modules might want to know the speed changed, only the few that asked are called
+    for (uint8_t i = 0; i < this->n_speed_listeners; i++)
+        this->speed_listeners[i]->call(0);
 
 }
 
@@ -9,15 +9,22 @@
 #define STEPPER_H
 
 #include "libs/Module.h"
+#include "libs/Hook.h"
 
 class Block;
-class Hook;
 class StepperMotor;
 
+#define MAX_SPEED_LISTENERS 4
+#define MAX_SHAPER_IMPULSES 3
+#define SHAPER_HISTORY_SIZE 128            // Acceleration ticks of speed history kept for the input shaper, a power of 2
+
 #define microseconds_per_step_pulse_checksum        CHECKSUM("microseconds_per_step_pulse")
 #define acceleration_ticks_per_second_checksum      CHECKSUM("acceleration_ticks_per_second")
 #define minimum_steps_per_minute_checksum           CHECKSUM("minimum_steps_per_minute")
 #define base_stepping_frequency_checksum            CHECKSUM("base_stepping_frequency")
+#define input_shaper_type_checksum                  CHECKSUM("input_shaper_type")
+#define input_shaper_frequency_checksum             CHECKSUM("input_shaper_frequency")
+#define input_shaper_damping_checksum               CHECKSUM("input_shaper_damping")
 
 class Stepper : public Module {
     public:
@@ -39,6 +46,21 @@ class Stepper : public Module {
         void turn_enable_pins_on();
         void turn_enable_pins_off();
         uint32_t synchronize_acceleration(uint32_t dummy);
+        void configure_input_shaper();
+        void shape_speed(float steps_per_second);
+        void decelerate_to_stop();
+        void begin_advance(StepperMotor* m, bool direction, uint32_t steps, float final_rate);
+        void end_advance(StepperMotor* m);
+
+        // Modules following the speed of the current block, called from the acceleration interrupt after every speed change
+        // They should only read speed_ratio and be quick about it
+        template<typename T> bool attach_speed_listener( T *optr, uint32_t ( T::*fptr )( uint32_t ) ){
+            if( this->n_speed_listeners >= MAX_SPEED_LISTENERS ){ return false; }
+            Hook* hook = new Hook();
+            hook->attach(optr, fptr);
+            this->speed_listeners[this->n_speed_listeners++] = hook;
+            return true;
+        }
 
         Block* current_block;
         int counters[3];
@@ -50,6 +72,7 @@ class Stepper : public Module {
         //int step_events_completed;
         unsigned int out_bits;
         float trapezoid_adjusted_rate;
+        float trapezoid_acceleration;      // Acceleration of the main stepper over the last trapezoid tick, in steps/s^2
         int trapezoid_tick_cycle_counter;
         int cycles_per_step_event;
         bool trapezoid_generator_busy;
@@ -61,8 +84,22 @@ class Stepper : public Module {
         int counter_increment;
         bool paused;
         bool force_speed_update;
+        volatile bool stopping;            // Decelerating to a stop before the end of the current block
         bool enable_pins_status;
         Hook* acceleration_tick_hook;
+        Hook* speed_listeners[MAX_SPEED_LISTENERS];
+        uint8_t n_speed_listeners;
+        float speed_ratio;                 // Current speed as a fraction of the current block's nominal speed
+
+        // Input shaper : the speed along the path is the sum of delayed and scaled copies of the speed the trapezoid generator asks for
+        float shaper_amplitudes[MAX_SHAPER_IMPULSES];
+        uint16_t shaper_delays[MAX_SHAPER_IMPULSES]; // In acceleration ticks
+        uint8_t shaper_impulses;           // 0 when input shaping is off
+        float* shaper_history;             // Speed asked for at each of the last acceleration ticks, in mm/s
+        uint16_t shaper_index;
+        float shaper_speed;                // Shaped speed in mm/s
+        float shaper_lag;                  // Distance in mm the motors are behind the trapezoid generator
+        bool shaper_idle;                  // History is cleared, nothing is moving
 
         StepperMotor* main_stepper;
 
@@ -2,6 +2,8 @@
 #ifndef BASESOLUTION_H
 #define BASESOLUTION_H
 
+#include <math.h>
+
 class Config;
 
 class BaseSolution {
@@ -14,6 +16,17 @@ class BaseSolution {
 
         virtual bool set_optional(char parameter, float  value) { return false; };
         virtual bool get_optional(char parameter, float *value) { return false; };
+
+    protected:
+        // Square root by Newton's method from a nearby root, like the one found for the previous segment
+        // Two iterations are exact to float precision for the small steps between segments, a bad guess falls back to sqrtf
+        static inline float sqrt_from(float value, float guess) {
+            if( guess <= 0.0F || value <= 0.0F ){ return sqrtf(value); }
+            float error = guess * guess - value;
+            if( error > 0.1F * value || error < -0.1F * value ){ return sqrtf(value); }
+            guess = 0.5F * ( guess + value / guess );
+            return  0.5F * ( guess + value / guess );
+        }
 };
 
 #endif
@@ -5,7 +5,7 @@
 
 #include "Vector3.h"
 
-#define SQ(x) powf(x, 2)
+#define SQ(x) ((x)*(x))
 #define ROUND(x, y) (roundf(x * 1e ## y) / 1e ## y)
 
 JohannKosselSolution::JohannKosselSolution(Config* config)
@@ -35,22 +35,27 @@ void JohannKosselSolution::init() {
 
     DELTA_TOWER3_X = 0.0F; // back middle tower
     DELTA_TOWER3_Y = DELTA_RADIUS;
+
+    // No previous segment to start the square roots from
+    roots[0] = roots[1] = roots[2] = 0.0F;
 }
 
 void JohannKosselSolution::cartesian_to_actuator( float cartesian_mm[], float actuator_mm[] )
 {
-    actuator_mm[ALPHA_STEPPER] = sqrtf(this->arm_length_squared
-                                - SQ(DELTA_TOWER1_X - cartesian_mm[X_AXIS])
-                                - SQ(DELTA_TOWER1_Y - cartesian_mm[Y_AXIS])
-                                ) + cartesian_mm[Z_AXIS];
-    actuator_mm[BETA_STEPPER ] = sqrtf(this->arm_length_squared
-                                - SQ(DELTA_TOWER2_X - cartesian_mm[X_AXIS])
-                                - SQ(DELTA_TOWER2_Y - cartesian_mm[Y_AXIS])
-                                ) + cartesian_mm[Z_AXIS];
-    actuator_mm[GAMMA_STEPPER] = sqrtf(this->arm_length_squared
-                                - SQ(DELTA_TOWER3_X - cartesian_mm[X_AXIS])
-                                - SQ(DELTA_TOWER3_Y - cartesian_mm[Y_AXIS])
-                                ) + cartesian_mm[Z_AXIS];
+    // Consecutive segments are close, so each root starts from the previous one
+    roots[0] = sqrt_from(this->arm_length_squared
+                         - SQ(DELTA_TOWER1_X - cartesian_mm[X_AXIS])
+                         - SQ(DELTA_TOWER1_Y - cartesian_mm[Y_AXIS]), roots[0]);
+    roots[1] = sqrt_from(this->arm_length_squared
+                         - SQ(DELTA_TOWER2_X - cartesian_mm[X_AXIS])
+                         - SQ(DELTA_TOWER2_Y - cartesian_mm[Y_AXIS]), roots[1]);
+    roots[2] = sqrt_from(this->arm_length_squared
+                         - SQ(DELTA_TOWER3_X - cartesian_mm[X_AXIS])
+                         - SQ(DELTA_TOWER3_Y - cartesian_mm[Y_AXIS]), roots[2]);
+
+    actuator_mm[ALPHA_STEPPER] = roots[0] + cartesian_mm[Z_AXIS];
+    actuator_mm[BETA_STEPPER ] = roots[1] + cartesian_mm[Z_AXIS];
+    actuator_mm[GAMMA_STEPPER] = roots[2] + cartesian_mm[Z_AXIS];
 }
 
 void JohannKosselSolution::actuator_to_cartesian( float actuator_mm[], float cartesian_mm[] )
@@ -32,5 +32,7 @@ class JohannKosselSolution : public BaseSolution {
         float DELTA_TOWER2_Y;
         float DELTA_TOWER3_X;
         float DELTA_TOWER3_Y;
+
+        float roots[3];                 // Root found for each tower on the last call
 };
 #endif // JOHANNKOSSELSOLUTION_H
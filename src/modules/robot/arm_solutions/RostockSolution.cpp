@@ -22,7 +22,9 @@ RostockSolution::RostockSolution(Config* config)
     // arm_radius is the horizontal distance from hinge to hinge when the effector is centered
     arm_radius         = config->value(arm_radius_checksum)->by_default(124.0f)->as_number();
 
-    arm_length_squared = powf(arm_length, 2);
+    arm_length_squared = arm_length * arm_length;
+
+    roots[0] = roots[1] = roots[2] = 0.0F;
 }
 
 void RostockSolution::cartesian_to_actuator( float cartesian_mm[], float actuator_mm[] ){
@@ -35,21 +37,25 @@ void RostockSolution::cartesian_to_actuator( float cartesian_mm[], float actuato
     }else{
         rotate( cartesian_mm, alpha_rotated, sin_alpha, cos_alpha );
     }
-    actuator_mm[ALPHA_STEPPER] = solve_arm( alpha_rotated );
+    actuator_mm[ALPHA_STEPPER] = solve_arm( alpha_rotated, roots[0] );
 
     rotate( alpha_rotated, rotated, sin_beta, cos_beta );
-    actuator_mm[BETA_STEPPER ] = solve_arm( rotated );
+    actuator_mm[BETA_STEPPER ] = solve_arm( rotated, roots[1] );
 
     rotate( alpha_rotated, rotated, sin_gamma, cos_gamma );
-    actuator_mm[GAMMA_STEPPER] = solve_arm( rotated );
+    actuator_mm[GAMMA_STEPPER] = solve_arm( rotated, roots[2] );
 }
 
 void RostockSolution::actuator_to_cartesian( float actuator_mm[], float cartesian_mm[] ){
     // unimplemented
 }
 
-float RostockSolution::solve_arm( float cartesian_mm[]) {
-    return sqrtf(arm_length_squared - powf(cartesian_mm[X_AXIS] - arm_radius, 2) - powf(cartesian_mm[Y_AXIS], 2)) + cartesian_mm[Z_AXIS];
+// root is the one found for this arm on the previous segment, and is updated
+float RostockSolution::solve_arm( float cartesian_mm[], float& root ) {
+    float x = cartesian_mm[X_AXIS] - arm_radius;
+    float y = cartesian_mm[Y_AXIS];
+    root = sqrt_from(arm_length_squared - x * x - y * y, root);
+    return root + cartesian_mm[Z_AXIS];
 }
 
 void RostockSolution::rotate(float in[], float out[], float sin, float cos ){
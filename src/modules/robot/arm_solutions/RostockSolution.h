@@ -20,7 +20,7 @@ class RostockSolution : public BaseSolution {
         void cartesian_to_actuator( float[], float[] );
         void actuator_to_cartesian( float[], float[] );
 
-        float solve_arm( float millimeters[] );
+        float solve_arm( float millimeters[], float& root );
         void rotate( float in[], float out[], float sin, float cos );
 
         float arm_length;
@@ -33,6 +33,8 @@ class RostockSolution : public BaseSolution {
         float cos_beta;
         float sin_gamma;
         float cos_gamma;
+
+        float roots[3];                 // Root found for each arm on the last call
 };
 
 
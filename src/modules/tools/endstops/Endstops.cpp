@@ -12,6 +12,7 @@
 #include "Endstops.h"
 #include "libs/nuts_bolts.h"
 #include "libs/Pin.h"
+#include "libs/PinInterrupt.h"
 #include "libs/StepperMotor.h"
 #include "wait_api.h" // mbed.h lib
 #include "Robot.h"
@@ -22,6 +23,12 @@
 #include "checksumm.h"
 #include "utils.h"
 #include "ConfigValue.h"
+#include "StreamOutputPool.h"
+#include "PublicData.h"
+#include "modules/utils/player/PlayerPublicAccess.h"
+
+#include <math.h>
+#include <stdio.h>
 
 #define ALPHA_AXIS 0
 #define BETA_AXIS  1
@@ -64,6 +71,8 @@
 #define beta_homing_retract_checksum     CHECKSUM("beta_homing_retract")
 #define gamma_homing_retract_checksum    CHECKSUM("gamma_homing_retract")
 #define endstop_debounce_count_checksum  CHECKSUM("endstop_debounce_count")
+#define endstop_debounce_us_checksum     CHECKSUM("endstop_debounce_us")
+#define endstop_limits_enable_checksum   CHECKSUM("endstop_limits_enable")
 
 // same as above but in user friendly mm/s and mm
 #define alpha_fast_homing_rate_mm_checksum  CHECKSUM("alpha_fast_homing_rate_mm_s")
@@ -74,6 +83,10 @@
 #define beta_slow_homing_rate_mm_checksum   CHECKSUM("beta_slow_homing_rate_mm_s")
 #define gamma_slow_homing_rate_mm_checksum  CHECKSUM("gamma_slow_homing_rate_mm_s")
 
+#define alpha_max_travel_checksum           CHECKSUM("alpha_max_travel")
+#define beta_max_travel_checksum            CHECKSUM("beta_max_travel")
+#define gamma_max_travel_checksum           CHECKSUM("gamma_max_travel")
+
 #define alpha_homing_retract_mm_checksum    CHECKSUM("alpha_homing_retract_mm")
 #define beta_homing_retract_mm_checksum     CHECKSUM("beta_homing_retract_mm")
 #define gamma_homing_retract_mm_checksum    CHECKSUM("gamma_homing_retract_mm")
@@ -100,6 +113,9 @@
 Endstops::Endstops()
 {
     this->status = NOT_HOMING;
+    this->planned_homing = false;
+    this->limits_enabled = false;
+    this->limit_hit = -1;
     home_offset[0] = home_offset[1] = home_offset[2] = 0.0F;
 }
 
@@ -112,6 +128,7 @@ void Endstops::on_module_loaded()
 
     register_for_event(ON_CONFIG_RELOAD);
     this->register_for_event(ON_GCODE_RECEIVED);
+    this->register_for_event(ON_MAIN_LOOP);
 
     // Take StepperMotor objects from Robot and keep them here
     this->steppers[0] = THEKERNEL->robot->alpha_stepper_motor;
@@ -119,6 +136,11 @@ void Endstops::on_module_loaded()
     this->steppers[2] = THEKERNEL->robot->gamma_stepper_motor;
     THEKERNEL->slow_ticker->attach( THEKERNEL->stepper->acceleration_ticks_per_second , this, &Endstops::acceleration_tick );
 
+    for ( int i = 0; i < 6; i++ ) {
+        this->interrupts[i] = new PinInterrupt();
+        this->stop_motors[i] = 0;
+    }
+
     // Settings
     this->on_config_reload(this);
 }
@@ -160,8 +182,22 @@ void Endstops::on_config_reload(void *argument)
     this->retract_steps[1] = THEKERNEL->config->value(beta_homing_retract_mm_checksum    )->by_default(this->retract_steps[1] / steps_per_mm[1])->as_number() * steps_per_mm[1];
     this->retract_steps[2] = THEKERNEL->config->value(gamma_homing_retract_mm_checksum   )->by_default(this->retract_steps[2] / steps_per_mm[2])->as_number() * steps_per_mm[2];
 
+    // how far homing moves look for the endstops
+    this->max_travel[0]   = THEKERNEL->config->value(alpha_max_travel_checksum          )->by_default(500)->as_number();
+    this->max_travel[1]   = THEKERNEL->config->value(beta_max_travel_checksum           )->by_default(500)->as_number();
+    this->max_travel[2]   = THEKERNEL->config->value(gamma_max_travel_checksum          )->by_default(500)->as_number();
+
     this->debounce_count  = THEKERNEL->config->value(endstop_debounce_count_checksum    )->by_default(0)->as_number();
 
+    // P0 and P2 endstops stop their motors from the pin interrupt, debounced there in microseconds
+    uint32_t debounce_us  = THEKERNEL->config->value(endstop_debounce_us_checksum       )->by_default(0)->as_number();
+    for ( int i = 0; i < 6; i++ ) {
+        this->interrupts[i]->attach(&this->pins[i], i, this, &Endstops::on_endstop_hit);
+        this->interrupts[i]->set_debounce_us(debounce_us);
+    }
+    this->limits_enabled  = THEKERNEL->config->value(endstop_limits_enable_checksum     )->by_default(false)->as_bool();
+    this->arm_limits();
+
 
     // get homing direction and convert to boolean where true is home to min, and false is home to max
     int home_dir                    = get_checksum(THEKERNEL->config->value(alpha_homing_direction_checksum)->by_default("home_to_min")->as_string());
@@ -190,119 +226,302 @@ void Endstops::on_config_reload(void *argument)
     this->trim[2] = THEKERNEL->config->value(gamma_trim_checksum )->by_default(0  )->as_number() * steps_per_mm[2] * dirz;
 }
 
-void Endstops::wait_for_homed(char axes_to_move)
+// Called from the pin interrupt when an armed endstop is hit, stops its motors on that very step
+uint32_t Endstops::on_endstop_hit(uint32_t pin_index)
 {
-    bool running = true;
-    unsigned int debounce[3] = {0, 0, 0};
-    while (running) {
-        running = false;
-        THEKERNEL->call_event(ON_IDLE);
-        for ( char c = 'X'; c <= 'Z'; c++ ) {
-            if ( ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-                if ( this->pins[c - 'X' + (this->home_direction[c - 'X'] ? 0 : 3)].get() ) {
-                    if ( debounce[c - 'X'] < debounce_count ) {
-                        debounce[c - 'X'] ++;
-                        running = true;
-                    } else if ( this->steppers[c - 'X']->moving ) {
-                        this->steppers[c - 'X']->move(0, 0);
-                    }
-                } else {
-                    // The endstop was not hit yet
-                    running = true;
-                    debounce[c - 'X'] = 0;
-                }
-            }
+    if ( this->status == NOT_HOMING ) {
+        // A limit switch, stop every motor right here, the queue is flushed from the main loop
+        // stop() keeps stepped, which then tells flush_queue how far into the block each motor got
+        // Halting the conveyor keeps any move planned meanwhile from being pushed and started
+        for (StepperMotor* m : THEKERNEL->robot->actuators) {
+            if ( m->moving ) m->stop();
+        }
+        THEKERNEL->conveyor->halted = true;
+        this->limit_hit = pin_index;
+        return 0;
+    }
+    if ( this->planned_homing ) {
+        this->endstop_hit(pin_index % 3);
+        return 0;
+    }
+    for ( int m = 0; m < 3; m++ ) {
+        if ( ( this->stop_motors[pin_index] >> m ) & 1 && this->steppers[m]->moving ) {
+            this->steppers[m]->move(0, 0);
         }
     }
+    return 0;
 }
 
-// this homing works for cartesian and delta printers, not for HBots/CoreXY
-void Endstops::do_homing(char axes_to_move)
+// Outside of homing every endstop is a limit switch, if enabled
+// Only those on P0 and P2 pins can be, as nothing is polled for them
+void Endstops::arm_limits()
 {
-    // Start moving the axes to the origin
-    this->status = MOVING_TO_ORIGIN_FAST;
-    for ( char c = 'X'; c <= 'Z'; c++ ) {
-        if ( ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-            this->feed_rate[c - 'X']= this->fast_rates[c - 'X'];
-            this->steppers[c - 'X']->set_speed(0);
-            this->steppers[c - 'X']->move(this->home_direction[c - 'X'], 10000000);
+    if ( !this->limits_enabled ) return;
+    for ( int i = 0; i < 6; i++ ) {
+        // Homing backs off its endstops, so a switch still pressed here is hit right away
+        this->stop_motors[i] = 0;
+        this->interrupts[i]->arm(true);
+    }
+}
+
+void Endstops::disarm_limits()
+{
+    for ( int i = 0; i < 6; i++ ) {
+        this->interrupts[i]->disarm();
+    }
+}
+
+// After homing the axes rest on their endstops, where with limits armed the slightest noise would trip them
+// So move away from them by the homing retract first, deltas move down by the largest one
+void Endstops::back_off(Gcode* gcode, char axes)
+{
+    if ( !this->limits_enabled || axes == 0 ) return;
+    Robot* robot = THEKERNEL->robot;
+    float target[3];
+    robot->get_axis_position(target);
+    float largest = 0.0F;
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        if ( !( ( axes >> c ) & 1 ) ) continue;
+        float retract = this->retract_steps[c] / this->steps_per_mm[c];
+        if ( this->is_delta ) {
+            if ( retract > largest ) largest = retract;
+        } else {
+            target[c] += this->home_direction[c] ? retract : -retract;
         }
     }
+    if ( this->is_delta ) target[Z_AXIS] += this->home_direction[Z_AXIS] ? largest : -largest;
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "G0 X%1.4f Y%1.4f Z%1.4f", robot->from_millimeters(target[X_AXIS]), robot->from_millimeters(target[Y_AXIS]), robot->from_millimeters(target[Z_AXIS]));
+    Gcode move(buffer, gcode->stream);
+    bool absolute_mode = robot->absolute_mode;
+    robot->absolute_mode = true;
+    THEKERNEL->call_event(ON_GCODE_RECEIVED, &move);
+    robot->absolute_mode = absolute_mode;
+    robot->flush_moves();
+    THEKERNEL->conveyor->wait_for_empty_queue();
+}
 
-    // Wait for all axes to have homed
-    this->wait_for_homed(axes_to_move);
+// A limit switch was hit, the motors were stopped by the interrupt, now throw away everything that was to follow
+// This is done from the main loop, as on_idle also runs while the planner is half way through adding a block
+// The conveyor stays halted, dropping every move, until G28 homes again
+void Endstops::on_main_loop(void* argument)
+{
+    if ( this->limit_hit < 0 ) return;
+    int pin_index = this->limit_hit;
+    this->limit_hit = -1;
+
+    THEKERNEL->conveyor->flush_queue();
+    THEKERNEL->robot->discard_moves();
+    THEKERNEL->public_data->set_value(player_checksum, abort_play_checksum, NULL);
+    THEKERNEL->streams->printf("Error: %c %s limit switch hit, moves stopped and discarded, home with G28 before going on\r\n", 'X' + pin_index % 3, pin_index < 3 ? "min" : "max");
+}
 
-    // Move back a small distance
-    this->status = MOVING_BACK;
-    bool inverted_dir;
-    for ( char c = 'X'; c <= 'Z'; c++ ) {
-        if ( ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-            inverted_dir = !this->home_direction[c - 'X'];
-            this->feed_rate[c - 'X']= this->slow_rates[c - 'X'];
-            this->steppers[c - 'X']->set_speed(0);
-            this->steppers[c - 'X']->move(inverted_dir, this->retract_steps[c - 'X']);
+// Returns false if the endstop can't interrupt, and has to be polled
+bool Endstops::arm_endstop(int pin_index, uint8_t motors)
+{
+    this->stop_motors[pin_index] = motors;
+    return this->interrupts[pin_index]->arm();
+}
+
+// Note how far into the move the endstop was hit, and have the move decelerate to a stop
+// Called from the pin interrupt, or with interrupts off when the endstop is polled
+void Endstops::endstop_hit(int axis)
+{
+    if ( ( this->triggered_axes >> axis ) & 1 ) return;
+    this->trigger_steps[axis] = this->steppers[axis]->stepped;
+    this->triggered_axes |= 1 << axis;
+    THEKERNEL->stepper->decelerate_to_stop();
+}
+
+// Plan a move of the actuators by the given distances in mm, none faster than its rate in mm/s, and wait for it to be done
+// Endstops of the watched axes cut the move short, trigger_position is then where each of them was hit
+void Endstops::home_move(float distance[], float rates[], char watched_axes)
+{
+    std::vector<StepperMotor*>& actuators = THEKERNEL->robot->actuators;
+    float target[MAX_ROBOT_ACTUATORS];
+    float unit_vec[MAX_ROBOT_ACTUATORS];
+    for (unsigned int i = 0; i < actuators.size(); i++) {
+        target[i] = actuators[i]->last_milestone_mm;
+        unit_vec[i] = 0.0F;
+    }
+
+    // Endstops already hit stay where they are, the others move on without them
+    float move[3];
+    this->triggered_axes = 0;
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        move[c] = distance[c];
+        if ( ( ( watched_axes >> c ) & 1 ) && this->pins[c + (this->home_direction[c] ? 0 : 3)].get() ) {
+            this->triggered_axes |= 1 << c;
+            this->trigger_position[c] = this->steppers[c]->last_milestone_mm;
+            watched_axes &= ~(1 << c);
+            move[c] = 0.0F;
         }
     }
 
-    // Wait for moves to be done
-    for ( char c = 'X'; c <= 'Z'; c++ ) {
-        if (  ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-            while ( this->steppers[c - 'X']->moving ) {
-                THEKERNEL->call_event(ON_IDLE);
+    int32_t start[3];
+    int steps[3];
+    float millimeters = 0.0F;
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        target[c] += move[c];
+        start[c] = this->steppers[c]->last_milestone_steps;
+        steps[c] = this->steppers[c]->steps_to_target(target[c]);
+        millimeters += move[c] * move[c];
+    }
+    millimeters = sqrtf(millimeters);
+    if ( steps[X_AXIS] == 0 && steps[Y_AXIS] == 0 && steps[Z_AXIS] == 0 ) return;
+
+    float rate = 0.0F;
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        if ( move[c] == 0.0F ) continue;
+        unit_vec[c] = move[c] / millimeters;
+        float axis_rate = rates[c] * millimeters / fabsf(move[c]);
+        if ( rate == 0.0F || axis_rate < rate ) rate = axis_rate;
+    }
+
+    // Nor accelerate any actuator past its limit, as Robot::plan_milestone does
+    float acceleration = THEKERNEL->planner->acceleration;
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        float max_acceleration = THEKERNEL->robot->actuator_max_acceleration(c);
+        if ( move[c] == 0.0F || max_acceleration <= 0.0F ) continue;
+        float axis_acceleration = acceleration * fabsf(move[c]) / millimeters;
+        if ( axis_acceleration > max_acceleration ) acceleration *= max_acceleration / axis_acceleration;
+    }
+
+    // Endstops that can interrupt decelerate the move on the step they are hit, the others are polled
+    bool interrupt[3] = {false, false, false};
+    unsigned int debounce[3] = {0, 0, 0};
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        if ( ( watched_axes >> c ) & 1 ) {
+            interrupt[c] = this->arm_endstop(c + (this->home_direction[c] ? 0 : 3), 1 << c);
+        }
+    }
+
+    THEKERNEL->planner->append_block(target, rate, millimeters, unit_vec, acceleration);
+
+    while ( !THEKERNEL->conveyor->queue.is_empty() ) {
+        THEKERNEL->conveyor->ensure_running();
+        THEKERNEL->call_event(ON_IDLE, this);
+        for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+            if ( !( ( watched_axes >> c ) & 1 ) || interrupt[c] || ( ( this->triggered_axes >> c ) & 1 ) ) continue;
+            if ( this->pins[c + (this->home_direction[c] ? 0 : 3)].get() ) {
+                if ( debounce[c] < debounce_count ) {
+                    debounce[c]++;
+                } else {
+                    __disable_irq();
+                    this->endstop_hit(c);
+                    __enable_irq();
+                }
+            } else {
+                debounce[c] = 0;
             }
         }
     }
 
-    // Start moving the axes to the origin slowly
-    this->status = MOVING_TO_ORIGIN_SLOW;
-    for ( char c = 'X'; c <= 'Z'; c++ ) {
-        if ( ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-            this->feed_rate[c - 'X']= this->slow_rates[c - 'X'];
-            this->steppers[c - 'X']->set_speed(0);
-            this->steppers[c - 'X']->move(this->home_direction[c - 'X'], 10000000);
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        if ( ( watched_axes >> c ) & 1 ) {
+            this->interrupts[c + (this->home_direction[c] ? 0 : 3)]->disarm();
         }
     }
 
-    // Wait for all axes to have homed
-    this->wait_for_homed(axes_to_move);
+    // The planner has the actuators at the target, they tell how far they actually went
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        if ( steps[c] == 0 ) continue;
+        StepperMotor* stepper = this->steppers[c];
+        int32_t dir = steps[c] < 0 ? -1 : 1;
+        stepper->last_milestone_steps = start[c] + dir * (int32_t)stepper->stepped;
+        stepper->last_milestone_mm = stepper->last_milestone_steps / stepper->steps_per_mm;
+        if ( ( this->triggered_axes >> c ) & 1 ) {
+            this->trigger_position[c] = ( start[c] + dir * (int32_t)this->trigger_steps[c] ) / stepper->steps_per_mm;
+        }
+    }
+}
+
+// Move the axes towards their endstops until each one is hit, returns false if one was not within max_travel
+// The first endstop hit stops the move for all, the others then carry on with a new one
+bool Endstops::approach(char axes_to_move, float rates[])
+{
+    char remaining = axes_to_move;
+    float distance[3];
+    while ( remaining ) {
+        for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+            distance[c] = ( ( remaining >> c ) & 1 ) ? ( this->home_direction[c] ? -this->max_travel[c] : this->max_travel[c] ) : 0.0F;
+        }
+        this->home_move(distance, rates, remaining);
+        if ( ( this->triggered_axes & remaining ) == 0 ) return false;
+        remaining &= ~this->triggered_axes;
+    }
+    return true;
+}
+
+// this homing works for cartesian and delta printers, not for HBots/CoreXY
+// The moves go through the planner so they accelerate, and decelerate once the endstops are hit
+bool Endstops::do_homing(char axes_to_move)
+{
+    float fast[3], slow[3], distance[3];
+    for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+        fast[c] = this->fast_rates[c] / this->steps_per_mm[c];
+        slow[c] = this->slow_rates[c] / this->steps_per_mm[c];
+    }
+    this->planned_homing = true;
+
+    // Move to the endstops, this goes past them by the distance it takes to decelerate
+    this->status = MOVING_TO_ORIGIN_FAST;
+    bool homed = this->approach(axes_to_move, fast);
 
-    if (this->is_delta) {
-        // move for soft trim
+    if ( homed ) {
+        // Move back to where they were hit, and a small distance further
         this->status = MOVING_BACK;
-        for ( char c = 'X'; c <= 'Z'; c++ ) {
-            if ( this->trim[c - 'X'] != 0 && ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-                inverted_dir = !this->home_direction[c - 'X'];
-                // move up or down depending on sign of trim
-                if (this->trim[c - 'X'] < 0) inverted_dir = !inverted_dir;
-                this->feed_rate[c - 'X']= this->slow_rates[c - 'X'];
-                this->steppers[c - 'X']->set_speed(0);
-                this->steppers[c - 'X']->move(inverted_dir, abs(this->trim[c - 'X']));
+        for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+            distance[c] = 0.0F;
+            if ( ( axes_to_move >> c ) & 1 ) {
+                float retract = this->retract_steps[c] / this->steps_per_mm[c];
+                distance[c] = this->trigger_position[c] - this->steppers[c]->last_milestone_mm + ( this->home_direction[c] ? retract : -retract );
             }
         }
+        this->home_move(distance, slow, 0);
 
-        // Wait for moves to be done
-        for ( char c = 'X'; c <= 'Z'; c++ ) {
-            if (  ( axes_to_move >> ( c - 'X' ) ) & 1 ) {
-                //THEKERNEL->streams->printf("axis %c \r\n", c );
-                while ( this->steppers[c - 'X']->moving ) {
-                    THEKERNEL->call_event(ON_IDLE);
+        // Move to the endstops slowly
+        this->status = MOVING_TO_ORIGIN_SLOW;
+        homed = this->approach(axes_to_move, slow);
+    }
+
+    if ( homed ) {
+        // Move back to exactly where they were hit, deltas then move for soft trim
+        this->status = MOVING_BACK;
+        for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
+            distance[c] = 0.0F;
+            if ( ( axes_to_move >> c ) & 1 ) {
+                distance[c] = this->trigger_position[c] - this->steppers[c]->last_milestone_mm;
+                if ( this->is_delta ) {
+                    // a positive trim moves away from the endstop
+                    float trim = this->trim[c] / this->steps_per_mm[c];
+                    distance[c] += this->home_direction[c] ? trim : -trim;
                 }
             }
         }
+        this->home_move(distance, slow, 0);
     }
 
     // Homing is done
+    this->planned_homing = false;
     this->status = NOT_HOMING;
+    return homed;
 }
 
 void Endstops::wait_for_homed_corexy(int axis)
 {
     bool running = true;
     unsigned int debounce[3] = {0, 0, 0};
+    int p = axis + (this->home_direction[axis] ? 0 : 3);
+    bool interrupt = this->arm_endstop(p, (1 << X_AXIS) | (1 << Y_AXIS));
     while (running) {
         running = false;
         THEKERNEL->call_event(ON_IDLE);
-        if ( this->pins[axis + (this->home_direction[axis] ? 0 : 3)].get() ) {
+        if ( interrupt ) {
+            // The interrupt stops both motors itself
+            running = !this->interrupts[p]->triggered();
+        } else if ( this->pins[p].get() ) {
             if ( debounce[axis] < debounce_count ) {
                 debounce[axis] ++;
                 running = true;
@@ -393,18 +612,26 @@ void Endstops::do_homing_corexy(char axes_to_move)
         this->steppers[motor]->set_speed(0); // need to allow for more ground covered when moving diagonally
         this->steppers[motor]->move(dir, 10000000);
         // wait until either X or Y hits the endstop
+        bool interrupt[2];
+        for(int m=X_AXIS;m<=Y_AXIS;m++) {
+            interrupt[m]= this->arm_endstop(m + (this->home_direction[m] ? 0 : 3), 1 << motor);
+        }
         bool running= true;
         while (running) {
             THEKERNEL->call_event(ON_IDLE);
             for(int m=X_AXIS;m<=Y_AXIS;m++) {
-                if(this->pins[m + (this->home_direction[m] ? 0 : 3)].get()) {
-                    // turn off motor
+                int p= m + (this->home_direction[m] ? 0 : 3);
+                if(interrupt[m] ? this->interrupts[p]->triggered() : this->pins[p].get()) {
+                    // turn off motor, the interrupt has already done it
                     if(this->steppers[motor]->moving) this->steppers[motor]->move(0, 0);
                     running= false;
                     break;
                 }
             }
         }
+        for(int m=X_AXIS;m<=Y_AXIS;m++) {
+            this->interrupts[m + (this->home_direction[m] ? 0 : 3)]->disarm();
+        }
     }
 
     // move individual axis
@@ -435,7 +662,12 @@ void Endstops::on_gcode_received(void *argument)
             gcode->mark_as_taken();
             // G28 is received, we have homing to do
 
-            // First wait for the queue to be empty
+            // First wait for the queue to be empty, limit switches are then homing endstops
+            // If one was hit meanwhile, the queue is flushed here, and homing lifts the halt
+            THEKERNEL->conveyor->wait_for_empty_queue();
+            this->disarm_limits();
+            this->on_main_loop(NULL);
+            THEKERNEL->conveyor->halted = false;
             THEKERNEL->conveyor->wait_for_empty_queue();
 
             // Do we move select axes or all of them
@@ -453,10 +685,14 @@ void Endstops::on_gcode_received(void *argument)
             THEKERNEL->stepper->turn_enable_pins_on();
 
             // do the actual homing
-            if (is_corexy)
+            if (is_corexy) {
                 do_homing_corexy(axes_to_move);
-            else
-                do_homing(axes_to_move);
+            } else if (!do_homing(axes_to_move)) {
+                gcode->stream->printf("Error: endstop not hit within max travel, not homed\r\n");
+                this->arm_limits();
+                return;
+            }
+            this->status = NOT_HOMING;
 
             // Zero the ax(i/e)s position, add in the home offset
             for ( int c = 0; c <= 2; c++ ) {
@@ -464,6 +700,9 @@ void Endstops::on_gcode_received(void *argument)
                     THEKERNEL->robot->reset_axis_position(this->homing_position[c] + this->home_offset[c], c);
                 }
             }
+
+            this->back_off(gcode, axes_to_move);
+            this->arm_limits();
         }
     } else if (gcode->has_m) {
         switch (gcode->m) {
@@ -576,7 +815,7 @@ void Endstops::trim2mm(float *mm)
 // Called periodically to change the speed to match acceleration
 uint32_t Endstops::acceleration_tick(uint32_t dummy)
 {
-    if(this->status == NOT_HOMING) return(0); // nothing to do
+    if(this->status == NOT_HOMING || this->planned_homing) return(0); // nothing to do, or the planner does it
 
     // foreach stepper that is moving
     for ( int c = X_AXIS; c <= Z_AXIS; c++ ) {
@@ -14,6 +14,10 @@
 #include "libs/StepperMotor.h"
 #include "libs/Pin.h"
 
+class PinInterrupt;
+
+
+class Gcode;
 
 class Endstops : public Module{
     public:
@@ -21,15 +25,23 @@ class Endstops : public Module{
         void on_module_loaded();
         void on_gcode_received(void* argument);
         void on_config_reload(void* argument);
+        void on_main_loop(void* argument);
         uint32_t acceleration_tick(uint32_t dummy);
+        uint32_t on_endstop_hit(uint32_t pin_index);
 
     private:
-        void do_homing(char axes_to_move);
+        bool do_homing(char axes_to_move);
+        bool approach(char axes_to_move, float rates[]);
+        void home_move(float distance[], float rates[], char watched_axes);
+        void endstop_hit(int axis);
+        void arm_limits();
+        void disarm_limits();
+        void back_off(Gcode* gcode, char axes);
         void do_homing_corexy(char axes_to_move);
-        void wait_for_homed(char axes_to_move);
         void wait_for_homed_corexy(int axis);
         void corexy_home(int home_axis, bool dirx, bool diry, float fast_rate, float slow_rate, unsigned int retract_steps);
         void trim2mm(float * mm);
+        bool arm_endstop(int pin_index, uint8_t motors);
 
         float steps_per_mm[3];
         float homing_position[3];
@@ -41,7 +53,16 @@ class Endstops : public Module{
         float  fast_rates[3];
         float  slow_rates[3];
         float  feed_rate[3];
+        float  max_travel[3];
+        float  trigger_position[3];             // Actuator position each endstop was hit at, in mm
+        volatile uint32_t trigger_steps[3];     // Steps into the move each endstop was hit at
+        volatile char triggered_axes;
+        bool   planned_homing;                  // Homing moves go through the planner, endstops decelerate them instead of stopping the motors
+        bool   limits_enabled;                  // Setting : endstops stop everything when hit outside of homing
+        volatile int8_t limit_hit;              // Endstop that was hit as a limit switch, -1 if none
         Pin           pins[6];
+        PinInterrupt* interrupts[6];     // Stop the motors as soon as the endstop is hit, for pins that can interrupt
+        uint8_t       stop_motors[6];    // Which motors each endstop stops when hit
         StepperMotor* steppers[3];
         char status;
         bool is_corexy;
@@ -18,10 +18,8 @@
 
 class StepperMotor;
 
-#define OFF 0
-#define SOLO 1
-#define FOLLOW 2
-
+// The extruder's motor is planned and stepped by the Robot, Planner and Stepper along with the axes, following the E word
+// This module only configures it and looks after its enable pin and steps per millimeter
 class Extruder : public Module, public Tool {
     public:
         Extruder(uint16_t config_identifier);
@@ -29,41 +27,25 @@ class Extruder : public Module, public Tool {
         void     on_config_reload(void* argument);
         void     on_gcode_received(void*);
         void     on_gcode_execute(void* argument);
-        void     on_block_begin(void* argument);
-        void     on_block_end(void* argument);
-        void     on_play(void* argument);
-        void     on_pause(void* argument);
-        void     on_speed_change(void* argument);
-        uint32_t acceleration_tick(uint32_t dummy);
-        uint32_t stepper_motor_finished_move(uint32_t dummy);
-        Block*   append_empty_block();
+        void     on_get_public_data(void* argument);
 
         Pin             step_pin;                     // Step pin for the stepper driver
         Pin             dir_pin;                      // Dir pin for the stepper driver
         Pin             en_pin;
 
-        float          target_position;              // End point ( in mm ) for the current move
-        float          current_position;             // Current point ( in mm ) for the current move, incremented every time a move is executed
-        float          unstepped_distance;           // overflow buffer for requested moves that are less than 1 step
-        Block*          current_block;                // Current block we are stepping, same as Stepper's one
         float          steps_per_millimeter;         // Steps to travel one millimeter
-        float          feed_rate;                    //
-        float          acceleration;                 //
-        float          max_speed;
-
-        float          travel_ratio;
-        float          travel_distance;
-        bool            absolute_mode;                // absolute/relative coordinate mode switch
-
-        char mode;                                    // extruder motion mode,  OFF, SOLO, or FOLLOW
+        float          acceleration;                 // Max acceleration of the filament, in mm/s^2, 0 for no limit
+        float          max_speed;                    // Max speed of the filament, in mm/s
+        float          linear_advance;               // Pressure advance factor K, in seconds
 
-        bool paused;
         bool single_config;
 
         uint16_t identifier;
 
         StepperMotor* stepper_motor;
 
+    private:
+        void     update_stepper_motor();
 };
 
 #endif
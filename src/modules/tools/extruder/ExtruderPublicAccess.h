@@ -0,0 +1,8 @@
+#ifndef __EXTRUDERPUBLICACCESS_H
+#define __EXTRUDERPUBLICACCESS_H
+
+// addresses used for public data access
+#define extruder_checksum            CHECKSUM("extruder")
+#define flow_rate_checksum           CHECKSUM("flow_rate")
+
+#endif // __EXTRUDERPUBLICACCESS_H
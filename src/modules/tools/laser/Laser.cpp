@@ -16,8 +16,33 @@
 #include "Block.h"
 #include "checksumm.h"
 #include "ConfigValue.h"
+#include "modules/robot/Robot.h"
+#include "modules/robot/Planner.h"
+#include "modules/robot/Conveyor.h"
+#include "libs/StepperMotor.h"
+#include "libs/SerialMessage.h"
+#include "libs/StreamOutput.h"
+#include "libs/utils.h"
+#include "PublicDataRequest.h"
+#include "LaserPublicAccess.h"
+
+#include <math.h>
+#include <stdlib.h>
 
 Laser::Laser(){
+    this->laser_on = false;
+    this->raster_rows = NULL;
+    this->raster_filled = 0;
+    this->raster_done = 0;
+    this->raster_file = NULL;
+    this->raster_data = NULL;
+    this->raster_feed = 0;
+    this->raster_speed = 0;
+    this->raster_end[X_AXIS] = this->raster_end[Y_AXIS] = 0;
+    this->raster_overscan_end[X_AXIS] = this->raster_overscan_end[Y_AXIS] = NAN;
+    this->raster_pending = false;
+    this->raster_active = false;
+    this->raster_stepper = NULL;
 }
 
 void Laser::on_module_loaded() {
@@ -53,37 +78,83 @@ void Laser::on_module_loaded() {
 
     this->laser_inverting = dummy_pin->inverting;
 
+    // P2.0 to P2.5 are PWM1.1 to PWM1.6
+    this->pwm_channel = dummy_pin->pin + 1;
+    switch( this->pwm_channel ){
+        case 1: this->pwm_match = &LPC_PWM1->MR1; break;
+        case 2: this->pwm_match = &LPC_PWM1->MR2; break;
+        case 3: this->pwm_match = &LPC_PWM1->MR3; break;
+        case 4: this->pwm_match = &LPC_PWM1->MR4; break;
+        case 5: this->pwm_match = &LPC_PWM1->MR5; break;
+        case 6: this->pwm_match = &LPC_PWM1->MR6; break;
+    }
+
     delete dummy_pin;
     dummy_pin = NULL;
 
     this->laser_pin->period_us(THEKERNEL->config->value(laser_module_pwm_period_checksum)->by_default(20)->as_number());
-    this->laser_pin->write(this->laser_inverting ? 1 : 0);
+    this->pwm_period = LPC_PWM1->MR0;
 
-    this->laser_max_power =    THEKERNEL->config->value(laser_module_max_power_checksum   )->by_default(0.8f)->as_number() ;
     this->laser_tickle_power = THEKERNEL->config->value(laser_module_tickle_power_checksum)->by_default(0   )->as_number() ;
+    this->set_power(           THEKERNEL->config->value(laser_module_max_power_checksum   )->by_default(0.8f)->as_number() );
+
+    // Power follows speed along power = minimum + ( 1 - minimum ) * speed ^ exponent, as a fraction of the S power
+    this->build_power_curve(   THEKERNEL->config->value(laser_module_minimum_power_checksum )->by_default(0.0f)->as_number(),
+                               THEKERNEL->config->value(laser_module_power_exponent_checksum)->by_default(1.0f)->as_number() );
+
+    this->set_pwm(0);
+
+    this->raster_overscan = THEKERNEL->config->value(laser_module_raster_overscan_checksum)->by_default(0.0f)->as_number();
+    this->raster_power    = this->laser_max_power;
 
     //register for events
     this->register_for_event(ON_GCODE_EXECUTE);
-    this->register_for_event(ON_SPEED_CHANGE);
+    this->register_for_event(ON_GCODE_RECEIVED);
+    this->register_for_event(ON_CONSOLE_LINE_RECEIVED);
+    this->register_for_event(ON_SET_PUBLIC_DATA);
     this->register_for_event(ON_PLAY);
     this->register_for_event(ON_PAUSE);
     this->register_for_event(ON_BLOCK_BEGIN);
     this->register_for_event(ON_BLOCK_END);
+    this->register_for_event(ON_QUEUE_FLUSH);
+
+    // Follow the speed changes of the stepper
+    THEKERNEL->stepper->attach_speed_listener(this, &Laser::speed_changed);
 }
 
 // Turn laser off laser at the end of a move
 void  Laser::on_block_end(void* argument){
-    this->laser_pin->write(this->laser_inverting ? 1 : 0);
+    this->set_pwm(0);
+
+    // Free the row for the next G7
+    if( this->raster_active ){
+        this->raster_active = false;
+        if( this->raster_stepper != NULL ){ this->raster_stepper->watch_step = false; }
+        this->raster_done++;
+    }
+}
+
+// The queued rows were thrown away with their blocks, their slots are free again
+void Laser::on_queue_flush(void* argument){
+    this->set_pwm(0);
+    this->raster_pending = false;
+    this->raster_filled = this->raster_done;
+    this->raster_overscan_end[X_AXIS] = this->raster_overscan_end[Y_AXIS] = NAN;
 }
 
 // Set laser power at the beginning of a block
 void Laser::on_block_begin(void* argument){
+    if( this->raster_pending ){
+        this->raster_pending = false;
+        this->raster_start();
+        return;
+    }
     this->set_proportional_power();
 }
 
 // When the play/pause button is set to pause, or a module calls the ON_PAUSE event
 void Laser::on_pause(void* argument){
-    this->laser_pin->write(this->laser_inverting ? 1 : 0);
+    this->set_pwm(0);
 }
 
 // When the play/pause button is set to play, or a module calls the ON_PLAY event
@@ -95,33 +166,310 @@ void Laser::on_play(void* argument){
 void Laser::on_gcode_execute(void* argument){
     Gcode* gcode = static_cast<Gcode*>(argument);
     this->laser_on = false;
-    if( gcode->has_g){
+    if( gcode->has_g && gcode->has_letter('Q') ){
+        // Moves of a raster row, Q1 engraves the row, Q0 are the overscan zones on each side where the laser stays off
+        if( gcode->get_value('Q') == 1 ){
+            this->raster_pending = true;
+        }
+        this->set_pwm(0);
+    }else if( gcode->has_g){
         int code = gcode->g;
         if( code == 0 ){                    // G0
-            this->laser_pin->write(this->laser_inverting ? 1 - this->laser_tickle_power : this->laser_tickle_power);
+            this->set_pwm(this->laser_tickle_power * this->pwm_period);
             this->laser_on =  false;
         }else if( code >= 1 && code <= 3 ){ // G1, G2, G3
             this->laser_on =  true;
         }
     }
     if ( gcode->has_letter('S' )){
-        this->laser_max_power = gcode->get_value('S');
+        this->set_power(gcode->get_value('S'));
 //         THEKERNEL->streams->printf("Adjusted laser power to %d/100\r\n",(int)(this->laser_max_power*100.0+0.5));
     }
 
 }
 
 // We follow the stepper module here, so speed must be proportional
-void Laser::on_speed_change(void* argument){
+uint32_t Laser::speed_changed(uint32_t dummy){
     if( this->laser_on ){
         this->set_proportional_power();
     }
+    return 0;
 }
 
 void Laser::set_proportional_power(){
     if( this->laser_on && THEKERNEL->stepper->current_block ){
-        // adjust power to maximum power and actual velocity
-        float proportional_power = float(float(this->laser_max_power) * float(THEKERNEL->stepper->trapezoid_adjusted_rate) / float(THEKERNEL->stepper->current_block->nominal_rate));
-        this->laser_pin->write(this->laser_inverting ? 1 - proportional_power : proportional_power);
+        // adjust power to maximum power and actual velocity, along the power curve
+        float speed = THEKERNEL->stepper->speed_ratio;
+        uint32_t index = speed >= 1.0F ? LASER_POWER_CURVE_SIZE : speed <= 0.0F ? 0 : uint32_t(speed * LASER_POWER_CURVE_SIZE);
+        this->set_pwm( ( this->power_match * this->power_curve[index] ) / LASER_POWER_CURVE_ONE );
+    }
+}
+
+// Set the power for S values, as a fraction of the full PWM period
+void Laser::set_power(float power){
+    if( power < 0.0F ){ power = 0.0F; }
+    if( power > 1.0F ){ power = 1.0F; }
+    this->laser_max_power = power;
+    this->power_match = lroundf(power * this->pwm_period);
+}
+
+// Work out the power for each speed step once, so the speed listener does not need any float math
+void Laser::build_power_curve(float minimum_power, float exponent){
+    for( int i = 0; i <= LASER_POWER_CURVE_SIZE; i++ ){
+        float fraction = minimum_power + ( 1.0F - minimum_power ) * powf( float(i) / LASER_POWER_CURVE_SIZE, exponent );
+        this->power_curve[i] = lroundf( fraction * LASER_POWER_CURVE_ONE );
+    }
+}
+
+// Write the duty cycle straight into the match register, it is latched at the start of the next PWM period
+void Laser::set_pwm(uint32_t match){
+    if( match > this->pwm_period ){ match = this->pwm_period; }
+    *this->pwm_match = this->laser_inverting ? this->pwm_period - match : match;
+    LPC_PWM1->LER |= 1 << this->pwm_channel;
+}
+
+// Catch G7 raster rows, and keep track of the power and speed they are to be engraved at
+void Laser::on_gcode_received(void* argument){
+    Gcode* gcode = static_cast<Gcode*>(argument);
+    if( !gcode->has_g ){ return; }
+
+    if( gcode->g == 7 ){
+        gcode->mark_as_taken();
+        this->raster_row(gcode);
+        return;
+    }
+
+    if( gcode->g >= 1 && gcode->g <= 3 && gcode->has_letter('S') ){
+        this->raster_power = gcode->get_value('S');
+    }
+}
+
+// GcodeDispatch hands us the base64 pixels of G7 lines, as they would not survive being cut up into letters
+void Laser::on_set_public_data(void* argument){
+    PublicDataRequest* pdr = static_cast<PublicDataRequest*>(argument);
+
+    if( !pdr->starts_with(laser_checksum) ) return;
+    if( !pdr->second_element_is(raster_data_checksum) ) return;
+
+    this->raster_data = static_cast<string*>(pdr->get_data_ptr());
+    pdr->set_taken();
+}
+
+void Laser::on_console_line_received(void* argument){
+    SerialMessage new_message = *static_cast<SerialMessage*>(argument);
+
+    // ignore comments
+    if( new_message.message[0] == ';' ) return;
+
+    string possible_command = new_message.message;
+    unsigned short check_sum = get_checksum( possible_command.substr(0, possible_command.find_first_of(" \r\n")) );
+
+    if( check_sum == raster_command_checksum )
+        this->raster_command( get_arguments(possible_command), new_message.stream );
+}
+
+// Select the binary file G7 reads its rows from, one byte per pixel, or close it when no file is given
+void Laser::raster_command(string parameters, StreamOutput* stream){
+    if( this->raster_file != NULL ){
+        fclose(this->raster_file);
+        this->raster_file = NULL;
+    }
+
+    string filename = shift_parameter( parameters );
+    if( filename.empty() ){ return; }
+
+    filename = absolute_from_relative(filename);
+    this->raster_file = fopen( filename.c_str(), "r");
+    if( this->raster_file == NULL ){
+        stream->printf("File not found: %s\r\n", filename.c_str());
+        return;
+    }
+    stream->printf("Raster rows from %s\r\n", filename.c_str());
+}
+
+// Decode base64 text into at most size bytes, returns the number of bytes decoded
+static uint32_t base64_decode(const char* text, uint8_t* out, uint32_t size){
+    uint32_t bits = 0, count = 0, n = 0;
+    for( ; *text != '\0' && n < size; text++ ){
+        char c = *text;
+        uint32_t value;
+        if(      c >= 'A' && c <= 'Z' ){ value = c - 'A'; }
+        else if( c >= 'a' && c <= 'z' ){ value = c - 'a' + 26; }
+        else if( c >= '0' && c <= '9' ){ value = c - '0' + 52; }
+        else if( c == '+' ){ value = 62; }
+        else if( c == '/' ){ value = 63; }
+        else{ continue; } // padding and spaces
+        bits = (bits << 6) | value;
+        count += 6;
+        if( count >= 8 ){
+            count -= 8;
+            out[n++] = (bits >> count) & 0xFF;
+        }
+    }
+    return n;
+}
+
+// G7 X Y [F] [S] [L] [D] : engrave a row of pixels from the current position to X Y
+// The pixels are D in base64, or L bytes read from the raster file. The row is planned as three moves, with an acceleration zone
+// before and a deceleration zone after where the laser stays off, so the pixels are all engraved at the same speed
+void Laser::raster_row(Gcode* gcode){
+    Robot* robot = THEKERNEL->robot;
+    string* data = this->raster_data;
+    this->raster_data = NULL;
+
+    // Moves are dropped after a limit switch hit, the row goes with them
+    if( THEKERNEL->conveyor->halted ){ return; }
+
+    // The row is engraved as a single block, which only moves in a straight line when the actuators are the axes
+    if( robot->arm_solution_kind == ARM_SOLUTION_OTHER ){
+        gcode->stream->printf("Error: G7 raster rows need a cartesian or hbot arm solution\r\n");
+        return;
+    }
+
+    if( gcode->has_letter('F') ){
+        this->raster_feed  = gcode->get_value('F');
+        this->raster_speed = robot->to_millimeters(this->raster_feed) / robot->seconds_per_minute;
+    }
+    if( gcode->has_letter('S') ){
+        this->raster_power = gcode->get_value('S');
+    }
+
+    // A row following the previous one starts where that row ended, not at the end of its deceleration zone
+    float start[3];
+    robot->get_axis_position(start);
+    if( fabs(start[X_AXIS] - this->raster_overscan_end[X_AXIS]) < 0.001F && fabs(start[Y_AXIS] - this->raster_overscan_end[Y_AXIS]) < 0.001F ){
+        start[X_AXIS] = this->raster_end[X_AXIS];
+        start[Y_AXIS] = this->raster_end[Y_AXIS];
+    }
+
+    float end[2];
+    end[X_AXIS] = gcode->has_letter('X') ? robot->to_millimeters(gcode->get_value('X')) + ( robot->absolute_mode ? 0 : start[X_AXIS] ) : start[X_AXIS];
+    end[Y_AXIS] = gcode->has_letter('Y') ? robot->to_millimeters(gcode->get_value('Y')) + ( robot->absolute_mode ? 0 : start[Y_AXIS] ) : start[Y_AXIS];
+
+    float length = hypotf(end[X_AXIS] - start[X_AXIS], end[Y_AXIS] - start[Y_AXIS]);
+    if( length < 0.0001F ){ return; }
+
+    // Wait for the oldest row to be engraved if they are all in use
+    if( this->raster_rows == NULL ){
+        this->raster_rows = (uint8_t*)malloc(LASER_RASTER_ROWS * LASER_RASTER_ROW_SIZE);
+        if( this->raster_rows == NULL ){
+            gcode->stream->printf("Error: not enough memory for raster rows\r\n");
+            return;
+        }
+    }
+    while( (uint8_t)(this->raster_filled - this->raster_done) >= LASER_RASTER_ROWS ){
+        // A limit switch stopped the queue, the row would be dropped with its moves anyway
+        if( THEKERNEL->conveyor->halted ){ return; }
+        THEKERNEL->conveyor->ensure_running();
+        THEKERNEL->call_event(ON_IDLE, this);
+    }
+
+    uint8_t slot = this->raster_filled % LASER_RASTER_ROWS;
+    uint8_t* row = this->raster_rows + slot * LASER_RASTER_ROW_SIZE;
+    uint32_t count = LASER_RASTER_ROW_SIZE;
+    if( gcode->has_letter('L') && gcode->get_value('L') < count ){
+        count = gcode->get_value('L');
+    }
+
+    if( data != NULL ){
+        count = base64_decode(data->c_str(), row, count);
+    }else if( this->raster_file != NULL && gcode->has_letter('L') ){
+        count = fread(row, 1, count, this->raster_file);
+    }else{
+        gcode->stream->printf("Error: G7 needs D pixels, or L and a raster file\r\n");
+        return;
+    }
+    if( count == 0 ){ return; }
+
+    this->raster_lengths[slot] = count;
+    this->raster_filled++;
+
+    // Distance needed to get up to speed, and back down
+    float overscan = this->raster_overscan;
+    if( this->raster_speed > 0 ){
+        overscan += ( this->raster_speed * this->raster_speed ) / ( 2.0F * THEKERNEL->planner->acceleration );
+    }
+    float unit[2] = { (end[X_AXIS] - start[X_AXIS]) / length, (end[Y_AXIS] - start[Y_AXIS]) / length };
+
+    // The S word keeps the Robot from merging the moves, Q tells us which one is the row
+    char feed[16] = "";
+    if( this->raster_feed > 0 ){
+        snprintf(feed, sizeof(feed), " F%1.4f", this->raster_feed);
+    }
+    char zone[40], engrave[40];
+    snprintf(zone,    sizeof(zone),    "%s S%1.4f Q0", feed, this->raster_power);
+    snprintf(engrave, sizeof(engrave), "%s S%1.4f Q1", feed, this->raster_power);
+
+    // The moves are given in absolute coordinates, whatever the mode
+    bool absolute_mode = robot->absolute_mode;
+    robot->absolute_mode = true;
+    this->raster_move(gcode, "G0", start[X_AXIS] - unit[X_AXIS] * overscan, start[Y_AXIS] - unit[Y_AXIS] * overscan, "");
+    if( overscan > 0 ){
+        this->raster_move(gcode, "G1", start[X_AXIS], start[Y_AXIS], zone);
+    }
+    this->raster_move(gcode, "G1", end[X_AXIS], end[Y_AXIS], engrave);
+    if( overscan > 0 ){
+        this->raster_move(gcode, "G1", end[X_AXIS] + unit[X_AXIS] * overscan, end[Y_AXIS] + unit[Y_AXIS] * overscan, zone);
+    }
+    robot->absolute_mode = absolute_mode;
+
+    this->raster_end[X_AXIS] = end[X_AXIS];
+    this->raster_end[Y_AXIS] = end[Y_AXIS];
+    robot->get_axis_position(start);
+    this->raster_overscan_end[X_AXIS] = start[X_AXIS];
+    this->raster_overscan_end[Y_AXIS] = start[Y_AXIS];
+}
+
+// Hand a move to the Robot as if it had been received
+void Laser::raster_move(Gcode* gcode, const char* command, float x, float y, const char* tail){
+    char buffer[80];
+    snprintf(buffer, sizeof(buffer), "%s X%1.4f Y%1.4f%s", command, THEKERNEL->robot->from_millimeters(x), THEKERNEL->robot->from_millimeters(y), tail);
+    Gcode move(buffer, gcode->stream);
+    THEKERNEL->call_event(ON_GCODE_RECEIVED, &move);
+}
+
+// Start engraving the row of the block that just began, the main stepper tells us when each pixel starts
+void Laser::raster_start(){
+    uint8_t slot = this->raster_done % LASER_RASTER_ROWS;
+    StepperMotor* stepper = THEKERNEL->stepper->main_stepper;
+    this->raster_active  = true;
+    this->raster_stepper = stepper;
+    if( stepper == NULL || !stepper->moving ){ return; }
+
+    this->raster_pixels         = this->raster_rows + slot * LASER_RASTER_ROW_SIZE;
+    this->raster_count          = this->raster_lengths[slot];
+    this->raster_step_quotient  = stepper->steps_to_move / this->raster_count;
+    this->raster_step_remainder = stepper->steps_to_move % this->raster_count;
+    this->raster_step_error     = 0;
+    this->raster_boundary       = 0;
+    this->raster_next           = 0;
+
+    this->raster_pixel(0);
+    if( this->raster_next < this->raster_count ){
+        stepper->attach_step_watch(this->raster_boundary, this, &Laser::raster_pixel);
+    }
+}
+
+// Called from the step interrupt when the main stepper reaches the start of a pixel
+// Pixel p starts at step p * steps / count, which is stepped through as a fraction to keep this to integer adds
+uint32_t Laser::raster_pixel(uint32_t dummy){
+    uint32_t stepped = this->raster_stepper->stepped;
+    while( this->raster_next < this->raster_count && this->raster_boundary <= stepped ){
+        this->raster_next++;
+        this->raster_boundary += this->raster_step_quotient;
+        this->raster_step_error += this->raster_step_remainder;
+        if( this->raster_step_error >= this->raster_count ){
+            this->raster_step_error -= this->raster_count;
+            this->raster_boundary++;
+        }
+    }
+
+    this->set_pwm( ( this->power_match * this->raster_pixels[this->raster_next - 1] ) / 255 );
+
+    if( this->raster_next < this->raster_count ){
+        this->raster_stepper->watch_step_number = this->raster_boundary;
+    }else{
+        this->raster_stepper->watch_step = false;
     }
+    return 0;
 }
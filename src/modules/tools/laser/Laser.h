@@ -14,12 +14,27 @@
 #include "modules/communication/utils/Gcode.h"
 #include "PwmOut.h" // mbed.h lib
 
+#include <stdio.h>
+
 
 #define laser_module_enable_checksum        CHECKSUM("laser_module_enable")
 #define laser_module_pin_checksum           CHECKSUM("laser_module_pin")
 #define laser_module_pwm_period_checksum    CHECKSUM("laser_module_pwm_period")
 #define laser_module_max_power_checksum     CHECKSUM("laser_module_max_power")
 #define laser_module_tickle_power_checksum  CHECKSUM("laser_module_tickle_power")
+#define laser_module_minimum_power_checksum CHECKSUM("laser_module_minimum_power")
+#define laser_module_power_exponent_checksum CHECKSUM("laser_module_power_exponent")
+#define laser_module_raster_overscan_checksum CHECKSUM("laser_module_raster_overscan")
+#define raster_command_checksum             CHECKSUM("raster")
+
+#define LASER_POWER_CURVE_SIZE 64          // Number of speed steps in the power curve
+#define LASER_POWER_CURVE_ONE  4096        // Full power in the curve, fixed point
+
+#define LASER_RASTER_ROWS      4           // Number of raster rows queued ahead of the one being engraved
+#define LASER_RASTER_ROW_SIZE  512         // Max number of pixels in a raster row
+
+class StepperMotor;
+class StreamOutput;
 
 class Laser : public Module{
     public:
@@ -27,18 +42,61 @@ class Laser : public Module{
         virtual ~Laser() {};
         void on_module_loaded();
         void on_block_end(void* argument);
+        void on_queue_flush(void* argument);
         void on_block_begin(void* argument);
         void on_play(void* argument);
         void on_pause(void* argument);
         void on_gcode_execute(void* argument);
-        void on_speed_change(void* argument);
+        void on_gcode_received(void* argument);
+        void on_console_line_received(void* argument);
+        void on_set_public_data(void* argument);
+        void raster_command(string parameters, StreamOutput* stream);
+        void raster_row(Gcode* gcode);
+        void raster_move(Gcode* gcode, const char* command, float x, float y, const char* tail);
+        void raster_start();
+        uint32_t raster_pixel(uint32_t dummy);
+        uint32_t speed_changed(uint32_t dummy);
         void set_proportional_power();
+        void set_pwm(uint32_t match);
+        void set_power(float power);
+        void build_power_curve(float minimum_power, float exponent);
 
         mbed::PwmOut*    laser_pin;    // PWM output to regulate the laser power
         bool             laser_on;     // Laser status
         bool             laser_inverting; // stores whether the pwm period should be inverted
         float            laser_max_power; // maximum allowed laser power to be output on the pwm pin
         float            laser_tickle_power; // value used to tickle the laser on moves
+
+        // The PWM1 match register of the laser pin is written directly, so the speed listener only does integer math
+        volatile uint32_t* pwm_match;
+        uint8_t          pwm_channel;
+        uint32_t         pwm_period;      // PWM period in match register ticks
+        uint32_t         power_match;     // Match value for laser_max_power at the block's nominal speed
+        uint16_t         power_curve[LASER_POWER_CURVE_SIZE+1]; // Fraction of the power, out of LASER_POWER_CURVE_ONE, for each speed step
+
+        // Raster rows, G7 fills them in when received and the row's block engraves them when executed, in order
+        uint8_t*         raster_rows;     // LASER_RASTER_ROWS rows of pixel intensities, allocated on the first G7
+        uint16_t         raster_lengths[LASER_RASTER_ROWS];
+        volatile uint8_t raster_filled;   // Rows filled so far, only changed by G7
+        volatile uint8_t raster_done;     // Rows engraved so far, only changed at the end of the row's block
+        FILE*            raster_file;     // Binary file G7 reads rows from when they do not come inline
+        string*          raster_data;     // Base64 pixels of the G7 being received, set by GcodeDispatch
+        float            raster_overscan; // Setting : extra distance ( mm ) past the acceleration zone on each side of a row
+        float            raster_power;    // Last S received, for the rows
+        float            raster_feed;     // Last F received with a G7, 0 if none yet
+        float            raster_speed;    // Same in mm/s
+        float            raster_end[2];   // End of the last row, and of its deceleration zone, where the next row carries on from
+        float            raster_overscan_end[2];
+        bool             raster_pending;  // The next block engraves a row
+        bool             raster_active;   // A row is being engraved
+
+        // Pixel being engraved, worked out by the step watch of the main stepper
+        StepperMotor*    raster_stepper;
+        uint8_t*         raster_pixels;
+        uint16_t         raster_count;
+        uint16_t         raster_next;     // Next pixel
+        uint32_t         raster_boundary; // Step the next pixel starts at
+        uint32_t         raster_step_quotient, raster_step_remainder, raster_step_error; // Steps per pixel, as a fraction
 };
 
 #endif
@@ -0,0 +1,8 @@
+#ifndef __LASERPUBLICACCESS_H_
+#define __LASERPUBLICACCESS_H_
+
+// addresses used for public data access
+#define laser_checksum                         CHECKSUM("laser")
+#define raster_data_checksum                   CHECKSUM("raster_data")
+
+#endif
@@ -124,8 +124,8 @@ void Switch::on_config_reload(void *argument)
     }
 
     if(this->output_type == PWM && this->output_pin.connected()) {
-        // PWM
-        THEKERNEL->slow_ticker->attach(1000, &this->output_pin, &Pwm::on_tick);
+        // PWM, in hardware if the pin is on a PWM1 channel
+        this->output_pin.start(1000);
     }
 }
 
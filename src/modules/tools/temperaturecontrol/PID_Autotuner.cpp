@@ -4,17 +4,21 @@
 #include "Gcode.h"
 #include "TemperatureControl.h"
 
-#include <cmath>        // std::abs
+#include <cmath>        // std::abs, std::isfinite
 
 //#define DEBUG_PRINTF s->printf
 #define DEBUG_PRINTF(...)
 
+#define CONVERGED_CYCLES    3           // Cycles that must agree before the relay autotune stops early
+#define CONVERGED_SPREAD    0.05F       // How much their amplitudes and periods may differ, relative to their average
+#define STEP_TIMEOUT        (20 * 60 * 1000UL)  // Beds can take that long
+
 PID_Autotuner::PID_Autotuner()
 {
     t = NULL;
     s = NULL;
-    lastInputs = NULL;
-    peaks = NULL;
+    amplitudes = NULL;
+    periods = NULL;
     tick = false;
     tickCnt= 0;
 }
@@ -27,43 +31,52 @@ void PID_Autotuner::on_module_loaded()
     register_for_event(ON_GCODE_RECEIVED);
 }
 
-void PID_Autotuner::begin(TemperatureControl *temp, float target, StreamOutput *stream, int ncycles)
+void PID_Autotuner::begin(TemperatureControl *temp, float target, StreamOutput *stream, int ncycles, bool step)
 {
+    if (t != NULL)
+        abort();
+
     noiseBand = 0.5;
     oStep = temp->heater_pin.max_pwm(); // use max pwm to cycle temp
-    nLookBack = 5 * 20; // 5 seconds of lookback
-    lookBackCnt= 0;
     tickCnt= 0;
 
-    if (lastInputs != NULL) delete[] lastInputs;
-    lastInputs = new float[nLookBack+1];
     t = temp;
     s = stream;
+    this->step = step;
 
-    t->heater_pin.set(0);
-    t->target_temperature = 0.0;
-
-    target_temperature = target;
-    requested_cycles = ncycles;
-
-    if (peaks != NULL) delete[] peaks;
-    peaks = new float[ncycles];
-
-    for (int i = 0; i < ncycles; i++) {
-        peaks[i] = 0.0;
+    float refVal = t->get_temperature();
+    if (step && (!std::isfinite(refVal) || refVal > target - 20)) {
+        s->printf("Error: %s must be at least 20C below the target for a step autotune\n", t->designator.c_str());
+        t = NULL;
+        s = NULL;
+        return;
     }
 
-    peakType = 0;
-    peakCount = 0;
-    justchanged = false;
-
-    float refVal = t->get_temperature();
-    absMax = refVal;
-    absMin = refVal;
-    output= oStep;
-    t->heater_pin.pwm(oStep); // turn on to start heating
+    // The temperature control leaves the heater to us until we are done
+    t->target_temperature = 0.0;
+    t->tuning = true;
 
-    s->printf("%s: Starting PID Autotune, %d max cycles, M304 aborts\n", t->designator.c_str(), ncycles);
+    target_temperature = target;
+    requested_cycles = (ncycles < CONVERGED_CYCLES) ? CONVERGED_CYCLES : ncycles;
+
+    if (amplitudes != NULL) delete[] amplitudes;
+    if (periods != NULL) delete[] periods;
+    amplitudes = new float[requested_cycles];
+    periods = new float[requested_cycles];
+    cycleCount = 0;
+    lastOn = 0;
+    cycleMax = refVal;
+    cycleMin = refVal;
+
+    sampleTime = 0;
+    rise.begin(refVal);
+
+    setOutput(oStep); // turn on to start heating
+
+    if (step)
+        s->printf("%s: Starting PID step autotune, M304 aborts\n", t->designator.c_str());
+    else
+        s->printf("%s: Starting PID Autotune, %d max cycles, M304 aborts\n", t->designator.c_str(), requested_cycles);
 }
 
 void PID_Autotuner::abort()
@@ -71,20 +84,35 @@ void PID_Autotuner::abort()
     if (!t)
         return;
 
-    t->target_temperature = 0;
-    t->heater_pin.set(0);
-    t = NULL;
-
     if (s)
         s->printf("PID Autotune Aborted\n");
+    stop();
+}
+
+void PID_Autotuner::stop()
+{
+    t->tuning = false;
+    t->target_temperature = 0;
+    setOutput(0);
+    t = NULL;
     s = NULL;
 
-    if (peaks != NULL)
-        delete[] peaks;
-    peaks = NULL;
-    if (lastInputs != NULL)
-        delete[] lastInputs;
-    lastInputs = NULL;
+    if (amplitudes != NULL)
+        delete[] amplitudes;
+    amplitudes = NULL;
+    if (periods != NULL)
+        delete[] periods;
+    periods = NULL;
+}
+
+void PID_Autotuner::setOutput(int o)
+{
+    output = o;
+    t->o = o;
+    if (o == 0)
+        t->heater_pin.set(0);
+    else
+        t->heater_pin.pwm(o);
 }
 
 void PID_Autotuner::on_gcode_received(void *argument)
@@ -116,96 +144,91 @@ void PID_Autotuner::on_idle(void *)
     if (t == NULL)
         return;
 
-    if(peakCount >= requested_cycles) {
-        finishUp();
-        return;
-    }
-
+    // The temperature control stops tuning if the thermistor fails
     float refVal = t->get_temperature();
-
-    if (refVal > absMax) absMax = refVal;
-    if (refVal < absMin) absMin = refVal;
-
-    // oscillate the output base on the input's relation to the setpoint
-    if (refVal > target_temperature + noiseBand){
-        output= 0;
-        //t->heater_pin.pwm(output);
-        t->heater_pin.set(0);
-    } else if (refVal < target_temperature - noiseBand) {
-        output= oStep;
-        t->heater_pin.pwm(output);
-    }
-
-    bool isMax = true, isMin = true;
-
-    // id peaks
-    for (int i = nLookBack - 1; i >= 0; i--) {
-        float val = lastInputs[i];
-        if (isMax) isMax = refVal > val;
-        if (isMin) isMin = refVal < val;
-        lastInputs[i + 1] = lastInputs[i];
-    }
-
-    lastInputs[0] = refVal;
-
-    if (lookBackCnt < nLookBack) {
-        lookBackCnt++; // count number of times we have filled lastInputs
-        //we don't want to trust the maxes or mins until the inputs array has been filled
+    if (!t->tuning || !std::isfinite(refVal)) {
+        s->printf("Error: %s reading lost, PID Autotune stopped\n", t->designator.c_str());
+        stop();
         return;
     }
 
-    if (isMax) {
-        if (peakType == 0) peakType = 1;
-        if (peakType == -1) {
-            peakType = 1;
-            justchanged = true;
-            peak2 = peak1;
-        }
-        peak1 = tickCnt;
-        peaks[peakCount] = refVal;
-
-    } else if (isMin) {
-        if (peakType == 0) peakType = -1;
-        if (peakType == 1) {
-            peakType = -1;
-            peakCount++;
-            justchanged = true;
-        }
-
-        if (peakCount < requested_cycles) peaks[peakCount] = refVal;
-    }
+    if (step)
+        step_tick(refVal);
+    else
+        relay_tick(refVal);
+}
 
-    // we need to ignore the first cycle warming up from room temp
+void PID_Autotuner::relay_tick(float refVal)
+{
+    if (refVal > cycleMax) cycleMax = refVal;
+    if (refVal < cycleMin) cycleMin = refVal;
 
-    if (justchanged && peakCount > 2) {
-        if(peakCount == 3) { // reset min to new min
-            absMin= refVal;
-        }
-        //we've transitioned. check if we can autotune based on the last peaks
-        float avgSeparation = (std::abs(peaks[peakCount - 1] - peaks[peakCount - 2]) + std::abs(peaks[peakCount - 2] - peaks[peakCount - 3])) / 2;
-        s->printf("Cycle %d: max: %g, min: %g, avg separation: %g\n", peakCount, absMax, absMin, avgSeparation);
-        if (peakCount > 3 && avgSeparation < 0.05 * (absMax - absMin)) {
-            DEBUG_PRINTF("Stabilized\n");
-            finishUp();
-            return;
+    // oscillate the output base on the input's relation to the setpoint
+    if (output != 0 && refVal > target_temperature + noiseBand) {
+        setOutput(0);
+
+    } else if (output == 0 && refVal < target_temperature - noiseBand) {
+        setOutput(oStep);
+
+        // A cycle ends each time the heater turns back on, the warm up from room temperature is not one
+        if (lastOn != 0) {
+            amplitudes[cycleCount] = cycleMax - cycleMin;
+            periods[cycleCount] = (tickCnt - lastOn) / 1000.0F;
+            cycleCount++;
+            s->printf("Cycle %d: max: %g, min: %g, period: %1.1fs\n", cycleCount, cycleMax, cycleMin, periods[cycleCount - 1]);
+
+            if (cycleCount >= requested_cycles || converged()) {
+                finishUp();
+                return;
+            }
         }
+        lastOn = tickCnt;
+        cycleMax = refVal;
+        cycleMin = refVal;
     }
 
-    justchanged = false;
-
     if ((tickCnt % 1000) == 0) {
-        s->printf("%s: %5.1f/%5.1f @%d %d/%d\n", t->designator.c_str(), t->get_temperature(), target_temperature, output, peakCount, requested_cycles);
-        DEBUG_PRINTF("lookBackCnt= %d, peakCount= %d, absmax= %g, absmin= %g, peak1= %lu, peak2= %lu\n", lookBackCnt, peakCount, absMax, absMin, peak1, peak2);
+        s->printf("%s: %5.1f/%5.1f @%d %d/%d\n", t->designator.c_str(), refVal, target_temperature, output, cycleCount, requested_cycles);
+        DEBUG_PRINTF("cycleMax= %g, cycleMin= %g, lastOn= %lu\n", cycleMax, cycleMin, lastOn);
     }
 }
 
+// The oscillation has settled once the last cycles have the same amplitude and period
+bool PID_Autotuner::converged()
+{
+    if (cycleCount < CONVERGED_CYCLES)
+        return false;
+
+    float amin = amplitudes[cycleCount - 1], amax = amin, asum = 0;
+    float pmin = periods[cycleCount - 1], pmax = pmin, psum = 0;
+    for (int i = cycleCount - CONVERGED_CYCLES; i < cycleCount; i++) {
+        if (amplitudes[i] < amin) amin = amplitudes[i];
+        if (amplitudes[i] > amax) amax = amplitudes[i];
+        if (periods[i] < pmin) pmin = periods[i];
+        if (periods[i] > pmax) pmax = periods[i];
+        asum += amplitudes[i];
+        psum += periods[i];
+    }
+
+    DEBUG_PRINTF("amplitude spread= %g, period spread= %g\n", amax - amin, pmax - pmin);
+    return (amax - amin) <= CONVERGED_SPREAD * asum / CONVERGED_CYCLES && (pmax - pmin) <= CONVERGED_SPREAD * psum / CONVERGED_CYCLES;
+}
 
 void PID_Autotuner::finishUp()
 {
+    // Average the last cycles, the first ones still carry the overshoot from the warm up
+    int n = (cycleCount < CONVERGED_CYCLES) ? cycleCount : CONVERGED_CYCLES;
+    float amplitude = 0, Pu = 0;
+    for (int i = cycleCount - n; i < cycleCount; i++) {
+        amplitude += amplitudes[i];
+        Pu += periods[i];
+    }
+    amplitude /= n;
+    Pu /= n;
+
     //we can generate tuning parameters!
-    float Ku = 4*(2*oStep)/((absMax-absMin)*3.14159);
-    float Pu = (float)(peak1-peak2) / 1000;
-    s->printf("\tKu: %g, Pu: %g\n", Ku, Pu);
+    float Ku = 4*(2*oStep)/(amplitude*3.14159);
+    s->printf("\tKu: %g, Pu: %g, after %d cycles\n", Ku, Pu, cycleCount);
 
     float kp = 0.6 * Ku;
     float ki = 1.2 * Ku / Pu;
@@ -219,18 +242,68 @@ void PID_Autotuner::finishUp()
 
     s->printf("PID Autotune Complete! The settings above have been loaded into memory, but not written to your config file.\n");
 
-
     // and clean up
-    t->target_temperature = 0;
-    t->heater_pin.set(0);
-    t = NULL;
-    s = NULL;
+    stop();
+}
+
+// Heat once at full power up to the target, sampling the temperature every second
+void PID_Autotuner::step_tick(float refVal)
+{
+    if (tickCnt - sampleTime >= 1000) {
+        sampleTime = tickCnt;
+        if (rise.add(sampleTime / 1000.0F, refVal) && (tickCnt % 10000) < 1000)
+            s->printf("%s: %5.1f/%5.1f rising %1.2fC/s\n", t->designator.c_str(), refVal, target_temperature, rise.rise);
+    }
 
-    if (peaks != NULL)
-        delete[] peaks;
-    peaks = NULL;
+    if (refVal >= target_temperature) {
+        setOutput(0);
+        finishStep();
+    } else if (tickCnt > STEP_TIMEOUT) {
+        s->printf("Error: %s did not reach %5.1f, PID Autotune stopped\n", t->designator.c_str(), target_temperature);
+        stop();
+    }
+}
+
+// Fit a first order plus dead time model to the step response, and tune for it with the SIMC rules
+void PID_Autotuner::finishStep()
+{
+    float maxRise = rise.max_rise;
+    if (maxRise <= 0) {
+        s->printf("Error: %s did not rise, PID Autotune stopped\n", t->designator.c_str());
+        stop();
+        return;
+    }
+
+    // The tangent at the steepest rise crosses the ambient temperature after the dead time
+    float theta = rise.rise_time - (rise.rise_temperature - rise.ambient) / maxRise;
+    if (theta < 1) theta = 1;
+
+    // dT/dt = (K.u - (T - ambient)) / tau, so the rise falls by 1/tau per degree
+    float tau = INFINITY;
+    float decay = rise.decay();
+    if (decay < 0)
+        tau = -1 / decay;
+
+    // Closed loop time constant set to the dead time, K/tau is the steepest rise per unit of output
+    float tc = theta;
+    float kp = oStep / (maxRise * (tc + theta));
+    float ti = 4 * (tc + theta);
+    if (tau < ti) ti = tau;
+    float td = std::isfinite(tau) ? tau * theta / (2 * tau + theta) : theta / 2;
+    float ki = kp / ti;
+    float kd = kp * td;
+
+    if (std::isfinite(tau))
+        s->printf("\tDead time: %1.1fs, time constant: %1.0fs, gain: %1.2fC per unit of output\n", theta, tau, maxRise * tau / oStep);
+    else
+        s->printf("\tDead time: %1.1fs, time constant: too long to measure, a higher target measures it\n", theta);
+    s->printf("\tTrying:\n\tKp: %5.1f\n\tKi: %5.3f\n\tKd: %5.0f\n", kp, ki, kd);
+
+    t->setPIDp(kp);
+    t->setPIDi(ki);
+    t->setPIDd(kd);
+
+    s->printf("PID Autotune Complete! The settings above have been loaded into memory, but not written to your config file.\n");
 
-    if (lastInputs != NULL)
-        delete[] lastInputs;
-    lastInputs = NULL;
+    stop();
 }
@@ -8,15 +8,18 @@
 #include <stdint.h>
 
 #include "Module.h"
+#include "StepRise.h"
 
 class TemperatureControl;
 class StreamOutput;
 
+// Relay autotune : cycles the heater around the target until the cycles repeat, then uses their amplitude and period
+// Step autotune : heats once at full power to the target, and fits a first order plus dead time model to the rise
 class PID_Autotuner : public Module
 {
 public:
     PID_Autotuner();
-    void     begin(TemperatureControl *, float, StreamOutput *, int cycles = 8);
+    void     begin(TemperatureControl *, float, StreamOutput *, int cycles = 8, bool step = false);
     void     abort();
 
     void     on_module_loaded(void);
@@ -25,7 +28,13 @@ public:
     void     on_gcode_received(void *);
 
 private:
+    void relay_tick(float refVal);
+    void step_tick(float refVal);
+    bool converged();
     void finishUp();
+    void finishStep();
+    void setOutput(int);
+    void stop();
 
     TemperatureControl *t;
     float target_temperature;
@@ -33,21 +42,23 @@ private:
 
     volatile bool tick;
 
-    float *peaks;
+    bool step;
     int requested_cycles;
     float noiseBand;
-    unsigned long peak1, peak2;
-    int sampleTime;
-    int nLookBack;
-    int lookBackCnt;
-    int peakType;
-    float *lastInputs;
-    int peakCount;
-    bool justchanged;
-    float absMax, absMin;
-    float oStep;
+    int oStep;
     int output;
     unsigned long tickCnt;
+
+    // Relay cycles, each ends when the heater turns back on
+    float *amplitudes;
+    float *periods;
+    int cycleCount;
+    unsigned long lastOn;
+    float cycleMax, cycleMin;
+
+    // Step response, sampled every second
+    unsigned long sampleTime;
+    StepRise rise;
 };
 
 #endif /* _PID_AUTOTUNE_H */
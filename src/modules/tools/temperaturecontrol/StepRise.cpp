@@ -0,0 +1,73 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "StepRise.h"
+
+void StepRise::begin(float ambient)
+{
+    this->ambient = ambient;
+    rise = 0;
+    max_rise = 0;
+    rise_temperature = ambient;
+    rise_time = 0;
+    window_count = 0;
+    fit_count = 0;
+    fit_x = fit_y = fit_xx = fit_xy = 0;
+}
+
+// Add a sample, time in seconds since the heating started, about one a second
+// Returns true once the window is full, rise is then the slope over it
+bool StepRise::add(float time, float temperature)
+{
+    window_time[window_count % STEP_WINDOW] = time;
+    window_temperature[window_count % STEP_WINDOW] = temperature;
+    window_count++;
+    if (window_count < STEP_WINDOW)
+        return false;
+
+    float mean_time = 0, mean_temperature = 0;
+    for (int i = 0; i < STEP_WINDOW; i++) {
+        mean_time += window_time[i];
+        mean_temperature += window_temperature[i];
+    }
+    mean_time /= STEP_WINDOW;
+    mean_temperature /= STEP_WINDOW;
+    float sxx = 0, sxy = 0;
+    for (int i = 0; i < STEP_WINDOW; i++) {
+        sxx += (window_time[i] - mean_time) * (window_time[i] - mean_time);
+        sxy += (window_time[i] - mean_time) * (window_temperature[i] - mean_temperature);
+    }
+    if (sxx <= 0)
+        return false;
+    rise = sxy / sxx;
+    float mid = mean_temperature - ambient;
+
+    // Before the steepest rise the sensor lags, after it a first order rise slows down in a straight line with temperature
+    if (rise > max_rise) {
+        max_rise = rise;
+        rise_temperature = mean_temperature;
+        rise_time = mean_time;
+        fit_count = 0;
+        fit_x = fit_y = fit_xx = fit_xy = 0;
+    }
+    fit_count++;
+    fit_x += mid;
+    fit_y += rise;
+    fit_xx += mid * mid;
+    fit_xy += mid * rise;
+    return true;
+}
+
+// How much the rise falls per degree above ambient after the steepest rise, -1/tau for a first order model
+// 0 if there were not enough samples after it to tell
+float StepRise::decay()
+{
+    float denominator = fit_count * fit_xx - fit_x * fit_x;
+    if (fit_count < 3 || denominator <= 0)
+        return 0;
+    return (fit_count * fit_xy - fit_x * fit_y) / denominator;
+}
@@ -0,0 +1,36 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STEPRISE_H
+#define STEPRISE_H
+
+#define STEP_WINDOW 8           // Seconds of samples the rise of a heating step is fitted over
+
+// Finds the steepest rise of a heater heating at a fixed output from cold, for the step autotune and M306
+// The rise is the least squares slope over the last STEP_WINDOW samples, a bed rises too slowly for one second to tell it from noise
+class StepRise
+{
+public:
+    void  begin(float ambient);
+    bool  add(float time, float temperature);
+    float decay();
+
+    float ambient;
+    float rise;                 // Rise over the last window, in degrees per second
+    float max_rise;             // Steepest rise
+    float rise_temperature;     // Temperature and time in the middle of the window of the steepest rise
+    float rise_time;
+
+private:
+    float window_time[STEP_WINDOW];     // Last samples, round and round
+    float window_temperature[STEP_WINDOW];
+    int   window_count;
+    int   fit_count;            // Rise against temperature after the steepest rise, a straight line for a first order model
+    float fit_x, fit_y, fit_xx, fit_xy;
+};
+
+#endif
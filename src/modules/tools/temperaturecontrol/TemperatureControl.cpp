@@ -10,10 +10,11 @@
 #include "libs/Module.h"
 #include "libs/Kernel.h"
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "TemperatureControl.h"
 #include "TemperatureControlPool.h"
 #include "libs/Pin.h"
-#include "libs/Median.h"
 #include "modules/robot/Conveyor.h"
 #include "PublicDataRequest.h"
 #include "TemperatureControlPublicAccess.h"
@@ -27,6 +28,12 @@
 #include "ConfigValue.h"
 #include "TemperatureControl.h"
 #include "PID_Autotuner.h"
+#include "ThermalModelTuner.h"
+#include "PublicData.h"
+#include "SwitchPublicAccess.h"
+#include "ExtruderPublicAccess.h"
+#include "utils.h"
+#include "nuts_bolts.h"
 
 #include "MRI_Hooks.h"
 
@@ -45,6 +52,9 @@
 #define vcc_checksum                       CHECKSUM("vcc")
 #define r1_checksum                        CHECKSUM("r1")
 #define r2_checksum                        CHECKSUM("r2")
+#define coefficients_checksum              CHECKSUM("coefficients")
+#define thermistor_table_checksum          CHECKSUM("thermistor_table")
+#define oversample_checksum                CHECKSUM("oversample")
 #define thermistor_pin_checksum            CHECKSUM("thermistor_pin")
 #define heater_pin_checksum                CHECKSUM("heater_pin")
 
@@ -63,9 +73,19 @@
 #define preset1_checksum                   CHECKSUM("preset1")
 #define preset2_checksum                   CHECKSUM("preset2")
 
+#define model_heater_power_checksum        CHECKSUM("model_heater_power")
+#define model_heat_capacity_checksum       CHECKSUM("model_heat_capacity")
+#define model_ambient_loss_checksum        CHECKSUM("model_ambient_loss")
+#define model_fan_loss_checksum            CHECKSUM("model_fan_loss")
+#define model_flow_heat_checksum           CHECKSUM("model_flow_heat")
+#define model_sensor_response_checksum     CHECKSUM("model_sensor_response")
+#define model_ambient_checksum             CHECKSUM("model_ambient")
+#define model_fan_checksum                 CHECKSUM("model_fan")
+#define wait_tolerance_checksum            CHECKSUM("wait_tolerance")
+
 
 TemperatureControl::TemperatureControl(uint16_t name) :
-  name_checksum(name), waiting(false), min_temp_violated(false) {}
+  name_checksum(name), waiting(false), min_temp_violated(false), model_started(false), fan_speed(0), flow_rate(0), model_inputs_stale(false), tuning(false) {}
 
 void TemperatureControl::on_module_loaded(){
 
@@ -88,6 +108,9 @@ void TemperatureControl::on_module_loaded(){
 }
 
 void TemperatureControl::on_main_loop(void* argument){
+    if (this->model_inputs_stale)
+        this->update_model_inputs();
+
     if (this->min_temp_violated) {
         THEKERNEL->streams->printf("Error: MINTEMP triggered on P%d.%d! check your thermistors!\n", this->thermistor_pin.port_number, this->thermistor_pin.pin);
         this->min_temp_violated = false;
@@ -132,9 +155,27 @@ void TemperatureControl::on_config_reload(void* argument){
     this->preset2 =             THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, preset2_checksum)->by_default(0)->as_number();
 
 
-    // Thermistor math
-    j = (1.0 / beta);
-    k = (1.0 / (t0 + 273.15));
+    // Steinhart-Hart coefficients, as "a,b,c", replace the beta model if given
+    string coefficients = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, coefficients_checksum)->by_default("")->as_string();
+    const char* cp = coefficients.c_str();
+    char* cn;
+    this->sh_a = strtof(cp, &cn);
+    this->use_steinhart_hart = cn != cp && *cn == ',';
+    if( this->use_steinhart_hart ){
+        this->sh_b = strtof(cn + 1, &cn);
+        this->use_steinhart_hart = *cn == ',';
+        if( this->use_steinhart_hart ){ this->sh_c = strtof(cn + 1, &cn); }
+    }
+
+    // A resistance to temperature table on the SD card replaces both
+    this->table_log_r.clear();
+    this->table_inv_t.clear();
+    string table_file = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, thermistor_table_checksum)->by_default("")->as_string();
+    if( table_file.length() > 0 && !this->load_thermistor_table(table_file) ){
+        THEKERNEL->streams->printf("Error: could not read thermistor table %s, using the thermistor settings\n", table_file.c_str());
+    }
+
+    this->build_temperature_table();
 
     // sigma-delta output modulation
     this->o = 0;
@@ -143,6 +184,9 @@ void TemperatureControl::on_config_reload(void* argument){
     this->thermistor_pin.from_string(THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, thermistor_pin_checksum )->required()->as_string());
     THEKERNEL->adc->enable_pin(&thermistor_pin);
 
+    // Average the last conversions the ADC made instead of using only the last one
+    this->oversample = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, oversample_checksum)->by_default(true)->as_bool();
+
     // Heater pin
     this->heater_pin.from_string(    THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, heater_pin_checksum)->required()->as_string())->as_output();
     this->heater_pin.max_pwm(        THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, max_pwm_checksum)->by_default(255)->as_number() );
@@ -155,8 +199,8 @@ void TemperatureControl::on_config_reload(void* argument){
 
     set_low_on_debug(heater_pin.port_number, heater_pin.pin);
 
-    // activate SD-DAC timer
-    THEKERNEL->slow_ticker->attach( THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, pwm_frequency_checksum)->by_default(2000)->as_number() , &heater_pin, &Pwm::on_tick);
+    // activate SD-DAC timer, or the hardware PWM if the heater pin has one
+    this->heater_pin.start( THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, pwm_frequency_checksum)->by_default(2000)->as_number() );
 
     // reading tick
     THEKERNEL->slow_ticker->attach( this->readings_per_second, this, &TemperatureControl::thermistor_read_tick );
@@ -171,6 +215,21 @@ void TemperatureControl::on_config_reload(void* argument){
     this->iTerm = 0.0;
     this->lastInput= -1.0;
     this->last_reading = 0.0;
+
+    // Thermal model, see M306 to identify it
+    this->model_power     = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_heater_power_checksum   )->by_default(0    )->as_number();
+    this->model_capacity  = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_heat_capacity_checksum  )->by_default(20   )->as_number();
+    this->model_loss      = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_ambient_loss_checksum   )->by_default(0.1f )->as_number();
+    this->model_fan_loss  = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_fan_loss_checksum       )->by_default(0    )->as_number();
+    this->model_flow_heat = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_flow_heat_checksum      )->by_default(0    )->as_number();
+    this->model_response  = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_sensor_response_checksum)->by_default(0.2f )->as_number();
+    this->model_ambient   = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_ambient_checksum        )->by_default(25   )->as_number();
+    this->model_fan       = get_checksum(THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, model_fan_checksum)->by_default("fan")->as_string());
+    this->use_model       = this->model_power > 0.0F && this->model_capacity > 0.0F && !this->use_bangbang;
+    this->model_started   = false;
+    this->model_correction = 0.0F;
+
+    this->wait_tolerance  = THEKERNEL->config->value(temperature_control_checksum, this->name_checksum, wait_tolerance_checksum)->by_default(1.0f)->as_number();
 }
 
 void TemperatureControl::on_gcode_received(void* argument){
@@ -200,6 +259,7 @@ void TemperatureControl::on_gcode_received(void* argument){
             gcode->stream->printf("%s(S%d): Pf:%g If:%g Df:%g X(I_max):%g O:%d\n", this->designator.c_str(), this->pool_index, this->p_factor, this->i_factor/this->PIDdt, this->d_factor*this->PIDdt, this->i_max, o);
 
         } else if (gcode->m == 303) {
+            // M303 E<heater> S<target> C<max cycles> relay autotunes, stopping once the cycles repeat, F1 step autotunes in one rise instead
             if (gcode->has_letter('E') && (gcode->get_value('E') == this->pool_index)) {
                 gcode->mark_as_taken();
                 float target = 150.0;
@@ -212,11 +272,42 @@ void TemperatureControl::on_gcode_received(void* argument){
                     ncycles= gcode->get_value('C');
                 }
                 gcode->stream->printf("Start PID tune, command is %s\n", gcode->command.c_str());
-                this->pool->PIDtuner->begin(this, target, gcode->stream, ncycles);
+                bool step = gcode->has_letter('F') && gcode->get_value('F') != 0;
+                this->pool->PIDtuner->begin(this, target, gcode->stream, ncycles, step);
+            }
+
+        } else if (gcode->m == 306) {
+            // M306 S<heater> T<temperature> identifies the thermal model, with F1 the fan's effect too
+            // M306 S<heater> P<power W> C<capacity J/K> A<ambient loss W/K> R<sensor response 1/s> F<fan loss W/K> H<flow heat W/K per mm/s> sets it
+            gcode->mark_as_taken();
+            if (gcode->has_letter('S') && (gcode->get_value('S') == this->pool_index)) {
+                if (gcode->has_letter('T')) {
+                    float power = gcode->has_letter('P') ? gcode->get_value('P') : this->model_power;
+                    if (power <= 0.0F) {
+                        gcode->stream->printf("Error: %s heater power unknown, give it in W with P\n", this->designator.c_str());
+                        return;
+                    }
+                    this->pool->model_tuner->begin(this, gcode->get_value('T'), power, gcode->has_letter('F') && gcode->get_value('F') > 0, gcode->stream);
+                    return;
+                }
+                if (gcode->has_letter('P')) this->model_power     = gcode->get_value('P');
+                if (gcode->has_letter('C')) this->model_capacity  = gcode->get_value('C');
+                if (gcode->has_letter('A')) this->model_loss      = gcode->get_value('A');
+                if (gcode->has_letter('R')) this->model_response  = gcode->get_value('R');
+                if (gcode->has_letter('F')) this->model_fan_loss  = gcode->get_value('F');
+                if (gcode->has_letter('H')) this->model_flow_heat = gcode->get_value('H');
+                this->use_model = this->model_power > 0.0F && this->model_capacity > 0.0F && !this->use_bangbang;
+                this->model_started = false;
+                this->model_correction = 0.0F;
+                gcode->stream->printf("%s(S%d): %s P:%g C:%g A:%g R:%g F:%g H:%g\n", this->designator.c_str(), this->pool_index, this->use_model ? "model" : "PID",
+                                      this->model_power, this->model_capacity, this->model_loss, this->model_response, this->model_fan_loss, this->model_flow_heat);
             }
 
         } else if (gcode->m == 500 || gcode->m == 503){// M500 saves some volatile settings to config override file, M503 just prints the settings
             gcode->stream->printf(";PID settings:\nM301 S%d P%1.4f I%1.4f D%1.4f\n", this->pool_index, this->p_factor, this->i_factor/this->PIDdt, this->d_factor*this->PIDdt);
+            if (this->use_model)
+                gcode->stream->printf(";Thermal model:\nM306 S%d P%1.2f C%1.3f A%1.5f R%1.4f F%1.5f H%1.5f\n", this->pool_index,
+                                      this->model_power, this->model_capacity, this->model_loss, this->model_response, this->model_fan_loss, this->model_flow_heat);
             gcode->mark_as_taken();
 
         } else if( ( gcode->m == this->set_m_code || gcode->m == this->set_and_wait_m_code ) && gcode->has_letter('S') ) {
@@ -307,24 +398,113 @@ float TemperatureControl::get_temperature(){
     return last_reading;
 }
 
+// The ADC value is in 1/16 counts, interpolate between the two table entries around it, so no float math is done for each reading
 float TemperatureControl::adc_value_to_temperature(int adc_value)
 {
-    if ((adc_value == 4095) || (adc_value == 0))
+    const int shift = THERMISTOR_TABLE_SHIFT + ADC_OVERSAMPLE_SHIFT;
+    if ((adc_value >= (4095 << ADC_OVERSAMPLE_SHIFT)) || (adc_value <= 0))
         return INFINITY;
-    float r = r2 / ((4095.0 / adc_value) - 1.0);
-    if (r1 > 0)
-        r = (r1 * r) / (r1 - r);
-    return (1.0 / (k + (j * log(r / r0)))) - 273.15;
+    int i = adc_value >> shift;
+    int frac = adc_value & ((1 << shift) - 1);
+    int t = this->temperature_table[i] + (((this->temperature_table[i + 1] - this->temperature_table[i]) * frac) >> shift);
+    return t * (1.0F / THERMISTOR_TABLE_SCALE);
+}
+
+// Compute the temperature every 1 << THERMISTOR_TABLE_SHIFT ADC counts
+void TemperatureControl::build_temperature_table()
+{
+    for (int i = 0; i < THERMISTOR_TABLE_SIZE; i++) {
+        // The ends of the range can't be computed, they are read as errors anyway
+        int adc_value = i << THERMISTOR_TABLE_SHIFT;
+        if (adc_value < 1) adc_value = 1;
+        if (adc_value > 4094) adc_value = 4094;
+
+        float r = r2 / ((4095.0F / adc_value) - 1.0F);
+        if (r1 > 0)
+            r = (r1 * r) / (r1 - r);
+
+        float t = (r > 0.0F) ? resistance_to_temperature(r) : -273.15F;
+        if (!(t < 2000.0F)) t = 2000.0F; // also catches NaN
+        if (t < -273.15F) t = -273.15F;
+        this->temperature_table[i] = lroundf(t * THERMISTOR_TABLE_SCALE);
+    }
+}
+
+float TemperatureControl::resistance_to_temperature(float r)
+{
+    float lr = logf(r);
+
+    if (this->table_log_r.size() >= 2) {
+        // 1/T is close to linear in ln(R) between two points of the table, extrapolate from the end segments
+        unsigned int i = 1;
+        while (i < this->table_log_r.size() - 1 && (lr - this->table_log_r[i]) * (this->table_log_r[i] - this->table_log_r[0]) > 0)
+            i++;
+        float f = (lr - this->table_log_r[i - 1]) / (this->table_log_r[i] - this->table_log_r[i - 1]);
+        return 1.0F / (this->table_inv_t[i - 1] + f * (this->table_inv_t[i] - this->table_inv_t[i - 1])) - 273.15F;
+    }
+
+    if (this->use_steinhart_hart)
+        return 1.0F / (this->sh_a + this->sh_b * lr + this->sh_c * lr * lr * lr) - 273.15F;
+
+    return 1.0F / ((1.0F / (t0 + 273.15F)) + (logf(r / r0) / beta)) - 273.15F;
+}
+
+// Read "resistance temperature" lines, in either order of temperatures, lines starting with # are ignored
+bool TemperatureControl::load_thermistor_table(string filename)
+{
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL) return false;
+
+    char line[64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#') continue;
+        char* cn;
+        float r = strtof(line, &cn);
+        if (cn == line) continue;
+        char* tp = cn;
+        float t = strtof(tp, &cn);
+        if (cn == tp || r <= 0.0F) continue;
+        this->table_log_r.push_back(logf(r));
+        this->table_inv_t.push_back(1.0F / (t + 273.15F));
+    }
+    fclose(file);
+
+    if (this->table_log_r.size() < 2) {
+        this->table_log_r.clear();
+        this->table_inv_t.clear();
+        return false;
+    }
+    return true;
 }
 
 uint32_t TemperatureControl::thermistor_read_tick(uint32_t dummy){
     int r = new_thermistor_reading();
 
     float temperature = adc_value_to_temperature(r);
+    bool reading_ok = (r > (1 << ADC_OVERSAMPLE_SHIFT)) && (r < (4094 << ADC_OVERSAMPLE_SHIFT));
+
+    // The model follows the heater even when it is off, so it is right when it is turned on
+    if (this->use_model) {
+        if (reading_ok)
+            model_update(temperature);
+        else
+            this->model_started = false;
+        this->model_inputs_stale = true;
+    }
 
-    if (target_temperature > 0)
+    if (this->tuning)
     {
-        if ((r <= 1) || (r >= 4094))
+        // An autotuner drives the heater, only stop it if the thermistor fails
+        if (!reading_ok)
+        {
+            this->min_temp_violated = true;
+            this->tuning = false;
+            heater_pin.set((this->o=0));
+        }
+    }
+    else if (target_temperature > 0)
+    {
+        if (!reading_ok)
         {
             this->min_temp_violated = true;
             target_temperature = UNDEFINED;
@@ -332,8 +512,14 @@ uint32_t TemperatureControl::thermistor_read_tick(uint32_t dummy){
         }
         else
         {
-            pid_process(temperature);
-            if ((temperature > target_temperature) && waiting)
+            if (this->use_model)
+                model_process(temperature);
+            else
+                pid_process(temperature);
+
+            // Without overshoot the model may take long to cross the target, so its waits end once close enough
+            bool reached = this->use_model ? (temperature >= target_temperature - this->wait_tolerance) : (temperature > target_temperature);
+            if (reached && waiting)
             {
                 THEKERNEL->pauser->release();
                 waiting = false;
@@ -348,6 +534,78 @@ uint32_t TemperatureControl::thermistor_read_tick(uint32_t dummy){
     return 0;
 }
 
+// Advance the model by one reading with the output applied since the last one, then move it onto the reading
+void TemperatureControl::model_update(float temperature)
+{
+    if (!this->model_started) {
+        this->block_temperature = this->sensor_temperature = temperature;
+        this->model_started = true;
+        return;
+    }
+
+    float loss = this->model_loss + (this->model_fan_loss * this->fan_speed) + (this->model_flow_heat * this->flow_rate);
+    float power = this->model_power * this->o / 255.0F;
+    this->block_temperature += (power - loss * (this->block_temperature - this->model_ambient)) * this->PIDdt / this->model_capacity;
+
+    float follow = this->model_response * this->PIDdt;
+    if (follow > 1.0F) follow = 1.0F;
+    this->sensor_temperature += (this->block_temperature - this->sensor_temperature) * follow;
+
+    // What the model missed is in the block too, the sensor only shows it late
+    float error = temperature - this->sensor_temperature;
+    this->block_temperature += error;
+    this->sensor_temperature += error;
+}
+
+// Output the power that holds the target against the losses, plus what brings the block to the target within the sensor's lag
+// The block leads the sensor, so heating stops before the sensor sees the target and it does not overshoot
+void TemperatureControl::model_process(float temperature)
+{
+    float loss = this->model_loss + (this->model_fan_loss * this->fan_speed) + (this->model_flow_heat * this->flow_rate);
+    float lag = (this->model_response > 0.0F) ? 1.0F / this->model_response : 1.0F;
+    float power = (loss * (this->target_temperature - this->model_ambient)) + (this->model_capacity * (this->target_temperature - this->block_temperature) / lag);
+
+    // What the model gets wrong would leave the temperature off the target, so the remaining error is integrated too
+    // Over MODEL_INTEGRAL_LAGS lags, at the proportional gain above, bounded and held while far off or saturated
+    float error = this->target_temperature - temperature;
+    bool hold = (fabsf(error) > MODEL_INTEGRAL_BAND) ||
+                (error > 0.0F && power + this->model_correction >= this->model_power * heater_pin.max_pwm() / 255.0F) ||
+                (error < 0.0F && power + this->model_correction <= 0.0F);
+    if (!hold) {
+        this->model_correction += (loss + this->model_capacity / lag) * error * this->PIDdt / (MODEL_INTEGRAL_LAGS * lag);
+        this->model_correction = confine(this->model_correction, -MODEL_MAX_CORRECTION * this->model_power, MODEL_MAX_CORRECTION * this->model_power);
+    }
+    power += this->model_correction;
+
+    this->o = power * 255.0F / this->model_power;
+    if (this->o >= heater_pin.max_pwm())
+        this->o = heater_pin.max_pwm();
+    else if (this->o < 0)
+        this->o = 0;
+
+    this->heater_pin.pwm(this->o);
+}
+
+// Fan speed and extrusion rate for the model, asked to the switch and extruder modules outside of the interrupt
+void TemperatureControl::update_model_inputs()
+{
+    this->model_inputs_stale = false;
+    void* returned_data;
+
+    float fan = 0.0F;
+    if (this->model_fan_loss > 0.0F && THEKERNEL->public_data->get_value(switch_checksum, this->model_fan, &returned_data)) {
+        struct pad_switch* pad = static_cast<struct pad_switch*>(returned_data);
+        if (pad->state) fan = confine(pad->value / 255.0F, 0.0F, 1.0F);
+    }
+    this->fan_speed = fan;
+
+    float flow = 0.0F;
+    if (this->model_flow_heat > 0.0F && THEKERNEL->public_data->get_value(extruder_checksum, this->name_checksum, flow_rate_checksum, &returned_data)) {
+        flow = *static_cast<float*>(returned_data);
+    }
+    this->flow_rate = flow;
+}
+
 /**
  * Based on https://github.com/br3ttb/Arduino-PID-Library
  */
@@ -396,19 +654,17 @@ void TemperatureControl::pid_process(float temperature)
     this->lastInput= temperature;
 }
 
+// Returns the filtered reading, in 1/16 ADC counts
 int TemperatureControl::new_thermistor_reading()
 {
-    int last_raw = THEKERNEL->adc->read(&thermistor_pin);
-    if (queue.size() >= queue.capacity()) {
-        uint16_t l;
-        queue.pop_front(l);
-    }
-    uint16_t r = last_raw;
-    queue.push_back(r);
-    for (int i=0; i<queue.size(); i++)
-      median_buffer[i] = *queue.get_ref(i);
-    uint16_t m = median_buffer[quick_median(median_buffer, queue.size())];
-    return m;
+    uint16_t r;
+    if (this->oversample)
+        r = THEKERNEL->adc->read_average(&thermistor_pin);
+    else
+        r = THEKERNEL->adc->read(&thermistor_pin) << ADC_OVERSAMPLE_SHIFT;
+    readings.push(r);
+    // The middle half of the readings, spikes are dropped like with a median but the result keeps more resolution
+    return readings.trimmed_mean(QUEUE_LEN / 4);
 }
 
 void TemperatureControl::on_second_tick(void* argument)
@@ -12,10 +12,24 @@
 #include "Pwm.h"
 #include <math.h>
 
-#include "RingBuffer.h"
+#include "Median.h"
+
+#include <vector>
+#include <string>
+using std::string;
+using std::vector;
 
 #define QUEUE_LEN 8
 
+// ADC readings are converted to temperatures with a table built when the config is loaded
+#define THERMISTOR_TABLE_SHIFT 4                                        // An entry every 16 ADC counts, interpolated in between
+#define THERMISTOR_TABLE_SIZE  ((4096 >> THERMISTOR_TABLE_SHIFT) + 1)
+#define THERMISTOR_TABLE_SCALE 16                                       // Temperatures are stored in 1/16 degree C
+
+#define MODEL_INTEGRAL_LAGS    10.0F                                    // The model's error is integrated over this many sensor lags
+#define MODEL_INTEGRAL_BAND    5.0F                                     // Only this close to the target, in degree C, so heating up does not wind it up
+#define MODEL_MAX_CORRECTION   0.3F                                     // Largest integral correction, as a fraction of the heater power
+
 class TemperatureControlPool;
 
 class TemperatureControl : public Module {
@@ -42,9 +56,16 @@ class TemperatureControl : public Module {
         int pool_index;
         TemperatureControlPool *pool;
         friend class PID_Autotuner;
+        friend class ThermalModelTuner;
 
     private:
         void pid_process(float);
+        void model_update(float temperature);
+        void model_process(float temperature);
+        void update_model_inputs();
+        void build_temperature_table();
+        float resistance_to_temperature(float r);
+        bool load_thermistor_table(string filename);
 
         float target_temperature;
 
@@ -57,8 +78,14 @@ class TemperatureControl : public Module {
         int r1;
         int r2;
         float beta;
-        float j;
-        float k;
+        float sh_a, sh_b, sh_c;         // Steinhart-Hart coefficients, used instead of beta if set
+        bool use_steinhart_hart;
+
+        // Resistance to temperature points read from a user table on the SD card, as ln(R) and 1/T in kelvins
+        vector<float> table_log_r;
+        vector<float> table_inv_t;
+
+        int16_t temperature_table[THERMISTOR_TABLE_SIZE];
 
 
         // PID runtime
@@ -71,9 +98,8 @@ class TemperatureControl : public Module {
         float acceleration_factor;
         float readings_per_second;
 
-        RingBuffer<uint16_t,QUEUE_LEN> queue;  // Queue of readings
-        uint16_t median_buffer[QUEUE_LEN];
-        int running_total;
+        RunningMedian<uint16_t,QUEUE_LEN> readings;  // Last readings, in 1/16 ADC counts
+        bool oversample;
 
         uint16_t name_checksum;
 
@@ -103,6 +129,28 @@ class TemperatureControl : public Module {
         float i_factor;
         float d_factor;
         float PIDdt;
+
+        // Thermal model, used instead of PID once the heater power is known
+        // The heater block gains power * output and loses ( losses ) * ( block - ambient ), the sensor follows the block with a lag
+        bool  use_model;
+        float model_power;              // Heater power at full output, in W
+        float model_capacity;           // Heat capacity of the heater block, in J/K
+        float model_loss;               // Loss to the ambient air, in W/K
+        float model_fan_loss;           // Extra loss with the part cooling fan at full speed, in W/K
+        float model_flow_heat;          // Heat taken by the filament per mm/s extruded, in W/K
+        float model_response;           // How fast the sensor follows the heater block, in 1/s
+        float model_ambient;
+        uint16_t model_fan;             // Switch module of the part cooling fan
+        bool  model_started;
+        float block_temperature;        // Modeled temperatures, corrected by every reading
+        float sensor_temperature;
+        float model_correction;         // Integral of the error, in W, for what the model gets wrong
+        volatile float fan_speed;       // Read from the fan switch and extruder in the main loop, for the reading tick
+        volatile float flow_rate;
+        volatile bool  model_inputs_stale;
+
+        float wait_tolerance;           // With the model, M109 and the like stop waiting once the temperature is this close to the target
+        volatile bool tuning;           // An autotuner drives the heater, readings don't
 };
 
 #endif
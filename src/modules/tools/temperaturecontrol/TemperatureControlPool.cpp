@@ -13,6 +13,7 @@ using namespace std;
 #include "TemperatureControlPool.h"
 #include "TemperatureControl.h"
 #include "PID_Autotuner.h"
+#include "ThermalModelTuner.h"
 #include "Config.h"
 #include "checksumm.h"
 #include "ConfigValue.h"
@@ -36,6 +37,7 @@ void TemperatureControlPool::on_module_loaded(){
     }
 
     THEKERNEL->add_module( this->PIDtuner = new PID_Autotuner() );
+    THEKERNEL->add_module( this->model_tuner = new ThermalModelTuner() );
 }
 
 
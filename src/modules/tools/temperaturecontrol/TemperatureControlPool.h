@@ -14,6 +14,7 @@ using namespace std;
 
 class TemperatureControl;
 class PID_Autotuner;
+class ThermalModelTuner;
 
 #define temperature_control_checksum CHECKSUM("temperature_control")
 #define enable_checksum              CHECKSUM("enable")
@@ -26,6 +27,7 @@ class TemperatureControlPool : public Module {
 
         vector<TemperatureControl*> controllers;
         PID_Autotuner* PIDtuner;
+        ThermalModelTuner* model_tuner;
 };
 
 
@@ -0,0 +1,240 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ThermalModelTuner.h"
+#include "Kernel.h"
+#include "SlowTicker.h"
+#include "Gcode.h"
+#include "StreamOutput.h"
+#include "PublicData.h"
+#include "checksumm.h"
+#include "SwitchPublicAccess.h"
+#include "TemperatureControl.h"
+
+#include <math.h>
+
+#define TICKS_PER_SECOND   20
+#define HEAT_TIMEOUT       (20 * 60 * TICKS_PER_SECOND)   // Beds can take that long
+#define HOLD_SETTLE        (30 * TICKS_PER_SECOND)        // Time to settle on the target before the output is averaged
+#define HOLD_MEASURE       (120 * TICKS_PER_SECOND)       // Time the output is averaged over, many bang-bang cycles
+
+ThermalModelTuner::ThermalModelTuner()
+{
+    t = NULL;
+    s = NULL;
+    tick = false;
+}
+
+void ThermalModelTuner::on_module_loaded()
+{
+    tick = false;
+    THEKERNEL->slow_ticker->attach(TICKS_PER_SECOND, this, &ThermalModelTuner::on_tick);
+    register_for_event(ON_IDLE);
+    register_for_event(ON_GCODE_RECEIVED);
+}
+
+void ThermalModelTuner::begin(TemperatureControl *temp, float target, float power, bool with_fan, StreamOutput *stream)
+{
+    if (t != NULL)
+        abort();
+
+    t = temp;
+    s = stream;
+    this->target = target;
+    this->power = power;
+    this->with_fan = with_fan;
+
+    // The heater should start cold, the rise from the ambient temperature is what is measured
+    ambient = t->get_temperature();
+    if (!isfinite(ambient) || ambient > target - 20) {
+        s->printf("Error: %s must be at least 20C below the target to identify its model\n", t->designator.c_str());
+        t = NULL;
+        s = NULL;
+        return;
+    }
+
+    t->target_temperature = 0;
+    t->tuning = true;
+
+    phase = HEATING;
+    ticks = 0;
+    rise.begin(ambient);
+    heat(t->heater_pin.max_pwm());
+
+    s->printf("%s: Identifying thermal model at %5.1f, M304 aborts\n", t->designator.c_str(), target);
+}
+
+void ThermalModelTuner::abort()
+{
+    if (!t)
+        return;
+
+    if (s)
+        s->printf("Thermal model identification aborted\n");
+    stop();
+}
+
+void ThermalModelTuner::stop()
+{
+    if (phase == HOLDING_FAN)
+        set_fan(false);
+    t->tuning = false;
+    t->target_temperature = 0;
+    t->heater_pin.set((t->o = 0));
+    t = NULL;
+    s = NULL;
+}
+
+void ThermalModelTuner::on_gcode_received(void *argument)
+{
+    Gcode *gcode = static_cast<Gcode *>(argument);
+
+    if ((gcode->has_m) && (gcode->m == 304))
+        abort();
+}
+
+uint32_t ThermalModelTuner::on_tick(uint32_t dummy)
+{
+    if (t)
+        tick = true;
+    return 0;
+}
+
+void ThermalModelTuner::heat(int output)
+{
+    t->o = output;
+    t->heater_pin.pwm(output);
+}
+
+// Bang-bang on the target, averaging the output once it has settled
+void ThermalModelTuner::hold(float temperature)
+{
+    int output = (temperature < target) ? t->heater_pin.max_pwm() : 0;
+    heat(output);
+    if (ticks > HOLD_SETTLE) {
+        output_sum += output / 255.0F;
+        output_count++;
+    }
+}
+
+// Turn the part cooling fan full on, or back to how it was
+bool ThermalModelTuner::set_fan(bool on)
+{
+    static struct pad_switch previous;
+    void *returned_data;
+    if (on) {
+        if (!THEKERNEL->public_data->get_value(switch_checksum, t->model_fan, &returned_data))
+            return false;
+        previous = *static_cast<struct pad_switch *>(returned_data);
+        float value = 255;
+        bool state = true;
+        THEKERNEL->public_data->set_value(switch_checksum, t->model_fan, value_checksum, &value);
+        THEKERNEL->public_data->set_value(switch_checksum, t->model_fan, state_checksum, &state);
+    } else {
+        THEKERNEL->public_data->set_value(switch_checksum, t->model_fan, value_checksum, &previous.value);
+        THEKERNEL->public_data->set_value(switch_checksum, t->model_fan, state_checksum, &previous.state);
+    }
+    return true;
+}
+
+void ThermalModelTuner::on_idle(void *)
+{
+    if (!tick)
+        return;
+
+    tick = false;
+
+    if (t == NULL)
+        return;
+
+    // The temperature control stops tuning if the thermistor fails
+    float temperature = t->get_temperature();
+    if (!t->tuning || !isfinite(temperature) || temperature > target + 30) {
+        s->printf("Error: %s reading lost or too high, thermal model identification stopped\n", t->designator.c_str());
+        stop();
+        return;
+    }
+
+    ticks++;
+
+    if (phase == HEATING) {
+        // Sample every second, the steepest rise is where the sensor lag has passed and the losses are still low
+        if ((ticks % TICKS_PER_SECOND) == 0) {
+            if (rise.add(ticks / (float)TICKS_PER_SECOND, temperature) && (ticks % (10 * TICKS_PER_SECOND)) == 0)
+                s->printf("%s: %5.1f/%5.1f rising %1.2fC/s\n", t->designator.c_str(), temperature, target, rise.rise);
+        }
+
+        if (temperature >= target) {
+            phase = HOLDING;
+            ticks = 0;
+            output_sum = 0;
+            output_count = 0;
+            s->printf("%s: holding %5.1f\n", t->designator.c_str(), target);
+        } else if (ticks > HEAT_TIMEOUT) {
+            s->printf("Error: %s did not reach %5.1f, thermal model identification stopped\n", t->designator.c_str(), target);
+            stop();
+        }
+        return;
+    }
+
+    hold(temperature);
+    if (ticks < HOLD_SETTLE + HOLD_MEASURE)
+        return;
+
+    if (phase == HOLDING) {
+        hold_output = output_sum / output_count;
+        if (with_fan && set_fan(true)) {
+            phase = HOLDING_FAN;
+            ticks = 0;
+            output_sum = 0;
+            output_count = 0;
+            s->printf("%s: holding %5.1f with the fan on\n", t->designator.c_str(), target);
+            return;
+        }
+    }
+
+    finish();
+}
+
+void ThermalModelTuner::finish()
+{
+    float span = target - ambient;
+    float loss = power * hold_output / span;
+    float fan_loss = 0;
+    if (phase == HOLDING_FAN)
+        fan_loss = power * (output_sum / output_count - hold_output) / span;
+
+    // At the steepest rise the heater gives full power, less what is already lost
+    float full = t->heater_pin.max_pwm() / 255.0F;
+    float capacity = (power * full - loss * (rise.rise_temperature - ambient)) / rise.max_rise;
+
+    // The tangent at the steepest rise crosses the ambient temperature once the sensor has caught up
+    float lag = rise.rise_time - (rise.rise_temperature - ambient) / rise.max_rise;
+    float response = (lag > 0.5F) ? 1.0F / lag : 2.0F;
+
+    if (rise.max_rise <= 0 || capacity <= 0 || loss <= 0) {
+        s->printf("Error: %s thermal model could not be identified\n", t->designator.c_str());
+        stop();
+        return;
+    }
+
+    t->model_power = power;
+    t->model_capacity = capacity;
+    t->model_loss = loss;
+    t->model_response = response;
+    t->model_ambient = ambient;
+    if (phase == HOLDING_FAN)
+        t->model_fan_loss = (fan_loss > 0) ? fan_loss : 0;
+    t->use_model = !t->use_bangbang;
+    t->model_started = false;
+
+    s->printf("\tHeat capacity: %1.2fJ/K, ambient loss: %1.4fW/K, sensor lag: %1.1fs, fan loss: %1.4fW/K\n", capacity, loss, 1.0F / response, t->model_fan_loss);
+    s->printf("\tM306 S%d P%1.2f C%1.3f A%1.5f R%1.4f F%1.5f\n", t->pool_index, power, capacity, loss, response, t->model_fan_loss);
+    s->printf("Thermal model identified! It has been loaded into memory, M500 saves it.\n");
+
+    stop();
+}
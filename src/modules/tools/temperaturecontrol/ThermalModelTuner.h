@@ -0,0 +1,60 @@
+/*
+      This file is part of Smoothie (http://smoothieware.org/). The motion control part is heavily based on Grbl (https://github.com/simen/grbl).
+      Smoothie is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+      Smoothie is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+      You should have received a copy of the GNU General Public License along with Smoothie. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THERMALMODELTUNER_H
+#define THERMALMODELTUNER_H
+
+#include <stdint.h>
+
+#include "Module.h"
+#include "StepRise.h"
+
+class TemperatureControl;
+class StreamOutput;
+
+// Identifies a heater's thermal model for TemperatureControl
+// Heats at full power from cold to find the heat capacity and the sensor lag from the steepest rise,
+// then holds the target to find the loss to ambient from the average power, and with the fan on if asked
+class ThermalModelTuner : public Module
+{
+public:
+    ThermalModelTuner();
+    void     begin(TemperatureControl *, float target, float power, bool with_fan, StreamOutput *);
+    void     abort();
+
+    void     on_module_loaded(void);
+    uint32_t on_tick(uint32_t);
+    void     on_idle(void *);
+    void     on_gcode_received(void *);
+
+private:
+    void     heat(int output);
+    void     hold(float temperature);
+    bool     set_fan(bool on);
+    void     finish();
+    void     stop();
+
+    TemperatureControl *t;
+    StreamOutput *s;
+    float target;
+    float power;                // Heater power in W, given by the user
+    bool  with_fan;
+
+    volatile bool tick;
+    uint32_t ticks;             // 20 per second since the phase started
+
+    enum { HEATING, HOLDING, HOLDING_FAN } phase;
+
+    float ambient;
+    StepRise rise;              // Steepest rise at full power, fitted over a window of samples
+
+    float output_sum;           // Average output while holding the target, once settled
+    uint32_t output_count;
+    float hold_output;          // Average output holding without the fan
+};
+
+#endif
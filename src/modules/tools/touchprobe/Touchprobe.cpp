@@ -7,14 +7,25 @@
 
 #include "Touchprobe.h"
 
+#include "libs/Kernel.h"
+#include "libs/StepperMotor.h"
+#include "libs/PinInterrupt.h"
+#include "modules/communication/utils/Gcode.h"
+#include "modules/robot/Conveyor.h"
+#include "modules/robot/Planner.h"
+#include "modules/robot/Robot.h"
+#include "modules/robot/Stepper.h"
+#include "modules/robot/BedMesh.h"
 #include "BaseSolution.h"
+#include "Config.h"
+#include "ConfigValue.h"
+#include "checksumm.h"
+#include "StreamOutput.h"
+#include "StreamOutputPool.h"
 
-#define touchprobe_enable_checksum           CHECKSUM("touchprobe_enable")
-#define touchprobe_log_enable_checksum       CHECKSUM("touchprobe_log_enable")
-#define touchprobe_logfile_name_checksum     CHECKSUM("touchprobe_logfile_name")
-#define touchprobe_log_rotate_mcode_checksum CHECKSUM("touchprobe_log_rotate_mcode")
-#define touchprobe_pin_checksum              CHECKSUM("touchprobe_pin")
-#define touchprobe_debounce_count_checksum   CHECKSUM("touchprobe_debounce_count")
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 
 #define touchprobe_enable_checksum           CHECKSUM("touchprobe_enable")
 #define touchprobe_log_enable_checksum       CHECKSUM("touchprobe_log_enable")
@@ -22,6 +33,14 @@
 #define touchprobe_log_rotate_mcode_checksum CHECKSUM("touchprobe_log_rotate_mcode")
 #define touchprobe_pin_checksum              CHECKSUM("touchprobe_pin")
 #define touchprobe_debounce_count_checksum   CHECKSUM("touchprobe_debounce_count")
+#define touchprobe_debounce_us_checksum      CHECKSUM("touchprobe_debounce_us")
+#define touchprobe_mesh_min_x_checksum       CHECKSUM("touchprobe_mesh_min_x")
+#define touchprobe_mesh_min_y_checksum       CHECKSUM("touchprobe_mesh_min_y")
+#define touchprobe_mesh_max_x_checksum       CHECKSUM("touchprobe_mesh_max_x")
+#define touchprobe_mesh_max_y_checksum       CHECKSUM("touchprobe_mesh_max_y")
+#define touchprobe_mesh_points_checksum      CHECKSUM("touchprobe_mesh_points")
+#define touchprobe_mesh_height_checksum      CHECKSUM("touchprobe_mesh_height")
+#define touchprobe_mesh_depth_checksum       CHECKSUM("touchprobe_mesh_depth")
 
 
 void Touchprobe::on_module_loaded() {
@@ -33,76 +52,257 @@ void Touchprobe::on_module_loaded() {
         return;
     }
     this->probe_rate = 5;
+    this->touched = false;
+    this->log_count = 0;
+    this->interrupt = new PinInterrupt();
     // load settings
     this->on_config_reload(this);
     // register event-handlers
     register_for_event(ON_CONFIG_RELOAD);
     register_for_event(ON_GCODE_RECEIVED);
-    register_for_event(ON_IDLE);
 }
 
 void Touchprobe::on_config_reload(void* argument){
     this->pin.from_string(  THEKERNEL->config->value(touchprobe_pin_checksum)->by_default("nc" )->as_string())->as_input();
     this->debounce_count =  THEKERNEL->config->value(touchprobe_debounce_count_checksum)->by_default(100  )->as_number();
+    this->interrupt->attach(&this->pin, 0, this, &Touchprobe::on_touch);
+    this->interrupt->set_debounce_us( THEKERNEL->config->value(touchprobe_debounce_us_checksum)->by_default(10)->as_number() );
 
     this->steppers[0] = THEKERNEL->robot->alpha_stepper_motor;
     this->steppers[1] = THEKERNEL->robot->beta_stepper_motor;
     this->steppers[2] = THEKERNEL->robot->gamma_stepper_motor;
 
+    this->mesh_min[X_AXIS] = THEKERNEL->config->value(touchprobe_mesh_min_x_checksum )->by_default(  0.0F)->as_number();
+    this->mesh_min[Y_AXIS] = THEKERNEL->config->value(touchprobe_mesh_min_y_checksum )->by_default(  0.0F)->as_number();
+    this->mesh_max[X_AXIS] = THEKERNEL->config->value(touchprobe_mesh_max_x_checksum )->by_default(100.0F)->as_number();
+    this->mesh_max[Y_AXIS] = THEKERNEL->config->value(touchprobe_mesh_max_y_checksum )->by_default(100.0F)->as_number();
+    this->mesh_points      = THEKERNEL->config->value(touchprobe_mesh_points_checksum)->by_default(3     )->as_number();
+    this->mesh_height      = THEKERNEL->config->value(touchprobe_mesh_height_checksum)->by_default(5.0F  )->as_number();
+    this->mesh_depth       = THEKERNEL->config->value(touchprobe_mesh_depth_checksum )->by_default(10.0F )->as_number();
+
     this->should_log = this->enabled = THEKERNEL->config->value( touchprobe_log_enable_checksum )->by_default(false)->as_bool();
     if( this->should_log){
-        this->filename = THEKERNEL->config->value(touchprobe_logfile_name_checksum)->by_default("/sd/probe_log.csv")->as_string();
+        this->filename = THEKERNEL->config->value(touchprobe_logfile_name_checksum)->by_default("/sd/probe_log.bin")->as_string();
         this->mcode = THEKERNEL->config->value(touchprobe_log_rotate_mcode_checksum)->by_default(0)->as_int();
-        this->logfile = NULL;
     }
 }
 
-void Touchprobe::wait_for_touch(int distance[]){
-    unsigned int debounce = 0;
-    while(true){
-        THEKERNEL->call_event(ON_IDLE);
-        // if no stepper is moving, moves are finished and there was no touch
-        if( ((this->steppers[0]->moving ? 0:1 ) + (this->steppers[1]->moving ? 0:1 ) + (this->steppers[2]->moving ? 0:1 )) == 3 ){
-            return;
+// Called from the pin interrupt when the probe touches, notes where the steppers are and has the probe move decelerate
+uint32_t Touchprobe::on_touch(uint32_t dummy){
+    for( int i=0; i<3; i++ ){
+        this->touch_steps[i] = this->steppers[i]->stepped;
+    }
+    this->touched = true;
+    THEKERNEL->stepper->decelerate_to_stop();
+    return 0;
+}
+
+// Move from where the Robot is to target at the probe rate, stopping when the probe touches
+// Each planned block is straight in actuator space, so on deltas a move across XY is cut into short segments, each waited for
+// Returns true if the probe touched, touch is then where, and the Robot's position is where the move stopped
+bool Touchprobe::probe_move(float target[], float touch[]){
+    Robot* robot = THEKERNEL->robot;
+
+    // The probe move starts from where everything planned so far ends
+    robot->flush_moves();
+    THEKERNEL->conveyor->wait_for_empty_queue();
+
+    float pos[3];
+    robot->get_axis_position(pos);
+    float millimeters = 0.0F;
+    for( int c = X_AXIS; c <= Z_AXIS; c++ ){
+        millimeters += ( target[c] - pos[c] ) * ( target[c] - pos[c] );
+    }
+    millimeters = sqrtf(millimeters);
+    if( millimeters < 0.0001F ){ return false; }
+
+    // Already touching, there is nowhere to go
+    if( this->pin.get() ){
+        memcpy(touch, pos, sizeof(pos));
+        return true;
+    }
+
+    int segments = 1;
+    if( robot->arm_solution_kind == ARM_SOLUTION_OTHER ){
+        float xy = sqrtf( ( target[X_AXIS] - pos[X_AXIS] ) * ( target[X_AXIS] - pos[X_AXIS] ) + ( target[Y_AXIS] - pos[Y_AXIS] ) * ( target[Y_AXIS] - pos[Y_AXIS] ) );
+        segments = max(1, (int)ceilf(xy / TOUCHPROBE_SEGMENT_MM));
+    }
+
+    float unit_vec[3];
+    for( int c = X_AXIS; c <= Z_AXIS; c++ ){
+        unit_vec[c] = ( target[c] - pos[c] ) / millimeters;
+    }
+
+    // Pins that can interrupt stop the move on the step the probe touched, others are polled
+    this->touched = false;
+    bool interrupt = this->interrupt->arm();
+
+    THEKERNEL->stepper->turn_enable_pins_on();
+    for( int i = 1; i <= segments && !this->touched; i++ ){
+        float point[3];
+        for( int c = X_AXIS; c <= Z_AXIS; c++ ){
+            point[c] = pos[c] + ( target[c] - pos[c] ) * i / segments;
         }
-        // if the touchprobe is active...
+        this->probe_segment(point, millimeters / segments, unit_vec, interrupt, touch);
+    }
+    this->interrupt->disarm();
+
+    // The actuators are exactly where their steps took them, the Robot's position follows from that
+    robot->reset_position_from_actuators();
+
+    return this->touched;
+}
+
+// Plan one block in actuator space to target, wait for it to be done, and find where the probe touched if it did
+void Touchprobe::probe_segment(float target[], float millimeters, float direction[], bool interrupt, float touch[]){
+    Robot* robot = THEKERNEL->robot;
+    std::vector<StepperMotor*>& actuators = robot->actuators;
+
+    float actuator_target[MAX_ROBOT_ACTUATORS];
+    float unit_vec[MAX_ROBOT_ACTUATORS];
+    for (unsigned int i = 0; i < actuators.size(); i++) {
+        actuator_target[i] = actuators[i]->last_milestone_mm;
+        unit_vec[i] = i < 3 ? direction[i] : 0.0F;
+    }
+
+    // The actuators are where the bed mesh has them, so the probe moves the same way
+    float leveled[3] = { target[X_AXIS], target[Y_AXIS], target[Z_AXIS] };
+    if( robot->bed_mesh->active ){
+        leveled[Z_AXIS] += robot->bed_mesh->get_height(target[X_AXIS], target[Y_AXIS]);
+    }
+    robot->arm_solution->cartesian_to_actuator(leveled, actuator_target);
+
+    int32_t start[3];
+    int steps[3];
+    for( int c = X_AXIS; c <= Z_AXIS; c++ ){
+        start[c] = actuators[c]->last_milestone_steps;
+        steps[c] = actuators[c]->steps_to_target(actuator_target[c]);
+    }
+
+    unsigned int debounce = 0;
+    THEKERNEL->planner->append_block(actuator_target, this->probe_rate, millimeters, unit_vec, THEKERNEL->planner->acceleration);
+
+    while( !THEKERNEL->conveyor->queue.is_empty() ){
+        THEKERNEL->conveyor->ensure_running();
+        THEKERNEL->call_event(ON_IDLE, this);
+        if( interrupt || this->touched ){ continue; }
         if( this->pin.get() ){
-            //...increase debounce counter...
-            if( debounce < debounce_count) {
-                // ...but only if the counter hasn't reached the max. value
+            if( debounce < this->debounce_count ){
                 debounce++;
-            } else {
-                // ...otherwise stop the steppers, return its remaining steps
-                for( int i=0; i<3; i++ ){
-                    distance[i] = 0;
-                    if ( this->steppers[i]->moving ){
-                        distance[i] =  this->steppers[i]->stepped;
-                        distance[i] *= this->steppers[i]->direction ? -1 : 1;
-                        this->steppers[i]->move(0,0);
-                    }
-                }
-                return;
+            }else{
+                __disable_irq();
+                this->on_touch(0);
+                __enable_irq();
             }
         }else{
-            // The probe was not hit yet, reset debounce counter
             debounce = 0;
         }
     }
+
+    // The planner has the actuators at the target, they tell where they actually stopped, and where they touched
+    if( !this->touched ){ return; }
+    float touched_at[3];
+    for( int c = X_AXIS; c <= Z_AXIS; c++ ){
+        StepperMotor* stepper = actuators[c];
+        int32_t dir = steps[c] < 0 ? -1 : 1;
+        if( steps[c] != 0 ){
+            stepper->last_milestone_steps = start[c] + dir * (int32_t)stepper->stepped;
+            stepper->last_milestone_mm = stepper->last_milestone_steps / stepper->steps_per_mm;
+        }
+        touched_at[c] = ( start[c] + ( steps[c] != 0 ? dir * (int32_t)this->touch_steps[c] : 0 ) ) / stepper->steps_per_mm;
+    }
+
+    robot->arm_solution->actuator_to_cartesian(touched_at, touch);
+    if( robot->bed_mesh->active ){
+        touch[Z_AXIS] -= robot->bed_mesh->get_height(touch[X_AXIS], touch[Y_AXIS]);
+    }
 }
 
+// Keep a probed point for the log, which is written once the buffer is full, or after a batch of probes
+void Touchprobe::log_point(float point[]){
+    if( !this->should_log ){ return; }
+    memcpy(this->log[this->log_count++], point, sizeof(this->log[0]));
+    if( this->log_count == TOUCHPROBE_LOG_SIZE ){
+        this->flush_log();
+    }
+}
 
+// Append the logged points to the log file, as X Y Z floats, in one write
 void Touchprobe::flush_log(){
-    //FIXME *sigh* fflush doesn't work as expected, see: http://mbed.org/forum/mbed/topic/3234/ or http://mbed.org/search/?type=&q=fflush
-    //fflush(logfile);
-    fclose(logfile);
-    //can't reopen the file here -> crash
-    logfile = NULL;
+    if( this->log_count == 0 ){ return; }
+    FILE* logfile = fopen(this->filename.c_str(), "ab");
+    if( logfile == NULL ){
+        THEKERNEL->streams->printf("Error: could not open the probe log %s\r\n", this->filename.c_str());
+    }else{
+        fwrite(this->log, sizeof(this->log[0]), this->log_count, logfile);
+        fclose(logfile);
+    }
+    this->log_count = 0;
+}
+
+// Plan a move by handing the Robot a G0, as if it had been received, the next probe move waits for it
+void Touchprobe::plan_move(Gcode* gcode, float x, float y, float z){
+    Robot* robot = THEKERNEL->robot;
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "G0 X%1.4f Y%1.4f Z%1.4f", robot->from_millimeters(x), robot->from_millimeters(y), robot->from_millimeters(z));
+    Gcode move(buffer, gcode->stream);
+
+    bool absolute_mode = robot->absolute_mode;
+    robot->absolute_mode = true;
+    THEKERNEL->call_event(ON_GCODE_RECEIVED, &move);
+    robot->absolute_mode = absolute_mode;
 }
-// Workaround for the close<->reopen crash, which itself is a workaround for wrong (or unimplemented) fflush behaviour
-void Touchprobe::on_idle(void* argument){
-    if( this->logfile == NULL) {
-        // NOTE: File creation is buggy, a file may appear but writing to it will fail
-        this->logfile = fopen( filename.c_str(), "a");
+
+// G29 [I<points along X>] [J<points along Y>] : probe the configured area from mesh_height, going back and forth along X
+// The way up and over to the next point is planned as one, so only the probe moves wait for the queue
+// The heights found make the Robot's bed mesh, which is then applied and saved
+void Touchprobe::probe_mesh(Gcode* gcode){
+    Robot* robot = THEKERNEL->robot;
+    BedMesh* mesh = robot->bed_mesh;
+
+    uint8_t points_x = gcode->has_letter('I') ? gcode->get_value('I') : this->mesh_points;
+    uint8_t points_y = gcode->has_letter('J') ? gcode->get_value('J') : this->mesh_points;
+
+    robot->flush_moves();
+    THEKERNEL->conveyor->wait_for_empty_queue();
+
+    // Probe the bed as it is, not as the previous mesh has it
+    if( !mesh->resize(points_x, points_y, this->mesh_min[X_AXIS], this->mesh_min[Y_AXIS], this->mesh_max[X_AXIS], this->mesh_max[Y_AXIS]) ){
+        gcode->stream->printf("Error: bad mesh size or area\r\n");
+        return;
+    }
+
+    float pos[3];
+    robot->get_axis_position(pos);
+    if( pos[Z_AXIS] < this->mesh_height ){
+        this->plan_move(gcode, pos[X_AXIS], pos[Y_AXIS], this->mesh_height);
+    }
+
+    for( uint8_t j = 0; j < points_y; j++ ){
+        for( uint8_t n = 0; n < points_x; n++ ){
+            uint8_t i = ( j & 1 ) ? points_x - 1 - n : n;
+            this->plan_move(gcode, mesh->point_x(i), mesh->point_y(j), this->mesh_height);
+
+            float target[3] = { mesh->point_x(i), mesh->point_y(j), this->mesh_height - this->mesh_depth };
+            float touch[3];
+            if( !this->probe_move(target, touch) ){
+                gcode->stream->printf("Error: no touch at X%1.3f Y%1.3f, bed mesh off\r\n", mesh->point_x(i), mesh->point_y(j));
+                this->plan_move(gcode, mesh->point_x(i), mesh->point_y(j), this->mesh_height);
+                this->flush_log();
+                return;
+            }
+            mesh->set_height(i, j, touch[Z_AXIS]);
+            this->log_point(touch);
+            gcode->stream->printf("X%1.3f Y%1.3f Z%1.3f\r\n", touch[X_AXIS], touch[Y_AXIS], touch[Z_AXIS]);
+
+            this->plan_move(gcode, mesh->point_x(i), mesh->point_y(j), this->mesh_height);
+        }
+    }
+    this->flush_log();
+
+    mesh->active = true;
+    if( !mesh->save(robot->bed_mesh_file.c_str()) ){
+        gcode->stream->printf("Error: could not save the bed mesh to %s\r\n", robot->bed_mesh_file.c_str());
     }
 }
 
@@ -112,66 +312,42 @@ void Touchprobe::on_gcode_received(void* argument)
     Robot* robot = THEKERNEL->robot;
 
     if( gcode->has_g) {
-        if( gcode->g == 31 ) {
-            float tmp[3], pos[3], mm[3];
-            int steps[3];
-            // first wait for an empty queue i.e. no moves left
+        if( gcode->g == 29 ) {
+            gcode->mark_as_taken();
+            this->probe_mesh(gcode);
+
+        }else if( gcode->g == 31 ) {
+            // G31 X Y Z [F] : probe towards the given point, any combination of axes, the position is then where the move stopped
+            gcode->mark_as_taken();
+            robot->flush_moves();
             THEKERNEL->conveyor->wait_for_empty_queue();
 
+            float pos[3], target[3], touch[3];
             robot->get_axis_position(pos);
             for(char c = 'X'; c <= 'Z'; c++){
+                target[c-'X'] = pos[c-'X'];
                 if( gcode->has_letter(c) ){
-                    tmp[c-'X'] = robot->to_millimeters(gcode->get_value(c)) - ( robot->absolute_mode ? pos[c-'X'] : 0 );
-                }else{
-                    tmp[c-'X'] = 0;
+                    target[c-'X'] = robot->to_millimeters(gcode->get_value(c)) + ( robot->absolute_mode ? 0 : pos[c-'X'] );
                 }
             }
             if( gcode->has_letter('F') )            {
                 this->probe_rate = robot->to_millimeters( gcode->get_value('F') ) / robot->seconds_per_minute;
             }
-            robot->arm_solution->cartesian_to_actuator(tmp, mm);
-            for (int c = 0; c < 3; c++)
-                steps[c] = mm[c] * robot->actuators[c]->steps_per_mm;
 
-            if( ((abs(steps[0]) > 0 ? 1:0) + (abs(steps[1]) > 0 ? 1:0) + (abs(steps[2]) > 0 ? 1:0)) != 1 ){
-                return; //TODO coordinated movement not supported yet
-            }
-
-            // Enable the motors
-            THEKERNEL->stepper->turn_enable_pins_on();
-            // move
-            for(char c='X'; c<='Z'; c++){
-                tmp[c - 'X'] = robot->actuators[c - 'X']->steps_per_mm;
-                if( steps[c-'X'] == 0 ){
-                    continue;
-                }
-                bool dir = steps[c-'X'] < 0;
-                // tmp is steps/mm, probe_rate in mm/s -> speed needs steps/s
-                this->steppers[c-'X']->set_speed(this->probe_rate * robot->actuators[c]->steps_per_mm);
-                this->steppers[c-'X']->move(dir,abs(steps[c-'X']));
-            }
-
-            wait_for_touch(steps);
-            // calculate new position
-            for(char c='X'; c<='Z'; c++){
-                robot->reset_axis_position(pos[c-'X'] + mm[c-'X'], c-'X');
-            }
-
-            if( this->should_log ){
-                robot->get_axis_position(pos);
-                fprintf(logfile,"%1.3f %1.3f %1.3f\n", robot->from_millimeters(pos[0]), robot->from_millimeters(pos[1]), robot->from_millimeters(pos[2]) );
-                flush_log();
+            if( this->probe_move(target, touch) ){
+                gcode->stream->printf("X%1.3f Y%1.3f Z%1.3f\r\n", robot->from_millimeters(touch[X_AXIS]), robot->from_millimeters(touch[Y_AXIS]), robot->from_millimeters(touch[Z_AXIS]));
+                this->log_point(touch);
+            }else{
+                gcode->stream->printf("Error: no touch\r\n");
             }
         }
     }else if(gcode->has_m) {
-        // log rotation
-        // for now this only writes a separator
+        // log rotation : write what is buffered, then a record of NaNs as a separator
         // TODO do a actual log rotation
         if( this->mcode != 0 && this->should_log && gcode->m == this->mcode){
-            string name;
-            fputs("--\n",logfile);
-            flush_log();
+            float separator[3] = { NAN, NAN, NAN };
+            this->log_point(separator);
+            this->flush_log();
         }
     }
 }
-
@@ -9,23 +9,52 @@
 #define TOUCHPROBE_H_
 
 #include "libs/Module.h"
+#include "libs/Pin.h"
+
+#include <stdio.h>
+#include <string>
+using std::string;
+
+#define TOUCHPROBE_LOG_SIZE 64  // Probed points kept in memory before they are written to the log file
+#define TOUCHPROBE_SEGMENT_MM 1.0F // Longest move across XY made as one block on deltas, which are not straight in actuator space
+
+class StepperMotor;
+class Gcode;
+class PinInterrupt;
 
 class Touchprobe: public Module {
     private:
-        void wait_for_touch(int distance[]);
+        bool probe_move(float target[], float touch[]);
+        void probe_segment(float target[], float millimeters, float direction[], bool interrupt, float touch[]);
+        uint32_t on_touch(uint32_t dummy);
+        void plan_move(Gcode* gcode, float x, float y, float z);
+        void probe_mesh(Gcode* gcode);
+        void log_point(float point[]);
         void flush_log();
 
-        FILE*          logfile;
         string         filename;
         StepperMotor*  steppers[3];
         Pin            pin;
         unsigned int   debounce_count;
+        PinInterrupt*  interrupt;       // Stops the probe move on the step the probe touched, if the pin can interrupt
+        volatile uint32_t touch_steps[3]; // Steps each stepper made into the probe move when it touched
+        volatile bool  touched;
+
+        // Probed points waiting to be written to the log, as X Y Z floats
+        float          log[TOUCHPROBE_LOG_SIZE][3];
+        uint8_t        log_count;
+
+        // G29 grid
+        float          mesh_min[2];
+        float          mesh_max[2];
+        uint8_t        mesh_points;
+        float          mesh_height;
+        float          mesh_depth;
 
     public:
         void on_module_loaded();
         void on_config_reload(void* argument);
         void on_gcode_received(void* argument);
-        void on_idle(void* argument);
 
         float         probe_rate;
         unsigned int   mcode;
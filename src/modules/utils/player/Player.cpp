@@ -21,6 +21,7 @@
 #include "ConfigValue.h"
 
 #include "modules/robot/Conveyor.h"
+#include "modules/robot/Robot.h"
 #include "DirHandle.h"
 #include "PublicDataRequest.h"
 #include "PlayerPublicAccess.h"
@@ -306,7 +307,8 @@ void Player::on_main_loop(void *argument)
         }
     }
 
-    if( this->playing_file ) {
+    // Don't feed the next line until the current move is fully cut into segments
+    if( this->playing_file && !THEKERNEL->robot->is_segmenting() ) {
         char buf[130]; // lines upto 128 characters are allowed, anything longer is discarded
         bool discard = false;
 